@@ -0,0 +1,184 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_ARENA_HPP_
+#define INCLUDE_ARENA_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <metrics.hpp>
+
+namespace alpaca {
+
+struct arena_metrics_t {
+  counter_t scopes{0};
+  counter_t allocations{0};       // carved out of a thread's block
+  counter_t heap_allocations{0};  // outside any scope
+  counter_t overflows{0};         // inside a scope with the block used up
+  std::atomic<std::uint64_t> high_water{0};
+
+  static arena_metrics_t& instance() {
+    static arena_metrics_t metrics;
+    return metrics;
+  }
+};
+
+// Bump allocator of one thread. While a request_scope is open on the thread
+// json values and errors are carved out of the thread's block, and the
+// whole block is handed back when the outermost scope closes, so a request
+// does not go through malloc for them. Outside a scope, or once the block
+// is used up, they come from the heap as usual.
+//
+// Memory taken inside a scope must not outlive it nor be freed by another
+// thread, request handlers only build values they serialize before
+// returning.
+class request_arena {
+ public:
+  constexpr static std::size_t capacity = 64 * 1024;
+
+ private:
+  std::unique_ptr<std::byte[]> block;
+  std::size_t used = 0;
+  std::size_t high_water = 0;
+  int depth = 0;
+
+  // flushed to arena_metrics_t when a scope closes
+  std::uint64_t allocations = 0;
+  std::uint64_t overflows = 0;
+
+  [[nodiscard]] bool owns(const void* p) const {
+    const std::byte* bytes = static_cast<const std::byte*>(p);
+    return block != nullptr && bytes >= block.get() && bytes < block.get() + capacity;
+  }
+
+  void flush() {
+    arena_metrics_t& metrics = arena_metrics_t::instance();
+
+    metrics.scopes.fetch_add(1, std::memory_order_relaxed);
+    metrics.allocations.fetch_add(allocations, std::memory_order_relaxed);
+    metrics.overflows.fetch_add(overflows, std::memory_order_relaxed);
+
+    std::uint64_t seen = metrics.high_water.load(std::memory_order_relaxed);
+    while (seen < high_water &&
+           !metrics.high_water.compare_exchange_weak(seen, high_water, std::memory_order_relaxed)) { }
+
+    allocations = 0;
+    overflows = 0;
+  }
+
+ public:
+  static request_arena& local() {
+    thread_local request_arena arena;
+    return arena;
+  }
+
+  [[nodiscard]] void* allocate(std::size_t size, std::size_t alignment) {
+    if (depth > 0) {
+      const std::size_t offset = (used + alignment - 1) & ~(alignment - 1);
+
+      if (offset + size <= capacity) {
+        used = offset + size;
+        high_water = std::max(high_water, used);
+        allocations++;
+        return block.get() + offset;
+      }
+
+      overflows++;
+    } else {
+      arena_metrics_t::instance().heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      return ::operator new(size, std::align_val_t{alignment});
+
+    return ::operator new(size);
+  }
+
+  void deallocate(void* p, std::size_t size, std::size_t alignment) {
+    if (!owns(p)) {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        ::operator delete(p, size, std::align_val_t{alignment});
+      else
+        ::operator delete(p, size);
+      return;
+    }
+
+    // the last allocation can be taken back, a string or vector that grows
+    // in place reuses its old bytes
+    std::byte* bytes = static_cast<std::byte*>(p);
+    if (depth > 0 && bytes + size == block.get() + used)
+      used = static_cast<std::size_t>(bytes - block.get());
+  }
+
+  void enter() {
+    if (block == nullptr)
+      block = std::make_unique<std::byte[]>(capacity);
+
+    depth++;
+  }
+
+  void leave() {
+    if (--depth > 0) return;
+
+    used = 0;
+    flush();
+  }
+};
+
+// Routes allocations to the arena of the calling thread. Stateless, so
+// containers built inside and outside a scope still swap and compare equal.
+template<typename T>
+struct arena_allocator {
+  using value_type = T;
+
+  arena_allocator() = default;
+
+  template<typename U>
+  arena_allocator(const arena_allocator<U>&) noexcept { }
+
+  [[nodiscard]] T* allocate(std::size_t n) {
+    return static_cast<T*>(request_arena::local().allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) noexcept {
+    request_arena::local().deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  template<typename U>
+  friend bool operator==(const arena_allocator&, const arena_allocator<U>&) noexcept {
+    return true;
+  }
+};
+
+using arena_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+// the arena of the thread handling a request, reset when it closes
+class request_scope {
+  request_arena& arena;
+
+ public:
+  request_scope()
+  : arena(request_arena::local()) {
+    arena.enter();
+  }
+
+  ~request_scope() {
+    arena.leave();
+  }
+
+  request_scope(const request_scope&) = delete;
+  request_scope& operator=(const request_scope&) = delete;
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_ARENA_HPP_
@@ -3,10 +3,13 @@
 #ifndef INCLUDE_ASTRONOMY_HPP_
 #define INCLUDE_ASTRONOMY_HPP_
 
+#include <algorithm>
 #include <iostream>
 #include <cstdint>
 #include <cmath>
+#include <span>
 
+#include <simd.hpp>
 #include <time.hpp>
 
 namespace alpaca {
@@ -17,12 +20,16 @@ struct dms_t {
   int minute;
   int second;
 
+  // kept apart from degree, angles in (-1, 0) degrees have a degree of 0
+  bool negative = false;
+
   dms_t() = default;
 
   constexpr dms_t(int degree, int minute, int second)
   : degree(degree)
   , minute(minute)
   , second(second)
+  , negative(degree < 0)
   { }
 
   constexpr dms_t(float angle) {
@@ -32,6 +39,7 @@ struct dms_t {
       ? static_cast<int>(angle * 3600 + 0.5f)
       : static_cast<int>(angle * 3600 - 0.5f);
 
+    negative = angle_secs < 0;
     degree = angle_secs / 3600;
 
     int secs = std::abs(angle_secs) % 3600;
@@ -40,17 +48,28 @@ struct dms_t {
   }
 
   constexpr float to_decimal() const {
-    float fraction = minute/60.0f + second/3600.0f;
-    return degree < 0 ? degree - fraction : degree + fraction;
+    float value = std::abs(degree) + minute/60.0f + second/3600.0f;
+    return negative ? -value : value;
   }
 };
 
-constexpr float static to_gmst(jdate_t jdate) {
-  double JD = jdate.julian_day();
-  float diff = JD - 2451545.0f;
-  float T = diff / 36525.0f;
-  float theta0 = 280.46061837f + 360.98564736629f * diff + (0.000387933f * T * T) - (T * T * T / 38710000.0f);
-  float angle = std::fmod(theta0, 360.0);
+// 360.98564736629 degrees per day, Meeus 12.4
+constexpr double sidereal_degrees_per_micro = 360.98564736629 / jdate_t::days_to_micros;
+
+// Days since J2000.0 in double, from the integer micros. Julian days as a
+// float have a resolution of minutes, which is degrees of sidereal time.
+constexpr double days_since_j2000(jdate_t jdate) {
+  constexpr std::uint64_t j2000_micros = 2451545ull * jdate_t::days_to_micros;
+
+  return static_cast<double>(static_cast<std::int64_t>(jdate.micros - j2000_micros))
+    / jdate_t::days_to_micros;
+}
+
+constexpr double to_gmst_precise(jdate_t jdate) {
+  double diff = days_since_j2000(jdate);
+  double T = diff / 36525.0;
+  double theta0 = 280.46061837 + 360.98564736629 * diff + (0.000387933 * T * T) - (T * T * T / 38710000.0);
+  double angle = std::fmod(theta0, 360.0);
 
   if (angle < 0.0)
     angle += 360.0;
@@ -58,6 +77,10 @@ constexpr float static to_gmst(jdate_t jdate) {
   return angle;
 }
 
+constexpr float static to_gmst(jdate_t jdate) {
+  return static_cast<float>(to_gmst_precise(jdate));
+}
+
 constexpr float to_gmst(utcdate_t utc) {
   return to_gmst(jdate_t::from_utc(utc));
 }
@@ -70,71 +93,275 @@ constexpr float to_lst(utcdate_t utc, float longitude) {
   return to_lst(jdate_t::from_utc(utc), longitude);
 }
 
-void ra_de_to_azm_alt(
-  utcdate_t now,
-  float ra, float de,
-  float lat, float lon,
-  float* azm, float* alt) {
+namespace detail {
+
+// Runs `kernel` over full vectors and once more over a zero padded copy of
+// the tail, so callers with a single point still take the vector path.
+template<typename Kernel>
+void for_each_block(
+  std::span<const float> in0, std::span<const float> in1,
+  std::span<float> out0, std::span<float> out1,
+  Kernel&& kernel) {
+  constexpr std::size_t width = simd::float_v::width;
+
+  const std::size_t count = std::min({ in0.size(), in1.size(), out0.size(), out1.size() });
+
+  std::size_t i = 0;
+  for (; i + width <= count; i += width)
+    kernel(in0.data() + i, in1.data() + i, out0.data() + i, out1.data() + i);
+
+  if (i == count) return;
+
+  float tail_in0[width] = {};
+  float tail_in1[width] = {};
+  float tail_out0[width];
+  float tail_out1[width];
+
+  std::copy(in0.begin() + i, in0.begin() + count, tail_in0);
+  std::copy(in1.begin() + i, in1.begin() + count, tail_in1);
 
-  float lstRA = to_lst(now, lon);
+  kernel(tail_in0, tail_in1, tail_out0, tail_out1);
 
-  float ha = lstRA - ra;
+  std::copy(tail_out0, tail_out0 + (count - i), out0.begin() + i);
+  std::copy(tail_out1, tail_out1 + (count - i), out1.begin() + i);
+}
+
+static inline simd::float_v wrap_360(simd::float_v angle) {
+  using simd::float_v;
+  return angle - float_v::broadcast(360.0f) * simd::floor(angle * float_v::broadcast(1.0f / 360.0f));
+}
 
-  if (ha < 0) ha += 360.0f;
+}  // namespace detail
 
-//sin(ALT) = sin(DEC)*sin(LAT) + cos(DEC)*cos(LAT)*cos(HA)
+// A site with its trigonometry cached and sidereal time kept as an
+// anchor: GMST is evaluated in double once, then advanced with a single
+// multiply-add over the elapsed micros. refresh() renews the anchor from
+// the wall clock every hour, so clock corrections are picked up.
 //
-//ALT = asin(ALT) 
+// Not synchronized, owners that share one guard it themselves.
+class observer_t {
+  constexpr static std::int64_t anchor_lifetime_micros = 3600ll * 1000000;
+
+  struct anchor_t {
+    utcdate_t utc;
+    monotonic_t monotonic;
+    double gmst;  // degrees, at utc
+  };
+
+  float latitude;
+  float longitude;
+  float sin_lat;
+  float cos_lat;
+  anchor_t anchor;
+
+  static float wrap_360(double angle) {
+    angle = std::fmod(angle, 360.0);
+    return static_cast<float>(angle < 0.0 ? angle + 360.0 : angle);
+  }
+
+ public:
+  observer_t(float latitude, float longitude)
+  : observer_t(latitude, longitude, utcdate_t::now(), monotonic_t::now()) { }
+
+  observer_t(float latitude, float longitude, utcdate_t utc, monotonic_t monotonic)
+  : latitude(latitude)
+  , longitude(longitude)
+  , sin_lat(std::sin(latitude * static_cast<float>(M_PI / 180.0)))
+  , cos_lat(std::cos(latitude * static_cast<float>(M_PI / 180.0))) {
+    reanchor(utc, monotonic);
+  }
+
+  void reanchor(utcdate_t utc, monotonic_t monotonic) {
+    anchor = { utc, monotonic, to_gmst_precise(jdate_t::from_utc(utc)) };
+  }
+
+  // true when the anchor was renewed
+  bool refresh(monotonic_t now = monotonic_t::now()) {
+    if (now - anchor.monotonic < anchor_lifetime_micros) return false;
+
+    reanchor(utcdate_t::now(), now);
+    return true;
+  }
+
+  // same, for a clock other than the wall clock
+  bool refresh(utcdate_t utc, monotonic_t now) {
+    if (now - anchor.monotonic < anchor_lifetime_micros) return false;
+
+    reanchor(utc, now);
+    return true;
+  }
+
+  [[nodiscard]] float get_latitude() const { return latitude; }
+  [[nodiscard]] float get_longitude() const { return longitude; }
+  [[nodiscard]] float get_sin_latitude() const { return sin_lat; }
+  [[nodiscard]] float get_cos_latitude() const { return cos_lat; }
+
+  // local sidereal time in [0, 360)
+  [[nodiscard]] float lst(utcdate_t utc) const {
+    return wrap_360(anchor.gmst + sidereal_degrees_per_micro * static_cast<double>(utc - anchor.utc) + longitude);
+  }
+
+  [[nodiscard]] float lst(monotonic_t now = monotonic_t::now()) const {
+    return wrap_360(anchor.gmst + sidereal_degrees_per_micro * static_cast<double>(now - anchor.monotonic) + longitude);
+  }
+};
+
+// Batched conversions over SoA buffers, all angles in degrees. The site
+// trigonometry comes from the observer and `local_sidereal_time` is shared
+// by every point, the spans are processed up to the shortest of them.
 //
-//               sin(DEC) - sin(ALT)*sin(LAT)
-//cos(A)   =   ---------------------------------
-//                   cos(ALT)*cos(LAT)
+// The textbook form recovers azimuth with acos(cos(A)), float loses a
+// minute of arc near the meridian that way. Both components are kept
+// instead:
 //
-//A = acos(A)
+//   sin(ALT)        = sin(DEC)*sin(LAT) + cos(DEC)*cos(LAT)*cos(HA)
+//   cos(ALT)*sin(A) = -cos(DEC)*sin(HA)
+//   cos(ALT)*cos(A) = sin(DEC)*cos(LAT) - cos(DEC)*sin(LAT)*cos(HA)
 //
-//If sin(HA) is negative, then AZ = A, otherwise
-//AZ = 360 - A
+// and the inverse swaps (DEC, HA) with (ALT, AZ).
+static inline void ra_de_to_azm_alt(
+  const observer_t& observer, float local_sidereal_time,
+  std::span<const float> ra, std::span<const float> de,
+  std::span<float> azm, std::span<float> alt) {
+  using simd::float_v;
+
+  const float_v lst = float_v::broadcast(local_sidereal_time);
+  const float_v sin_lat = float_v::broadcast(observer.get_sin_latitude());
+  const float_v cos_lat = float_v::broadcast(observer.get_cos_latitude());
+
+  detail::for_each_block(ra, de, azm, alt, [&](const float* ra_block, const float* de_block, float* azm_block, float* alt_block) {
+    float_v sin_ha, cos_ha, sin_de, cos_de;
+    simd::sincos_deg(lst - float_v::load(ra_block), &sin_ha, &cos_ha);
+    simd::sincos_deg(float_v::load(de_block), &sin_de, &cos_de);
+
+    const float_v cos_alt_sin_a = -(cos_de * sin_ha);
+    const float_v cos_alt_cos_a = sin_de * cos_lat - cos_de * sin_lat * cos_ha;
+    const float_v sin_alt = simd::fma(cos_de * cos_lat, cos_ha, sin_de * sin_lat);
+    const float_v cos_alt = simd::sqrt(simd::fma(cos_alt_sin_a, cos_alt_sin_a, cos_alt_cos_a * cos_alt_cos_a));
+
+    detail::wrap_360(simd::atan2_deg(cos_alt_sin_a, cos_alt_cos_a)).store(azm_block);
+    simd::atan2_deg(sin_alt, cos_alt).store(alt_block);
+  });
+}
+
+static inline void azm_alt_to_ra_de(
+  const observer_t& observer, float local_sidereal_time,
+  std::span<const float> azm, std::span<const float> alt,
+  std::span<float> ra, std::span<float> de) {
+  using simd::float_v;
+
+  const float_v lst = float_v::broadcast(local_sidereal_time);
+  const float_v sin_lat = float_v::broadcast(observer.get_sin_latitude());
+  const float_v cos_lat = float_v::broadcast(observer.get_cos_latitude());
+
+  detail::for_each_block(azm, alt, ra, de, [&](const float* azm_block, const float* alt_block, float* ra_block, float* de_block) {
+    float_v sin_azm, cos_azm, sin_alt, cos_alt;
+    simd::sincos_deg(float_v::load(azm_block), &sin_azm, &cos_azm);
+    simd::sincos_deg(float_v::load(alt_block), &sin_alt, &cos_alt);
+
+    const float_v cos_de_sin_ha = -(cos_alt * sin_azm);
+    const float_v cos_de_cos_ha = sin_alt * cos_lat - cos_alt * sin_lat * cos_azm;
+    const float_v sin_de = simd::fma(cos_alt * cos_lat, cos_azm, sin_alt * sin_lat);
+    const float_v cos_de = simd::sqrt(simd::fma(cos_de_sin_ha, cos_de_sin_ha, cos_de_cos_ha * cos_de_cos_ha));
+
+    detail::wrap_360(lst - simd::atan2_deg(cos_de_sin_ha, cos_de_cos_ha)).store(ra_block);
+    simd::atan2_deg(sin_de, cos_de).store(de_block);
+  });
+}
 
-  float k = M_PI / 180.0f;
+static inline void ra_de_to_azm_alt(
+  const observer_t& observer, utcdate_t now,
+  std::span<const float> ra, std::span<const float> de,
+  std::span<float> azm, std::span<float> alt) {
+  ra_de_to_azm_alt(observer, observer.lst(now), ra, de, azm, alt);
+}
 
-  float sin_alt = std::sin(de*k)*std::sin(lat*k) + std::cos(de*k)*std::cos(lat*k)*std::cos(ha*k);
-  *alt = std::asin(sin_alt);
+static inline void azm_alt_to_ra_de(
+  const observer_t& observer, utcdate_t now,
+  std::span<const float> azm, std::span<const float> alt,
+  std::span<float> ra, std::span<float> de) {
+  azm_alt_to_ra_de(observer, observer.lst(now), azm, alt, ra, de);
+}
 
-  float cos_azm = (std::sin(de*k) - sin_alt*std::sin(lat*k)) / (std::cos(*alt)*std::cos(lat*k));
-  *azm = std::acos(cos_azm);
+static inline void ra_de_to_azm_alt(
+  const observer_t& observer, float local_sidereal_time,
+  float ra, float de,
+  float* azm, float* alt) {
+  // padded to a full vector, a single point goes straight to the tail
+  float in0[simd::float_v::width] = { ra };
+  float in1[simd::float_v::width] = { de };
 
-  if (std::sin(ha*k) > 0)
-    *azm = 2*M_PI - *azm;
+  ra_de_to_azm_alt(observer, local_sidereal_time, {in0, 1}, {in1, 1}, {azm, 1}, {alt, 1});
 }
 
-void azm_alt_to_ra_de(
-  utcdate_t now,
+static inline void azm_alt_to_ra_de(
+  const observer_t& observer, float local_sidereal_time,
   float azm, float alt,
-  float lat, float lon,
   float* ra, float* de) {
+  float in0[simd::float_v::width] = { azm };
+  float in1[simd::float_v::width] = { alt };
 
-  float k = M_PI / 180.0f;
-  float k2 = 180.0f / M_PI;
+  azm_alt_to_ra_de(observer, local_sidereal_time, {in0, 1}, {in1, 1}, {ra, 1}, {de, 1});
+}
 
-  float lstRA = to_lst(now, lon);
+static inline void ra_de_to_azm_alt(
+  const observer_t& observer,
+  float ra, float de,
+  float* azm, float* alt) {
+  ra_de_to_azm_alt(observer, observer.lst(), ra, de, azm, alt);
+}
 
-  float sin_de = std::sin(alt*k)*std::sin(lat*k) + std::cos(alt*k)*std::cos(lat*k)*std::cos(azm*k);
-  *de = std::asin(sin_de);
+static inline void azm_alt_to_ra_de(
+  const observer_t& observer,
+  float azm, float alt,
+  float* ra, float* de) {
+  azm_alt_to_ra_de(observer, observer.lst(), azm, alt, ra, de);
+}
 
-  float cos_ha = (std::sin(alt*k) - sin_de*std::sin(lat*k)) / (std::cos(*de)*std::cos(lat*k));
-  float ha = std::acos(cos_ha)*k2;
+// raw site angles, anchors a throwaway observer at `now`
+static inline void ra_de_to_azm_alt(
+  utcdate_t now,
+  std::span<const float> ra, std::span<const float> de,
+  float lat, float lon,
+  std::span<float> azm, std::span<float> alt) {
+  ra_de_to_azm_alt(observer_t(lat, lon, now, monotonic_t::now()), now, ra, de, azm, alt);
+}
+
+static inline void azm_alt_to_ra_de(
+  utcdate_t now,
+  std::span<const float> azm, std::span<const float> alt,
+  float lat, float lon,
+  std::span<float> ra, std::span<float> de) {
+  azm_alt_to_ra_de(observer_t(lat, lon, now, monotonic_t::now()), now, azm, alt, ra, de);
+}
+
+static inline void ra_de_to_azm_alt(
+  utcdate_t now,
+  float ra, float de,
+  float lat, float lon,
+  float* azm, float* alt) {
+  float in0[simd::float_v::width] = { ra };
+  float in1[simd::float_v::width] = { de };
+
+  ra_de_to_azm_alt(now, {in0, 1}, {in1, 1}, lat, lon, {azm, 1}, {alt, 1});
+}
 
-  //if (std::sin(azm*k) < 0)
-  //  ha += M_PI;
+static inline void azm_alt_to_ra_de(
+  utcdate_t now,
+  float azm, float alt,
+  float lat, float lon,
+  float* ra, float* de) {
+  float in0[simd::float_v::width] = { azm };
+  float in1[simd::float_v::width] = { alt };
 
-  *ra = lstRA - ha;
+  azm_alt_to_ra_de(now, {in0, 1}, {in1, 1}, lat, lon, {ra, 1}, {de, 1});
 }
 
 }  // namespace astronomy
 }  // namespace alpaca
 
 static inline std::ostream& operator<<(std::ostream& os, const alpaca::astronomy::dms_t& dms) {
-  os << dms.degree << " " << dms.minute << "' " << dms.second << "\"";
+  os << (dms.negative && dms.degree == 0 ? "-" : "") << dms.degree << " " << dms.minute << "' " << dms.second << "\"";
   return os;
 }
 
@@ -0,0 +1,84 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_BUDGET_HPP_
+#define INCLUDE_BUDGET_HPP_
+
+#include <atomic>
+#include <limits>
+
+namespace alpaca {
+
+// Responses that keep blocking an http worker after render returned,
+// telemetry streams and deferred replies. A pool worker blocked in one
+// stalls every connection it multiplexes, so pool mode caps them and leaves
+// workers to the other requests.
+class blocking_budget_t {
+  std::atomic<int> used{0};
+  std::atomic<int> limit{std::numeric_limits<int>::max()};
+
+ public:
+  void set_limit(int limit) {
+    this->limit.store(limit, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] int get_used() const {
+    return used.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] bool acquire() {
+    if (used.fetch_add(1, std::memory_order_relaxed) >= limit.load(std::memory_order_relaxed)) {
+      used.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    return true;
+  }
+
+  void release() {
+    used.fetch_sub(1, std::memory_order_relaxed);
+  }
+};
+
+// one place in a blocking_budget_t, given back with the response holding it
+class blocking_slot_t {
+  blocking_budget_t* budget = nullptr;
+  bool acquired = false;
+
+ public:
+  blocking_slot_t() = default;
+
+  // a slot in `budget`, empty when it is used up. nullptr has no limit.
+  explicit blocking_slot_t(blocking_budget_t* budget)
+  : budget(budget) {
+    acquired = budget == nullptr || budget->acquire();
+    if (!acquired) this->budget = nullptr;
+  }
+
+  ~blocking_slot_t() {
+    if (budget != nullptr) budget->release();
+  }
+
+  blocking_slot_t(blocking_slot_t&& other) noexcept
+  : budget(other.budget)
+  , acquired(other.acquired) {
+    other.budget = nullptr;
+  }
+
+  blocking_slot_t& operator=(blocking_slot_t&& other) noexcept {
+    if (this != &other) {
+      if (budget != nullptr) budget->release();
+      budget = other.budget;
+      acquired = other.acquired;
+      other.budget = nullptr;
+    }
+    return *this;
+  }
+
+  [[nodiscard]] explicit operator bool() const {
+    return acquired;
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_BUDGET_HPP_
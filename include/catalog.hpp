@@ -0,0 +1,413 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_CATALOG_HPP_
+#define INCLUDE_CATALOG_HPP_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <astronomy.hpp>
+
+namespace alpaca {
+
+// On disk, little endian, everything 4 byte aligned:
+//
+//   catalog_header_t
+//   std::uint32_t band_start[band_count + 1]  first record of each band
+//   catalog_record_t records[object_count]    by band, then right ascension
+//   char names[names_size]                    nul terminated
+//
+// Bands split declination [-90, 90] in equal slices, records inside a band
+// are sorted by right ascension so an hour angle window is a binary search.
+struct catalog_header_t {
+  constexpr static char expected_magic[8] = { 'A', 'L', 'P', 'C', 'A', 'T', '\0', '\0' };
+  constexpr static std::uint32_t current_version = 1;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t band_count;
+  std::uint32_t object_count;
+  std::uint32_t names_size;
+};
+
+struct catalog_record_t {
+  float rightascension;  // degrees
+  float declination;
+  float magnitude;
+  std::uint32_t name_offset;
+};
+
+static_assert(sizeof(catalog_header_t) == 24);
+static_assert(sizeof(catalog_record_t) == 16);
+
+struct visible_object_t {
+  std::uint32_t index;
+  float azimuth;
+  float altitude;
+};
+
+struct catalog_query_t {
+  float min_altitude = 0;
+  float max_magnitude = 99;
+  std::size_t max_count = 1000;
+};
+
+struct catalog_stats_t {
+  std::uint32_t bands = 0;       // bands that could reach min_altitude
+  std::uint32_t candidates = 0;  // records that went through the transform
+};
+
+// Read-only view over a mapped catalog file. Opening validates the layout
+// once, queries afterwards only touch the pages of the bands they need.
+class catalog {
+  constexpr static float window_margin = 0.05f;  // degrees
+
+  void* mapping = MAP_FAILED;
+  std::size_t mapping_size = 0;
+
+  const catalog_header_t* header = nullptr;
+  std::span<const std::uint32_t> band_start;
+  std::span<const catalog_record_t> records;
+  std::string_view names;
+
+  [[nodiscard]] float band_height() const {
+    return 180.0f / static_cast<float>(header->band_count);
+  }
+
+  [[nodiscard]] bool validate(std::size_t size) {
+    if (size < sizeof(catalog_header_t)) return false;
+
+    const char* base = static_cast<const char*>(mapping);
+    header = static_cast<const catalog_header_t*>(mapping);
+
+    if (std::memcmp(header->magic, catalog_header_t::expected_magic, sizeof(header->magic)) != 0)
+      return false;
+    if (header->version != catalog_header_t::current_version)
+      return false;
+    if (header->band_count == 0 || header->band_count > 180 * 60)
+      return false;
+
+    const std::size_t bands_offset = sizeof(catalog_header_t);
+    const std::size_t records_offset = bands_offset + (header->band_count + std::size_t{1}) * sizeof(std::uint32_t);
+    const std::size_t names_offset = records_offset + std::size_t{header->object_count} * sizeof(catalog_record_t);
+
+    if (names_offset + header->names_size != size)
+      return false;
+
+    band_start = { static_cast<const std::uint32_t*>(static_cast<const void*>(base + bands_offset)),
+                   header->band_count + std::size_t{1} };
+    records = { static_cast<const catalog_record_t*>(static_cast<const void*>(base + records_offset)),
+                header->object_count };
+    names = { base + names_offset, header->names_size };
+
+    if (band_start.front() != 0 || band_start.back() != header->object_count)
+      return false;
+
+    if (!std::is_sorted(band_start.begin(), band_start.end()))
+      return false;
+
+    // name offsets are checked on use, looking at every record here would
+    // page in the whole file
+    if (!names.empty() && names.back() != '\0')
+      return false;
+
+    return true;
+  }
+
+  // widest hour angle in degrees at which some declination of the band
+  // still reaches `min_altitude`, 180 when the whole circle qualifies and
+  // negative when nothing in the band does
+  [[nodiscard]] static float max_hour_angle(
+    const astronomy::observer_t& observer, float min_altitude, float de_low, float de_high) {
+    constexpr float k = static_cast<float>(M_PI / 180.0);
+
+    const float sin_h0 = std::sin(min_altitude * k);
+    const float sin_lat = observer.get_sin_latitude();
+    const float cos_lat = observer.get_cos_latitude();
+
+    // cos(HA) >= (sin(h0) - sin(de)*sin(lat)) / (cos(de)*cos(lat)), its
+    // extremes are at the band edges or where sin(de) = sin(lat)/sin(h0)
+    auto limit = [&](float de) {
+      const float denominator = std::cos(de * k) * cos_lat;
+      if (denominator <= 1e-6f)
+        return sin_h0 <= std::sin(de * k) * sin_lat ? -1.0f : 1.0f + 1e-6f;
+      return (sin_h0 - std::sin(de * k) * sin_lat) / denominator;
+    };
+
+    float lowest = std::min(limit(de_low), limit(de_high));
+
+    if (std::abs(sin_h0) > 1e-6f) {
+      float ratio = sin_lat / sin_h0;
+      if (ratio >= -1.0f && ratio <= 1.0f) {
+        float de_extreme = std::asin(ratio) / k;
+        if (de_extreme > de_low && de_extreme < de_high)
+          lowest = std::min(lowest, limit(de_extreme));
+      }
+    }
+
+    if (lowest > 1.0f + 1e-4f) return -1.0f;
+    if (lowest <= -1.0f) return 180.0f;
+
+    // widened so float rounding never drops what the transform would keep
+    return std::acos(std::min(lowest, 1.0f)) / k + window_margin;
+  }
+
+  // first record of [begin, end) with right ascension >= ra
+  [[nodiscard]] std::uint32_t lower_bound(std::uint32_t begin, std::uint32_t end, float ra) const {
+    auto first = records.begin() + begin;
+    auto last = records.begin() + end;
+
+    auto it = std::lower_bound(first, last, ra, [](const catalog_record_t& record, float value) {
+      return record.rightascension < value;
+    });
+
+    return static_cast<std::uint32_t>(it - records.begin());
+  }
+
+ public:
+  catalog() { }
+
+  catalog(const catalog&) = delete;
+  catalog& operator=(const catalog&) = delete;
+
+  ~catalog() {
+    close();
+  }
+
+  [[nodiscard]] bool open(const char* path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      ::close(fd);
+      return false;
+    }
+
+    mapping_size = static_cast<std::size_t>(st.st_size);
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED || !validate(mapping_size)) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (mapping != MAP_FAILED)
+      munmap(mapping, mapping_size);
+
+    mapping = MAP_FAILED;
+    mapping_size = 0;
+    header = nullptr;
+    band_start = {};
+    records = {};
+    names = {};
+  }
+
+  [[nodiscard]] bool is_open() const {
+    return header != nullptr;
+  }
+
+  [[nodiscard]] std::size_t size() const {
+    return records.size();
+  }
+
+  [[nodiscard]] const catalog_record_t& at(std::uint32_t index) const {
+    return records[index];
+  }
+
+  [[nodiscard]] std::string_view name(std::uint32_t index) const {
+    std::uint32_t offset = records[index].name_offset;
+    if (offset >= names.size()) return {};
+
+    // the blob ends with a nul, validated when opening
+    return names.data() + offset;
+  }
+
+  // Objects at or above `query.min_altitude` for the observer at local
+  // sidereal time `lst` (degrees). Bands that never rise that high are
+  // skipped, the others only contribute the right ascension window whose
+  // hour angle can reach it. Appends to `out` in catalog order.
+  catalog_stats_t visible(
+    const astronomy::observer_t& observer, float lst,
+    const catalog_query_t& query, std::vector<visible_object_t>* out) const {
+    catalog_stats_t stats;
+
+    if (!is_open()) return stats;
+
+    thread_local std::vector<std::uint32_t> index;
+    thread_local std::vector<float> ra, de, azm, alt;
+
+    const float height = band_height();
+
+    // a declination can only culminate above min_altitude within this reach of the latitude
+    const float reach = 90.0f - query.min_altitude + window_margin;
+    const float lat = observer.get_latitude();
+
+    for (std::uint32_t band = 0; band < header->band_count; band++) {
+      const float de_low = -90.0f + static_cast<float>(band) * height;
+      const float de_high = de_low + height;
+
+      if (de_high < lat - reach || de_low > lat + reach) continue;
+
+      const std::uint32_t begin = band_start[band];
+      const std::uint32_t end = band_start[band + 1];
+      if (begin == end) continue;
+
+      const float hour_angle = max_hour_angle(observer, query.min_altitude, de_low, de_high);
+      if (hour_angle < 0.0f) continue;
+
+      stats.bands++;
+
+      index.clear();
+      ra.clear();
+      de.clear();
+
+      auto collect = [&](std::uint32_t first, std::uint32_t last) {
+        for (std::uint32_t i = first; i < last; i++) {
+          const catalog_record_t& record = records[i];
+          if (record.magnitude > query.max_magnitude) continue;
+
+          index.push_back(i);
+          ra.push_back(record.rightascension);
+          de.push_back(record.declination);
+        }
+      };
+
+      if (hour_angle >= 180.0f) {
+        collect(begin, end);
+      } else {
+        // hour angle = lst - ra, so the window is ra in [lst - H, lst + H]
+        float from = lst - hour_angle;
+        float to = lst + hour_angle;
+
+        from -= 360.0f * std::floor(from / 360.0f);
+        to -= 360.0f * std::floor(to / 360.0f);
+
+        if (from <= to) {
+          collect(lower_bound(begin, end, from), lower_bound(begin, end, to));
+        } else {
+          collect(lower_bound(begin, end, from), end);
+          collect(begin, lower_bound(begin, end, to));
+        }
+      }
+
+      if (index.empty()) continue;
+
+      stats.candidates += static_cast<std::uint32_t>(index.size());
+
+      azm.resize(index.size());
+      alt.resize(index.size());
+
+      astronomy::ra_de_to_azm_alt(observer, lst, ra, de, azm, alt);
+
+      for (std::size_t i = 0; i < index.size(); i++) {
+        if (alt[i] < query.min_altitude) continue;
+
+        out->push_back({ index[i], azm[i], alt[i] });
+
+        if (out->size() >= query.max_count) return stats;
+      }
+    }
+
+    return stats;
+  }
+};
+
+struct catalog_entry_t {
+  std::string name;
+  float rightascension;  // degrees
+  float declination;
+  float magnitude;
+};
+
+// builds the file catalog::open() reads, false on i/o errors
+[[nodiscard]] static inline bool write_catalog(
+  const char* path, std::vector<catalog_entry_t> entries, std::uint32_t band_count) {
+  if (band_count == 0 || band_count > 180 * 60) return false;
+
+  const float height = 180.0f / static_cast<float>(band_count);
+
+  auto band_of = [&](float declination) {
+    auto band = static_cast<std::uint32_t>((declination + 90.0f) / height);
+    return std::min(band, band_count - 1);
+  };
+
+  for (auto& entry : entries) {
+    entry.rightascension -= 360.0f * std::floor(entry.rightascension / 360.0f);
+    entry.declination = std::clamp(entry.declination, -90.0f, 90.0f);
+  }
+
+  std::sort(entries.begin(), entries.end(), [&](const catalog_entry_t& a, const catalog_entry_t& b) {
+    std::uint32_t band_a = band_of(a.declination);
+    std::uint32_t band_b = band_of(b.declination);
+    if (band_a != band_b) return band_a < band_b;
+    return a.rightascension < b.rightascension;
+  });
+
+  std::vector<std::uint32_t> band_start(band_count + 1, 0);
+  std::vector<catalog_record_t> records;
+  std::string names;
+
+  records.reserve(entries.size());
+
+  for (const auto& entry : entries) {
+    band_start[band_of(entry.declination) + 1]++;
+
+    records.push_back({
+      entry.rightascension,
+      entry.declination,
+      entry.magnitude,
+      static_cast<std::uint32_t>(names.size()),
+    });
+
+    names.append(entry.name);
+    names.push_back('\0');
+  }
+
+  for (std::uint32_t band = 0; band < band_count; band++)
+    band_start[band + 1] += band_start[band];
+
+  // keeps the file size a multiple of 4, readers do not care
+  while (names.size() % 4 != 0)
+    names.push_back('\0');
+
+  catalog_header_t header;
+  std::memcpy(header.magic, catalog_header_t::expected_magic, sizeof(header.magic));
+  header.version = catalog_header_t::current_version;
+  header.band_count = band_count;
+  header.object_count = static_cast<std::uint32_t>(records.size());
+  header.names_size = static_cast<std::uint32_t>(names.size());
+
+  std::FILE* file = std::fopen(path, "wb");
+  if (file == nullptr) return false;
+
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+    && std::fwrite(band_start.data(), sizeof(std::uint32_t), band_start.size(), file) == band_start.size()
+    && std::fwrite(records.data(), sizeof(catalog_record_t), records.size(), file) == records.size()
+    && std::fwrite(names.data(), 1, names.size(), file) == names.size();
+
+  return std::fclose(file) == 0 && ok;
+}
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_CATALOG_HPP_
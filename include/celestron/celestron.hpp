@@ -3,417 +3,135 @@
 #ifndef INCLUDE_CELESTRON_CELESTRON_HPP_
 #define INCLUDE_CELESTRON_CELESTRON_HPP_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string>
+#include <thread>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include <telescope.hpp>
+#include <logger.hpp>
 #include <serial.hpp>
 #include <time.hpp>
 #include <astronomy.hpp>
+#include <celestron/codec.hpp>
 
 namespace celestron {
 
-enum class tracking_mode_kind : std::uint8_t {
-  off      = 0,
-  alt_azm  = 1,
-  eq_north = 2,
-  eq_south = 3
+// one command of a pipelined burst, nbytes is what send_command would
+// have returned for it
+struct batch_slot_t {
+  const void* in;
+  int in_size;
+  void* out;
+  int out_size;
+  expect_t expect;
+  int nbytes;
 };
 
-  //dev
-  // 16 = azm/ra motor
-  // 17 = alt/de motor
-  // 176 = gps
-  // 178 = rtc
-enum class device_kind : std::uint8_t {
-  azm_motor = 16,
-  alt_motor = 17,
-  gps       = 176,
-  rtc       = 178
+// what the poller reads, callers set the flags of the values they want and
+// a value is only valid when its flag is still set afterwards
+struct mount_state_t {
+  alpaca::coord_t coord;
+  alpaca::altazm_t altazm;
+  bool slewing;
+  tracking_mode_kind tracking_mode;
+
+  bool has_coord;
+  bool has_altazm;
+  bool has_slewing;
+  bool has_tracking_mode;
 };
 
-enum class passthrough_command_kind : std::uint8_t {
-  slew_variable_positive = 6,
-  slew_variable_negative = 7,
-  slew_fixed_positive = 36,
-  slew_fixed_negative = 37,
-
-  // [ 'P', req_size, dev, cmd/arg0, arg1, arg2, arg3, resp_size ]
-
-  // azm motor
-  // + var azm    = 3, 16, 6, hi, lo, 0, 0
-  // - var azm    = 3, 16, 7, hi, lo, 0, 0
-  // + fix azm    = 2, 16, 36, rate, 0, 0, 0
-  // - fix azm    = 2, 16, 37, rate, 0, 0, 0
-
-  // alt motor
-  // + var alt    = 3, 17, 6, hi, lo, 0, 0
-  // - var alt    = 3, 17, 7, hi, lo, 0, 0
-  // + fix azm    = 2, 17, 36, rate, 0, 0, 0
-  // - fix azm    = 2, 17, 37, rate, 0, 0, 0
-
-  //gps
-  //is gps linked = 1, 176, 55, 0, 0, 0, 1
-  //get latitude  = 1, 176, 1, 0, 0, 0, 3
-  //get longitude = 1, 176, 2, 0, 0, 0, 3
-  //get date      = 1, 176, 3, 0, 0, 0, 2
-  //get year      = 1, 176, 4, 0, 0, 0, 2
-  //get time      = 1, 176, 51, 0, 0, 0, 3
-
-  //rtc
-  //get date      = 1, 178, 3, 0, 0, 0, 2
-  //get year      = 1, 178, 4, 0, 0, 0, 2
-  //get time      = 1, 178, 51, 0, 0, 0, 3
-  //set date      = 3, 178, 131, x, y, 0, 0
-  //set year      = 3, 178, 132, x, y, 0, 0
-  //set time      = 4, 178, 179, x, y, z, 0
-
-  //misc
-  //get dev ver   = 1, dev, 254, 0, 0, 0, 2
+// told by a protocol that keeps a link to the mount, from the protocol's own
+// thread, every time the link comes up
+struct link_listener {
+  virtual ~link_listener() { }
 
+  virtual void link_up() = 0;
 };
 
-template<typename T>
-struct response_base_t {
-  union {
-    struct {
-      T            payload;
-      std::uint8_t always_0x23;
-    };
-    std::uint8_t data[sizeof(T) + sizeof(std::uint8_t)];
-  };
-
-  constexpr response_base_t() = default;
-};
-
-template<>
-struct response_base_t<void> {
-  union {
-    std::uint8_t always_0x23;
-    std::uint8_t data[sizeof(std::uint8_t)];
-  };
-
-  constexpr response_base_t() = default;
-};
-
-template<
-  typename Payload,
-  typename... Args
-> concept parseable_t = requires(Payload payload, Args... args) {
-  { payload.parse(args...) } -> std::convertible_to<bool>;
-};
-
-template<typename Payload>
-struct response_t : response_base_t<Payload> {
-
-  constexpr response_t() = default;
-
-  [[nodiscard]] constexpr auto is_ok() const -> bool {
-    return response_base_t<Payload>::always_0x23 == '#';
-  }
-
-  [[nodiscard]] constexpr auto parse() const -> bool requires(std::same_as<Payload, void>) {
-    return true;
-  }
-
-  template<
-    typename T
-  >
-  [[nodiscard]] constexpr auto parse(T* args) const -> bool requires(!std::same_as<Payload, void> && std::convertible_to<Payload, T>) {
-    const response_base_t<Payload>& self = *this;
-
-    *args = static_cast<T>(self.payload);
-    return true;
-  }
-
-  template<
-    typename... Args
-  >
-  [[nodiscard]] constexpr auto parse(Args... args) const -> bool requires(parseable_t<Payload, Args...>) {
-    const response_base_t<Payload>& self = *this;
-
-    return self.payload.parse(args...);
-  }
-};
-
-template<std::uint8_t CMD, typename Payload>
-struct command_t {
-  union {
-    struct {
-      std::uint8_t cmd;
-      Payload      payload;
-    };
-    std::uint8_t data[sizeof(std::uint8_t) + sizeof(Payload)];
-  };
-
-  template<typename... Args>
-  constexpr command_t(Args... args)
-  : cmd{CMD}
-  , payload{args...}
-  { }
-};
-
-template<std::uint8_t CMD>
-struct command_t<CMD, void> {
-  union {
-    std::uint8_t cmd;
-    std::uint8_t data[sizeof(std::uint8_t)];
-  };
-
-  constexpr command_t()
-  : cmd{CMD}
-  { }
-};
-
-struct location_t {
-  std::uint8_t latitude_degree;
-  std::uint8_t latitude_minute;
-  std::uint8_t latitude_second;
-  std::uint8_t is_south;
-  std::uint8_t longitude_degree;
-  std::uint8_t longitude_minute;
-  std::uint8_t longitude_second;
-  std::uint8_t is_west;
-
-  constexpr location_t() = default;
+struct nexstar_protocol {
+  virtual ~nexstar_protocol() { }
 
-  constexpr location_t(float latitude, float longitude) {
-    alpaca::astronomy::dms_t lat{ latitude };
-    alpaca::astronomy::dms_t lon{ longitude };
+  [[nodiscard]] virtual int send_command(
+    const void* in, int in_size, void* out, int out_size, expect_t expect) = 0;
 
-    latitude_degree  = static_cast<std::uint8_t>(std::abs(lat.degree));
-    latitude_minute  = static_cast<std::uint8_t>(lat.minute);
-    latitude_second  = static_cast<std::uint8_t>(lat.second);
-    is_south         = static_cast<std::uint8_t>(latitude >= 0 ? 0 : 1);
-    longitude_degree = static_cast<std::uint8_t>(std::abs(lon.degree));
-    longitude_minute = static_cast<std::uint8_t>(lon.minute);
-    longitude_second = static_cast<std::uint8_t>(lon.second);
-    is_west          = static_cast<std::uint8_t>(longitude >= 0 ? 0 : 1);
+  // sends several commands and fills in every slot, protocols that can
+  // write them back to back override it, the default is one at a time
+  virtual void send_batch(std::span<batch_slot_t> slots) {
+    for (auto& slot : slots)
+      slot.nbytes = send_command(slot.in, slot.in_size, slot.out, slot.out_size, slot.expect);
   }
 
-  [[nodiscard]] constexpr auto parse(float* latitude, float* longitude) const -> bool {
-    alpaca::astronomy::dms_t lat{ latitude_degree, latitude_minute, latitude_second };
-    alpaca::astronomy::dms_t lon{ longitude_degree, longitude_minute, longitude_second };
-
-    *latitude = is_south == 1 ? -lat.to_decimal() : +lat.to_decimal();
-    *longitude = is_west == 1 ? -lon.to_decimal() : +lon.to_decimal();
-
-    return true;
+  virtual void write_metrics(alpaca::metrics_writer*, std::string_view) const {
   }
-};
-
-struct utcdate_t {
-  std::uint8_t hour;
-  std::uint8_t minute;
-  std::uint8_t second;
-  std::uint8_t month;
-  std::uint8_t day;
-  std::uint8_t year;
-  std::uint8_t offset;
-  std::uint8_t isdst;
-
-  constexpr utcdate_t() = default;
-
-  constexpr utcdate_t(alpaca::utcdate_t utcdate, int offset_micros) {
-    utcdate += offset_micros;
-
-    std::tm local_tm;
-    utcdate.to_local_tm(&local_tm);
 
-    int gmt_offset = local_tm.tm_gmtoff/3600;
-
-    if (gmt_offset < 0)
-      gmt_offset += 256;
-
-    hour   = static_cast<std::uint8_t>(local_tm.tm_hour); // hour (24 hour)
-    minute = static_cast<std::uint8_t>(local_tm.tm_min); // minutes
-    second = static_cast<std::uint8_t>(local_tm.tm_sec); // seconds
-    month  = static_cast<std::uint8_t>(local_tm.tm_mon + 1); // month
-    day    = static_cast<std::uint8_t>(local_tm.tm_mday); // day
-    year   = static_cast<std::uint8_t>(local_tm.tm_year + 1900 - 2000); // year (century is 20)
-    offset = static_cast<std::uint8_t>(gmt_offset); // gmt offset
-    isdst  = static_cast<std::uint8_t>(local_tm.tm_isdst > 0 ? 1 : 0); // 1 dst, 0 std time
+  // clock the mount keeps time with, nullptr for the wall clock
+  [[nodiscard]] virtual const alpaca::virtual_clock_t* get_clock() const {
+    return nullptr;
   }
 
-  [[nodiscard]] auto parse(alpaca::utcdate_t* utcdate) const -> bool {
-    int gmt_offset = offset;
-
-    if (gmt_offset > 127)
-      gmt_offset -= 256;
-
-    std::tm local_tm;
-    local_tm.tm_hour   = hour;
-    local_tm.tm_min    = minute;
-    local_tm.tm_sec    = second;
-    local_tm.tm_mon    = month - 1;
-    local_tm.tm_mday   = day;
-    local_tm.tm_year   = year + 2000 - 1900;
-    local_tm.tm_gmtoff = gmt_offset;
-    local_tm.tm_isdst  = isdst;
-
-    *utcdate = alpaca::utcdate_t::from_local_tm(&local_tm);
-
+  // false while the mount is known to be unreachable, commands fail at once
+  [[nodiscard]] virtual bool is_online() const {
     return true;
   }
-};
-
-struct version_t {
-  std::uint8_t major;
-  std::uint8_t minor;
 
-  constexpr version_t() = default;
-
-  [[nodiscard]] constexpr auto parse(std::int32_t* major, std::int32_t* minor) const -> bool {
-    *major = this->major;
-    *minor = this->minor;
-    return true;
+  // the listener must outlive the protocol, protocols without a link to
+  // lose never call it
+  virtual void set_link_listener(link_listener*) {
   }
-};
 
-struct alignas(1) passthrough_command_t {
-  // [ 'P', req_size, dev, cmd/arg0, arg1, arg2, arg3, resp_size ]
-  std::uint8_t always_P;
-  std::uint8_t request_arguments;
-  device_kind device;
-  passthrough_command_kind command;
-  std::uint8_t args[3];
-  std::uint8_t response_arguments;
-
-  constexpr passthrough_command_t() = default;
-
-  constexpr passthrough_command_t(device_kind device, passthrough_command_kind command, char arg0, char arg1, char arg2, char args_size, char response_size) {
-    this->always_P = 'P';
-    this->request_arguments = args_size + 1;
-    this->device = device;
-    this->command = command;
-    this->args[0] = arg0;
-    this->args[1] = arg1;
-    this->args[2] = arg2;
-    this->response_arguments = response_size;
+  // the slot of a burst for `command`, sized and delimited by the command table
+  [[nodiscard]] static batch_slot_t batch_slot(const message_t& command, message_t* reply) {
+    return { command.bytes.data(), command.size, reply->bytes.data(), command.reply_size(), command.spec().expect, -1 };
   }
-};
-
-struct slew_variable_command_t {
-  union {
-    passthrough_command_t cmd;
-    std::uint8_t data[8];
-  };
-
-  constexpr slew_variable_command_t(int axis, float rate) {
-    int rate_abs = static_cast<int>(std::abs(rate * 3600 * 4)); //arcseconds/second
-
-    passthrough_command_kind command = rate >= 0
-        ? passthrough_command_kind::slew_variable_negative
-        : passthrough_command_kind::slew_variable_positive;
 
-    device_kind device = axis == 0
-        ? device_kind::azm_motor
-        : device_kind::alt_motor;
-
-    char hi = static_cast<char>((rate_abs >> 8) & 0xff);
-    char lo = static_cast<char>(rate_abs & 0xff);
-
-    std::construct_at(&cmd, device, command, hi, lo, 0, 2, 0);
+  void exchange(const message_t& command, message_t* reply) {
+    reply->size = std::max(0, send_command(
+      command.bytes.data(), command.size, reply->bytes.data(), command.reply_size(), command.spec().expect));
   }
 
-  [[nodiscard]] constexpr auto parse(int* axis, float* rate) const -> bool {
-    std::int32_t rate_int = cmd.args[0] << 8 | cmd.args[1];
-
-    switch (cmd.device) {
-      case device_kind::azm_motor:
-        *axis = 0;
-        break;
-
-      case device_kind::alt_motor:
-        *axis = 1;
-        break;
-
-      default:
-        return false;
-    }
-
-    switch (cmd.command) {
-      case passthrough_command_kind::slew_variable_positive:
-        *rate = +rate_int / (3600.0f * 4);
-        break;
-
-      case passthrough_command_kind::slew_variable_negative:
-        *rate = -rate_int / (3600.0f * 4);
-        break;
-
-      default:
-        return false;
-    }
+  // for commands the mount only acknowledges
+  [[nodiscard]] bool exchange(const message_t& command) {
+    message_t reply;
+    exchange(command, &reply);
 
-    return true;
+    return decode_ack(reply);
   }
 
-};
-
-std::ostream& operator<<(std::ostream& os, const passthrough_command_t& p) {
-  std::cout << p.always_P << std::endl;
-  std::cout << static_cast<int>(p.request_arguments) << std::endl;
-  std::cout << static_cast<int>(p.device) << std::endl;
-  std::cout << static_cast<int>(p.command) << std::endl;
-  std::cout << static_cast<int>(p.args[0]) << std::endl;
-  std::cout << static_cast<int>(p.args[1]) << std::endl;
-  std::cout << static_cast<int>(p.args[2]) << std::endl;
-  std::cout << static_cast<int>(p.response_arguments) << std::endl;
-  return os;
-}
-
-struct nexstar_protocol {
-  virtual ~nexstar_protocol() { }
-
-  [[nodiscard]] virtual int send_command(
-    const void* in, int in_size, void* out, int out_size) = 0;
-
-#if 0
-  template<
-    std::uint8_t CMD,
-    typename CommandPayload,
-    typename ResponsePayload
-  >
-  [[nodiscard]] bool send_command(
-    const command_t<CMD, CommandPayload>& command,
-    response_t<ResponsePayload>* response) {
-    int nbytes = send_command(
-      command.data,
-      sizeof(command_t<CMD, CommandPayload>),
-      response->data,
-      sizeof(response_t<ResponsePayload>));
-
-    if (nbytes != sizeof(response_t<ResponsePayload>)) return false;
-    if (!response->is_ok()) return false;
+  template<typename Payload>
+  [[nodiscard]] bool exchange(const message_t& command, Payload* payload) {
+    message_t reply;
+    exchange(command, &reply);
 
-    return true;
+    return decode_reply(reply, payload);
   }
-#endif
 
   bool get_version(std::int32_t* major, std::int32_t* minor) {
-    const command_t<'V', void> command;
-    response_t<version_t> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    version_t version;
+    if (!exchange(encode_command('V'), &version)) return false;
 
-    return response.parse(major, minor);
+    return version.parse(major, minor);
   }
 
   bool get_model(int* model) {
-    const command_t<'m', void> command;
-    response_t<std::int8_t> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    std::uint8_t value;
+    if (!exchange(encode_command('m'), &value)) return false;
 
-    return response.parse(model);
+    *model = static_cast<std::int8_t>(value);
+    return true;
   }
 
   std::string get_model_string(int model) {
@@ -462,7 +180,11 @@ struct nexstar_protocol {
     const float k2 = 0x000010000 / 360.0f;
     const float k = precise ? k1 : k2;
 
-    return static_cast<std::uint32_t>(std::fmod(angle, 360.0f) * k);
+    // negative angles would wrap to numbers wider than the reply field
+    angle = std::fmod(angle, 360.0f);
+    if (angle < 0.0f) angle += 360.0f;
+
+    return static_cast<std::uint32_t>(angle * k);
   }
 
   // converts [0, 360] to [-90, +90]
@@ -481,224 +203,196 @@ struct nexstar_protocol {
     return angle;
   }
 
-  bool get_ra_de(alpaca::coord_t* coord, bool precise) {
-    const char command[] = { precise ? 'e' : 'E' };
-    char output[19];
+  [[nodiscard]] bool parse_ra_de(const message_t& reply, bool precise, alpaca::coord_t* coord) {
     std::uint32_t ra_int, de_int;
 
-    int size = precise ? 18 : 10;
+    if (!decode_reply(reply, precise, &ra_int, &de_int))
+      return false;
 
-    int nbytes = send_command(command, 1, output, size);
+    coord->rightascension = nexstar_to_degree(ra_int, precise) / 15.0f;
+    coord->declination = nexstar_to_degree(de_int, precise);
 
-    if (nbytes != size) return false;
-    if (output[size - 1] != '#') return false;
+    return true;
+  }
 
-    output[size] = '\0';
+  [[nodiscard]] bool parse_azm_alt(const message_t& reply, bool precise, alpaca::altazm_t* altazm) {
+    std::uint32_t alt_int, azm_int;
 
-    if (std::sscanf(output, "%x,%x#", &ra_int, &de_int) != 2)
+    if (!decode_reply(reply, precise, &azm_int, &alt_int))
       return false;
 
-    coord->rightascension = nexstar_to_degree(ra_int, precise) / 15.0f;
-    coord->declination = nexstar_to_degree(de_int, precise);
+    altazm->azimuth = nexstar_to_degree(azm_int, precise);
+    altazm->altitude = fix_declination(nexstar_to_degree(alt_int, precise));
 
     return true;
   }
 
-  bool goto_ra_de(alpaca::coord_t coord, bool precise) {
-    char command[19];
-    char output[1];
+  [[nodiscard]] static bool parse_goto_in_progress(const message_t& reply, bool* is_inprogress) {
+    std::uint8_t value;
+    if (!decode_reply(reply, &value)) return false;
+
+    *is_inprogress = value == '1';
+    return true;
+  }
+
+  [[nodiscard]] static bool parse_tracking_mode(const message_t& reply, tracking_mode_kind* mode) {
+    std::uint8_t value;
+    if (!decode_reply(reply, &value)) return false;
+
+    *mode = static_cast<tracking_mode_kind>(value);
+    return true;
+  }
+
+  bool get_ra_de(alpaca::coord_t* coord, bool precise) {
+    message_t reply;
+    exchange(encode_command(precise ? 'e' : 'E'), &reply);
 
-    int size = precise ? 18 : 10;
-    const char* fmt = precise ? "r%08X,%08X" : "R%04X,%04X";
+    return parse_ra_de(reply, precise, coord);
+  }
 
+  bool goto_ra_de(alpaca::coord_t coord, bool precise) {
     if (coord.declination < 0.0f)
       coord.declination += 360.0f;
 
     std::uint32_t ra_int = degree_to_nexstar(coord.rightascension * 15.0f, precise);
     std::uint32_t de_int = degree_to_nexstar(coord.declination, precise);
 
-    std::snprintf(command, size + 1, fmt, ra_int, de_int);
-
-    int nbytes = send_command(command, size, output, 1);
-
-    if (nbytes != 1) return false;
-    if (output[0] != '#') return false;
-
-    return true;
+    return exchange(encode_command(precise ? 'r' : 'R', ra_int, de_int));
   }
 
   bool get_azm_alt(alpaca::altazm_t* altazm, bool precise) {
-    const char command[] = { precise ? 'z' : 'Z' };
-    char output[19];
-    std::uint32_t alt_int, azm_int;
+    message_t reply;
+    exchange(encode_command(precise ? 'z' : 'Z'), &reply);
+
+    return parse_azm_alt(reply, precise, altazm);
+  }
 
-    int size = precise ? 18 : 10;
+  bool is_goto_in_progress(bool* is_inprogress) {
+    message_t reply;
+    exchange(encode_command('L'), &reply);
 
-    int nbytes = send_command(command, 1, output, size);
+    return parse_goto_in_progress(reply, is_inprogress);
+  }
 
-    if (nbytes != size) return false;
-    if (output[size - 1] != '#') return false;
+  // the wanted ones of e/E, z/Z, L and t as one burst, a failed reply only
+  // clears its own flag
+  void get_mount_state(mount_state_t* state, bool precise) {
+    const message_t ra_de_command = encode_command(precise ? 'e' : 'E');
+    const message_t azm_alt_command = encode_command(precise ? 'z' : 'Z');
+    const message_t goto_command = encode_command('L');
+    const message_t tracking_command = encode_command('t');
 
-    output[size] = '\0';
+    message_t ra_de;
+    message_t azm_alt;
+    message_t in_progress;
+    message_t mode;
 
-    if (std::sscanf(output, "%x,%x#", &azm_int, &alt_int) != 2)
-      return false;
+    std::array<batch_slot_t, 4> slots;
+    std::size_t count = 0;
 
-    altazm->azimuth = nexstar_to_degree(azm_int, precise);
-    altazm->altitude = nexstar_to_degree(alt_int, precise);
+    auto add = [&](bool wanted, const message_t& command, message_t* reply) -> batch_slot_t* {
+      if (!wanted) return nullptr;
 
-    return true;
-  }
+      slots[count] = batch_slot(command, reply);
+      return &slots[count++];
+    };
 
-  bool is_goto_in_progress(bool* is_inprogress) {
-    const command_t<'L', void> command;
-    response_t<std::uint8_t> response;
+    const batch_slot_t* ra_de_slot = add(state->has_coord, ra_de_command, &ra_de);
+    const batch_slot_t* azm_alt_slot = add(state->has_altazm, azm_alt_command, &azm_alt);
+    const batch_slot_t* goto_slot = add(state->has_slewing, goto_command, &in_progress);
+    const batch_slot_t* tracking_slot = add(state->has_tracking_mode, tracking_command, &mode);
 
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
+    if (count == 0) return;
 
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    send_batch(std::span<batch_slot_t>(slots.data(), count));
 
-    std::uint8_t value;
-    if (response.parse(&value)) {
-      *is_inprogress = value == '1';
-      return true;
-    }
+    auto received = [](const batch_slot_t* slot, message_t* reply) -> const message_t& {
+      reply->size = std::max(0, slot->nbytes);
+      return *reply;
+    };
 
-    return false;
+    if (ra_de_slot)
+      state->has_coord = parse_ra_de(received(ra_de_slot, &ra_de), precise, &state->coord);
+    if (azm_alt_slot)
+      state->has_altazm = parse_azm_alt(received(azm_alt_slot, &azm_alt), precise, &state->altazm);
+    if (goto_slot)
+      state->has_slewing = parse_goto_in_progress(received(goto_slot, &in_progress), &state->slewing);
+    if (tracking_slot)
+      state->has_tracking_mode = parse_tracking_mode(received(tracking_slot, &mode), &state->tracking_mode);
   }
 
   [[nodiscard]] bool get_utcdate(alpaca::utcdate_t* utcdate) {
-    const command_t<'h', void> command;
-    response_t<utcdate_t> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
+    utcdate_t date;
+    if (!exchange(encode_command('h'), &date)) return false;
 
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse(utcdate);
+    return date.parse(utcdate);
   }
 
   [[nodiscard]] bool set_utcdate(alpaca::utcdate_t utcdate) {
-    const command_t<'H', utcdate_t> command{utcdate, 0};
-    response_t<void> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse();
+    return exchange(encode_command('H', utcdate_t(utcdate, 0)));
   }
 
   [[nodiscard]] bool get_location(float* latitude, float* longitude) {
-    const command_t<'w', void> command;
-    response_t<location_t> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    location_t location;
+    if (!exchange(encode_command('w'), &location)) return false;
 
-    return response.parse(latitude, longitude);
+    return location.parse(latitude, longitude);
   }
 
   [[nodiscard]] bool set_location(float latitude, float longitude) {
-    const command_t<'W', location_t> command{latitude, longitude};
-    response_t<void> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse();
+    return exchange(encode_command('W', location_t(latitude, longitude)));
   }
 
   [[nodiscard]] bool slew_variable(const alpaca::move_t& move) {
-    const slew_variable_command_t slew_command{move.axis, move.rate};
-    response_t<void> response;
-
-    int nbytes = send_command(slew_command.data, sizeof(slew_command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse();
+    return exchange(encode_slew_variable(move.axis, move.rate));
   }
 
   bool get_tracking_mode(tracking_mode_kind* mode) {
-    const command_t<'t', void> command;
-    response_t<tracking_mode_kind> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    message_t reply;
+    exchange(encode_command('t'), &reply);
 
-    return response.parse(mode);
+    return parse_tracking_mode(reply, mode);
   }
 
   bool set_tracking_mode(tracking_mode_kind mode) {
-    const command_t<'T', tracking_mode_kind> command{mode};
-    response_t<void> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse();
+    return exchange(encode_command('T', static_cast<std::uint8_t>(mode)));
   }
 
   bool is_aligned(bool* aligned) {
-    const command_t<'J', void> command;
-    response_t<bool> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
+    std::uint8_t value;
+    if (!exchange(encode_command('J'), &value)) return false;
 
-    return response.parse(aligned);
+    *aligned = value != 0;
+    return true;
   }
 
   bool cancel_goto() {
-    const command_t<'M', void> command;
-    response_t<void> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-
-    return response.parse();
+    return exchange(encode_command('M'));
   }
 
   bool echo(char ch) {
-    const command_t<'K', char> command{ch};
-    response_t<char> response;
-
-    int nbytes = send_command(command.data, sizeof(command), response.data, sizeof(response));
-
-    if (nbytes != sizeof(response)) return false;
-    if (!response.is_ok()) return false;
-    if (response.data[0] != ch) return false;
+    std::uint8_t value;
+    if (!exchange(encode_command('K', static_cast<std::uint8_t>(ch)), &value)) return false;
 
-    return true;
+    return value == static_cast<std::uint8_t>(ch);
   }
 
 };
 
+// A mount in memory. It runs on a virtual clock, shared with the caller
+// so a test can run it faster than real time or step it by hand.
 struct simulator_protocol : nexstar_protocol {
+  std::shared_ptr<alpaca::virtual_clock_t> clock;
+
   float target_rightascension = 0;
   float target_declination = 0;
   float rightascension = 0;
   float declination = 0;
 
-  float latitude;
-  float longitude;
+  float latitude = 0;
+  float longitude = 0;
+
+  alpaca::astronomy::observer_t observer{latitude, longitude, clock->utc(), clock->monotonic()};
 
   tracking_mode_kind tracking_mode = tracking_mode_kind::off;
   float slew_rate[2] = {0, 0};
@@ -711,12 +405,22 @@ struct simulator_protocol : nexstar_protocol {
 
   state_kind state = state_kind::no_op;
 
-  alpaca::utcdate_t last_ts = alpaca::utcdate_t::now();
+  alpaca::monotonic_t last_ts = clock->monotonic();
 
-  alpaca::utcdate_t utcdate = alpaca::utcdate_t::now();
+  alpaca::utcdate_t utcdate = clock->utc();
   alpaca::utcdate_t utcdate_updated = utcdate;
 
-  simulator_protocol() {
+  explicit simulator_protocol(
+    std::shared_ptr<alpaca::virtual_clock_t> clock = std::make_shared<alpaca::virtual_clock_t>())
+  : clock(std::move(clock)) {
+  }
+
+  [[nodiscard]] virtual const alpaca::virtual_clock_t* get_clock() const override {
+    return clock.get();
+  }
+
+  [[nodiscard]] float lst() const {
+    return observer.lst(clock->monotonic());
   }
 
   auto step(float target, float* actual, float delta_time) -> void {
@@ -739,11 +443,11 @@ struct simulator_protocol : nexstar_protocol {
     }
   }
 
-  auto step() -> void {
-    alpaca::utcdate_t now = alpaca::utcdate_t::now();
-    float delta_time = (now - last_ts) / 1000000.0f;
-    last_ts = now;
+  // motion advances in fixed ticks, a scenario ends up in the same place
+  // however often it is polled and however fast the clock runs
+  constexpr static std::int64_t tick_micros = 10000;
 
+  auto tick(float delta_time) -> void {
     switch (state) {
       case state_kind::no_op:
         break;
@@ -753,9 +457,6 @@ struct simulator_protocol : nexstar_protocol {
         step(target_rightascension, &rightascension, delta_time);
         step(target_declination, &declination, delta_time);
 
-        printf("step(%f) => (%f %f) => (%f %f)\n",
-          delta_time, rightascension, declination, target_rightascension, target_declination);
-
         bool is_slewing = target_rightascension != rightascension || target_declination != declination;
         if (!is_slewing)
           state = state_kind::no_op;
@@ -770,180 +471,148 @@ struct simulator_protocol : nexstar_protocol {
     }
   }
 
-  virtual int send_command(
-    const void* in_ptr, int, void* out_ptr, int out_size) {
+  auto step() -> void {
+    alpaca::monotonic_t now = clock->monotonic();
+    observer.refresh(clock->utc(), now);
+
+    constexpr float delta_time = static_cast<float>(tick_micros) / 1000000.0f;
+
+    while (now - last_ts >= tick_micros) {
+      // nothing moves while idle, skip the whole gap
+      if (state == state_kind::no_op) {
+        last_ts = last_ts + (now - last_ts) / tick_micros * tick_micros;
+        break;
+      }
 
-    const char* in = reinterpret_cast<const char*>(in_ptr);
-    char* out = reinterpret_cast<char*>(out_ptr);
+      last_ts = last_ts + tick_micros;
+      tick(delta_time);
+    }
+  }
+
+  // a command the mount does not know, or of the wrong length, gets no reply
+  virtual int send_command(
+    const void* in_ptr, int in_size, void* out_ptr, int out_size, expect_t) override {
+    const std::uint8_t* in = static_cast<const std::uint8_t*>(in_ptr);
 
     step();
 
-    switch (in[0]) {
+    if (in_size <= 0 || in_size != command_spec(in[0]).request_size)
+      return 0;
+
+    const message_t reply = answer(in, in_size);
+    const int nbytes = std::min(reply.size, out_size);
+
+    std::memcpy(out_ptr, reply.bytes.data(), nbytes);
+    return nbytes;
+  }
+
+ private:
+  [[nodiscard]] message_t answer(const std::uint8_t* in, int in_size) {
+    const command_spec_t& spec = command_spec(in[0]);
+
+    switch (spec.letter) {
       case 'K':
-        out[0] = in[1];
-        out[1] = '#';
-        return 2;
+        return encode_reply(in[1]);
 
       case 'V':
-        out[0] = 1;
-        out[1] = 2;
-        out[2] = '#';
-        return 3;
+        return encode_reply(version_t(1, 2));
 
       case 'm':
-        out[0] = 20;
-        out[1] = '#';
-        return 2;
+        return encode_reply(std::uint8_t{20});
 
       case 'h':
-        std::construct_at(reinterpret_cast<utcdate_t*>(out), utcdate, alpaca::utcdate_t::now() - utcdate_updated);
-        out[8] = '#';
-        return 9;
+        return encode_reply(utcdate_t(utcdate, static_cast<int>(clock->utc() - utcdate_updated)));
 
       case 'H':
-        if (reinterpret_cast<const utcdate_t*>(in+1)->parse(&utcdate)) {
-          out[0] = '#';
-          utcdate_updated = alpaca::utcdate_t::now();
-          return 1;
-        } else {
-          return 0;
-        }
+        if (!utcdate_t::read(in + 1).parse(&utcdate)) break;
+
+        utcdate_updated = clock->utc();
+        return encode_ack();
 
       case 'w':
-        std::construct_at(reinterpret_cast<location_t*>(out), latitude, longitude);
-        out[8] = '#';
-        return 9;
+        return encode_reply(location_t(latitude, longitude));
 
       case 'W':
-        if (reinterpret_cast<const location_t*>(in+1)->parse(&latitude, &longitude)) {
-          out[0] = '#';
-          return 1;
-        } else {
-          return 0;
-        }
+        if (!location_t::read(in + 1).parse(&latitude, &longitude)) break;
 
-      case 'E':
-        std::snprintf(out, out_size + 1, "%04X,%04X#",
-          degree_to_nexstar(rightascension, false),
-          degree_to_nexstar(declination, false));
-        return 10;
+        observer = alpaca::astronomy::observer_t(latitude, longitude, clock->utc(), clock->monotonic());
+        return encode_ack();
 
+      case 'E':
       case 'e':
-        std::snprintf(out, out_size + 1, "%08X,%08X#",
-          degree_to_nexstar(rightascension, true),
-          degree_to_nexstar(declination, true));
-        return 18;
+        return encode_reply(
+          degree_to_nexstar(rightascension, spec.precise),
+          degree_to_nexstar(declination, spec.precise),
+          spec.precise);
 
       case 'Z':
-      {
-        float azimuth, altitude;
-
-        alpaca::astronomy::ra_de_to_azm_alt(
-          alpaca::utcdate_t::now(),
-          rightascension, declination,
-          latitude, longitude,
-          &azimuth, &altitude);
-
-        std::snprintf(out, out_size + 1, "%04X,%04X#",
-          degree_to_nexstar(azimuth, false),
-          degree_to_nexstar(altitude, false));
-        return 10;
-      }
-
       case 'z':
       {
         float azimuth, altitude;
 
         alpaca::astronomy::ra_de_to_azm_alt(
-          alpaca::utcdate_t::now(),
-          rightascension, declination,
-          latitude, longitude,
-          &azimuth, &altitude
-        );
-
-        std::snprintf(out, out_size + 1, "%08X,%08X#",
-          degree_to_nexstar(azimuth, true),
-          degree_to_nexstar(altitude, true));
-        return 18;
+          observer, lst(), rightascension, declination, &azimuth, &altitude);
+
+        return encode_reply(
+          degree_to_nexstar(azimuth, spec.precise),
+          degree_to_nexstar(altitude < 0.0f ? altitude + 360.0f : altitude, spec.precise),
+          spec.precise);
       }
 
       case 's':
-        out[0] = '#';
-        return 1;
-
       case 'S':
-        out[0] = '#';
-        return 1;
+        return encode_ack();
 
       case 't':
-        out[0] = static_cast<char>(tracking_mode);
-        out[1] = '#';
-        return 2;
+        return encode_reply(static_cast<std::uint8_t>(tracking_mode));
 
       case 'T':
         tracking_mode = static_cast<tracking_mode_kind>(in[1]);
-        out[0] = '#';
-        return 1;
+        return encode_ack();
 
       case 'J':
-        out[0] = 1;
-        out[1] = '#';
-        return 2;
+        return encode_reply(std::uint8_t{1});
 
       case 'L':
-      {
-        bool is_slewing = state != state_kind::no_op;
-        out[0] = is_slewing ? '1' : '0';
-        out[1] = '#';
-        return 2;
-      }
+        return encode_reply(static_cast<std::uint8_t>(state != state_kind::no_op ? '1' : '0'));
 
       case 'M':
         state = state_kind::no_op;
         target_rightascension = rightascension;
         target_declination = declination;
-        out[0] = '#';
-        return 1;
+        return encode_ack();
 
       case 'r':
       case 'R':
       {
-        uint32_t ra = -1, de = -1;
+        std::uint32_t ra, de;
 
-        std::sscanf(in, "%*c%x,%x", &ra, &de);
+        if (!decode_command(in, in_size, &ra, &de)) break;
 
-        bool precise = in[0] == 'r';
-
-        printf("%s %d %d\n", in, ra, de);
-        target_rightascension = nexstar_to_degree(ra, precise);
-        target_declination = nexstar_to_degree(de, precise);
-        printf("r %f %f\n", target_rightascension, target_declination);
+        alpaca::logger::instance().message(alpaca::log_level_t::debug, "%c %u %u", in[0], ra, de);
+        target_rightascension = nexstar_to_degree(ra, spec.precise);
+        target_declination = nexstar_to_degree(de, spec.precise);
+        alpaca::logger::instance().message(
+          alpaca::log_level_t::debug, "r %f %f", target_rightascension, target_declination);
         state = state_kind::slewing;
 
-        out[0] = '#';
-        return 1;
+        return encode_ack();
       }
 
       case 'b':
       case 'B':
       {
-        uint32_t azm, alt;
-
-        std::sscanf(in, "%*c%x,%x", &azm, &alt);
+        std::uint32_t azm, alt;
 
-        bool precise = in[0] == 'b';
+        if (!decode_command(in, in_size, &azm, &alt)) break;
 
-        float azimuth = nexstar_to_degree(azm, precise);
-        float altitude = nexstar_to_degree(alt, precise);
+        float azimuth = nexstar_to_degree(azm, spec.precise);
+        float altitude = nexstar_to_degree(alt, spec.precise);
 
         alpaca::astronomy::azm_alt_to_ra_de(
-          alpaca::utcdate_t::now(),
-          azimuth, altitude,
-          latitude, longitude,
-          &rightascension, &declination);
+          observer, lst(), azimuth, altitude, &rightascension, &declination);
 
-        out[0] = '#';
-        return 1;
+        return encode_ack();
       }
 
       case 'P':
@@ -951,21 +620,19 @@ struct simulator_protocol : nexstar_protocol {
           case passthrough_command_kind::slew_variable_positive:
           case passthrough_command_kind::slew_variable_negative:
           {
-            const slew_variable_command_t* slew_command = reinterpret_cast<const slew_variable_command_t*>(in);
-
             float rate;
             int axis;
 
-            if (slew_command->parse(&axis, &rate)) {
+            if (decode_slew_variable(in, in_size, &axis, &rate)) {
               slew_rate[axis] = rate;
 
-              state = rate != 0 ? state_kind::moving : state_kind::no_op;
+              // the other axis keeps its rate, guide pulses overlap
+              state = slew_rate[0] != 0 || slew_rate[1] != 0 ? state_kind::moving : state_kind::no_op;
             } else {
               state = state_kind::no_op;
             }
 
-            out[0] = '#';
-            return 1;
+            return encode_ack();
           }
 
           default:
@@ -974,59 +641,333 @@ struct simulator_protocol : nexstar_protocol {
         break;
     }
 
-    return 0;
+    return message_t();
   }
 };
 
-struct serial_protocol : nexstar_protocol {
+// The port is opened and the mount greeted from a supervisor thread, right
+// at construction and again whenever the link drops (a USB adapter pulled,
+// the hand controller switched off), backing off between attempts. While
+// the link is down commands fail at once instead of each paying for an
+// open or a read timeout, and a reseated cable answers again within
+// max_backoff_micros plus one handshake.
+class serial_protocol : public nexstar_protocol {
   alpaca::serial serial;
-  std::string_view port;
+  std::string port;
   int baudRate;
 
-  virtual int send_command(
-    const void* in, int in_size, void* out, int out_size) {
+  constexpr static std::int64_t min_backoff_micros = 100000;
+  constexpr static std::int64_t max_backoff_micros = 2000000;
 
-    if (!serial.is_open()) {
-      if (!serial.open(port, baudRate))
-        return -1;
-    }
+  // exchanges in a row without a byte back before the link counts as down,
+  // a port that is still there but has nobody behind it never errors
+  constexpr static int max_silent = 3;
 
-    if (serial.write(in, in_size) != in_size)
-      return -1;
+  // keeps a burst well inside the hand controller's input buffer
+  constexpr static int max_batch_bytes = 128;
+
+  std::mutex port_mutex;
+  int silent = 0;  // port_mutex held
+
+  std::atomic<bool> online{false};
 
-    return serial.read(out, out_size);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool running = true;
+  bool lost = true;
+  bool notifying = false;
+  link_listener* listener = nullptr;
+
+  alpaca::counter_t connects{0};
+  alpaca::counter_t drops{0};
+
+  std::thread supervisor;
+
+  // port_mutex held
+  void drop() {
+    serial.close();
+    online.store(false, std::memory_order_release);
+    drops.fetch_add(1, std::memory_order_relaxed);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lost = true;
+    }
+    cv.notify_all();
   }
 
-  serial_protocol(std::string_view port, int baudRate)
-  : serial(), port(port), baudRate(baudRate) { }
+  // port_mutex held, `answered` is false for an exchange that got no byte back
+  void track(bool answered) {
+    if (answered)
+      silent = 0;
+    else if (++silent >= max_silent)
+      drop();
+  }
+
+  // opens the port and checks a mount echoes back
+  [[nodiscard]] bool connect() {
+    std::lock_guard<std::mutex> lock(port_mutex);
 
-  virtual ~serial_protocol() {
     if (serial.is_open())
       serial.close();
+
+    if (!serial.open(port, baudRate))
+      return false;
+
+    const message_t command = encode_command('K', static_cast<std::uint8_t>('x'));
+    message_t reply;
+
+    serial.discard_input();
+    if (serial.write(command.bytes.data(), command.size) == command.size)
+      reply.size = std::max(0, serial.read(
+        reply.bytes.data(), command.reply_size(), command.spec().expect.terminator,
+        command.spec().expect.timeout_micros));
+
+    std::uint8_t echoed;
+    if (!decode_reply(reply, &echoed) || echoed != 'x') {
+      serial.close();
+      return false;
+    }
+
+    silent = 0;
+    online.store(true, std::memory_order_release);
+    connects.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
   }
-};
 
-#if 0
-const siderealRate = 361 / (24 * 60 * 60);
+  void run() {
+    std::int64_t backoff_micros = min_backoff_micros;
+    std::unique_lock<std::mutex> lock(mutex);
 
-return [
-  {
-    Minimum: 2 * siderealRate,
-    Maximum: 2 * siderealRate,
-  },
-  {
-    Minimum: 4 * siderealRate,
-    Maximum: 4 * siderealRate,
-  },
-  {
-    Minimum: 8 * siderealRate,
-    Maximum: 8 * siderealRate,
-  },
-  {
-    Minimum: 16 * siderealRate,
-    Maximum: 16 * siderealRate,
-  },
-  {
+    while (running) {
+      cv.wait(lock, [this]() { return !running || lost; });
+      if (!running) break;
+
+      lock.unlock();
+      bool up = connect();
+      lock.lock();
+
+      if (up) {
+        lost = false;
+        backoff_micros = min_backoff_micros;
+
+        // the listener talks to the mount, the port must be free
+        if (link_listener* notify = listener) {
+          notifying = true;
+          lock.unlock();
+          notify->link_up();
+          lock.lock();
+          notifying = false;
+          cv.notify_all();
+        }
+        continue;
+      }
+
+      cv.wait_for(lock, std::chrono::microseconds(backoff_micros), [this]() { return !running; });
+      backoff_micros = std::min(backoff_micros * 2, max_backoff_micros);
+    }
+  }
+
+  // bytes of `data` that complete the reply of `slot`, -1 when more are needed
+  [[nodiscard]] static int reply_length(const batch_slot_t& slot, const std::uint8_t* data, int available) {
+    int limit = std::min(available, slot.out_size);
+
+    if (slot.expect.terminator >= 0 && limit > 0) {
+      const void* end = std::memchr(data, slot.expect.terminator, limit);
+      if (end != nullptr)
+        return static_cast<int>(static_cast<const std::uint8_t*>(end) - data) + 1;
+    }
+
+    return available >= slot.out_size ? slot.out_size : -1;
+  }
+
+ public:
+  serial_protocol(std::string_view port, int baudRate)
+  : serial(), port(port), baudRate(baudRate) {
+    supervisor = std::thread([this]() { run(); });
+  }
+
+  virtual ~serial_protocol() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+
+    cv.notify_all();
+    supervisor.join();
+
+    if (serial.is_open())
+      serial.close();
+  }
+
+  serial_protocol(const serial_protocol&) = delete;
+  serial_protocol& operator=(const serial_protocol&) = delete;
+
+  virtual int send_command(
+    const void* in, int in_size, void* out, int out_size, expect_t expect) override {
+    if (!online.load(std::memory_order_acquire))
+      return -1;
+
+    std::lock_guard<std::mutex> lock(port_mutex);
+
+    // dropped while waiting for the port
+    if (!serial.is_open())
+      return -1;
+
+    // late bytes of a timed out reply would be taken as this reply
+    serial.discard_input();
+
+    if (serial.write(in, in_size) != in_size) {
+      drop();
+      return -1;
+    }
+
+    int nbytes = serial.read(out, out_size, expect.terminator, expect.timeout_micros);
+    if (nbytes < 0)
+      drop();
+    else
+      track(nbytes > 0);
+
+    return nbytes;
+  }
+
+  // all commands go out in a single write, the replies are split on their
+  // terminator (binary ones on their full length) as they arrive, so the
+  // burst pays one turnaround instead of one per command
+  virtual void send_batch(std::span<batch_slot_t> slots) override {
+    int command_size = 0;
+    int reply_size = 0;
+
+    for (const auto& slot : slots) {
+      command_size += slot.in_size;
+      reply_size += slot.out_size;
+    }
+
+    if (slots.size() < 2 || command_size > max_batch_bytes || reply_size > max_batch_bytes) {
+      nexstar_protocol::send_batch(slots);
+      return;
+    }
+
+    for (auto& slot : slots)
+      slot.nbytes = -1;
+
+    if (!online.load(std::memory_order_acquire))
+      return;
+
+    std::lock_guard<std::mutex> lock(port_mutex);
+
+    if (!serial.is_open())
+      return;
+
+    serial.discard_input();
+
+    std::array<std::uint8_t, max_batch_bytes> commands;
+    int offset = 0;
+
+    for (const auto& slot : slots) {
+      std::memcpy(commands.data() + offset, slot.in, slot.in_size);
+      offset += slot.in_size;
+    }
+
+    if (serial.write(commands.data(), command_size) != command_size) {
+      drop();
+      return;
+    }
+
+    std::array<std::uint8_t, max_batch_bytes> replies;
+    int received = 0;
+    int consumed = 0;
+
+    for (auto& slot : slots) {
+      int length;
+      bool timed_out = false;
+
+      while ((length = reply_length(slot, replies.data() + consumed, received - consumed)) < 0) {
+        int nbytes = serial.read(
+          replies.data() + received, consumed + slot.out_size - received,
+          slot.expect.terminator, slot.expect.timeout_micros);
+
+        if (nbytes < 0) {
+          drop();
+          return;
+        }
+
+        if (nbytes == 0) {
+          length = received - consumed;
+          timed_out = true;
+          break;
+        }
+
+        received += nbytes;
+      }
+
+      std::memcpy(slot.out, replies.data() + consumed, length);
+      slot.nbytes = length;
+      consumed += length;
+
+      // the mount skipped a reply, later bytes can not be matched to a slot
+      if (timed_out) {
+        for (auto* rest = &slot + 1; rest != slots.data() + slots.size(); rest++)
+          rest->nbytes = 0;
+        break;
+      }
+    }
+
+    track(received > 0);
+  }
+
+  [[nodiscard]] virtual bool is_online() const override {
+    return online.load(std::memory_order_acquire);
+  }
+
+  // returns once a listener being replaced is no longer called
+  virtual void set_link_listener(link_listener* listener) override {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return !notifying; });
+      this->listener = listener;
+    }
+
+    // the link may have come up before there was anyone to tell
+    if (listener != nullptr && is_online())
+      listener->link_up();
+  }
+
+  virtual void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const override {
+    writer->gauge("alpaca_serial_link_up",
+      "Whether the serial link to the mount is up", labels,
+      is_online() ? 1 : 0);
+    writer->counter("alpaca_serial_connects_total",
+      "Times the serial link came up after a handshake", labels,
+      connects.load(std::memory_order_relaxed));
+    writer->counter("alpaca_serial_drops_total",
+      "Times the serial link was lost to a port error or a silent mount", labels,
+      drops.load(std::memory_order_relaxed));
+  }
+};
+
+#if 0
+const siderealRate = 361 / (24 * 60 * 60);
+
+return [
+  {
+    Minimum: 2 * siderealRate,
+    Maximum: 2 * siderealRate,
+  },
+  {
+    Minimum: 4 * siderealRate,
+    Maximum: 4 * siderealRate,
+  },
+  {
+    Minimum: 8 * siderealRate,
+    Maximum: 8 * siderealRate,
+  },
+  {
+    Minimum: 16 * siderealRate,
+    Maximum: 16 * siderealRate,
+  },
+  {
     Minimum: 32 * siderealRate,
     Maximum: 32 * siderealRate,
   },
@@ -1048,71 +989,668 @@ return [
   },
 #endif
 
-class celestron_telescope : public alpaca::telescope {
+// Times guide pulses on both axes from one timer thread. A pulse drives its
+// axis at the guide rate with a variable rate slew and the thread sends the
+// rate 0 that ends it, which hands the axis back to tracking. The mount
+// applies a rate before it acknowledges it, so both ends of a pulse are
+// taken at their acknowledgment: the stop goes out early by the round trip
+// stops have been taking. Pulses on different axes overlap freely, a new
+// pulse on a guiding axis replaces the running one.
+class pulse_guider {
+  using clock = std::chrono::steady_clock;
+
+  nexstar_protocol* protocol;
+
+  // one slew on the wire per axis, a stop must not overtake the start of
+  // the pulse that replaced it
+  std::array<std::mutex, 2> axis_mutex;
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  bool running = true;
+
+  struct pulse_state_t {
+    clock::time_point started;  // acknowledgment of the start
+    clock::time_point stop_at;
+    std::int64_t duration_micros;
+  };
+
+  std::array<std::optional<pulse_state_t>, 2> pulses;
+
+  // running estimate of the round trip of a stop, in micros
+  std::int64_t stop_lead_micros = 0;
+
+  alpaca::counter_t pulse_count{0};
+  alpaca::counter_t failures{0};
+  alpaca::histogram_t pulse_error;
+
+  std::thread worker;
+
+  [[nodiscard]] bool send_rate(int axis, float rate) {
+    return protocol->slew_variable(alpaca::move_t(axis, rate));
+  }
+
+  // axis_mutex[axis] held, a lost stop would leave the axis running so
+  // it is sent again once
+  void stop(int axis) {
+    auto sent = clock::now();
+    bool ok = send_rate(axis, 0.0f);
+    auto acknowledged = clock::now();
+
+    if (!ok) ok = send_rate(axis, 0.0f);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!ok) {
+      failures.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      auto round_trip = std::chrono::duration_cast<std::chrono::microseconds>(acknowledged - sent).count();
+      stop_lead_micros += (round_trip - stop_lead_micros) / 4;
+
+      if (pulses[axis]) {
+        auto length = std::chrono::duration_cast<std::chrono::microseconds>(acknowledged - pulses[axis]->started).count();
+        pulse_error.observe(std::abs(length - pulses[axis]->duration_micros));
+      }
+    }
+
+    pulses[axis].reset();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (running) {
+      int due = -1;
+      std::optional<clock::time_point> next;
+
+      for (int axis = 0; axis < 2; axis++) {
+        if (!pulses[axis]) continue;
+        if (!next || pulses[axis]->stop_at < *next) {
+          next = pulses[axis]->stop_at;
+          due = axis;
+        }
+      }
+
+      if (!next) {
+        cv.wait(lock);
+        continue;
+      }
+
+      if (clock::now() < *next) {
+        cv.wait_until(lock, *next);
+        continue;
+      }
+
+      clock::time_point stop_at = *next;
+      lock.unlock();
+
+      {
+        std::lock_guard<std::mutex> axis_lock(axis_mutex[due]);
+
+        // a pulse started meanwhile moved the stop, the loop picks it up
+        bool still_due;
+        {
+          std::lock_guard<std::mutex> relock(mutex);
+          still_due = pulses[due] && pulses[due]->stop_at == stop_at;
+        }
+
+        if (still_due)
+          stop(due);
+      }
+
+      lock.lock();
+    }
+  }
+
+ public:
+  explicit pulse_guider(nexstar_protocol* protocol)
+  : protocol(protocol)
+  , worker(&pulse_guider::run, this) {
+  }
+
+  ~pulse_guider() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+
+    cv.notify_one();
+    worker.join();
+  }
+
+  pulse_guider(const pulse_guider&) = delete;
+  pulse_guider& operator=(const pulse_guider&) = delete;
+
+  // axis 0 is right ascension (azimuth), 1 declination (altitude)
+  [[nodiscard]] bool pulse(int axis, float rate, int duration_millis) {
+    std::lock_guard<std::mutex> axis_lock(axis_mutex[axis]);
+
+    if (!send_rate(axis, rate)) {
+      failures.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    auto started = clock::now();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      const std::int64_t duration_micros = duration_millis * 1000ll;
+      const std::int64_t lead = std::min(stop_lead_micros, duration_micros);
+
+      pulses[axis] = pulse_state_t{
+        started, started + std::chrono::microseconds(duration_micros - lead), duration_micros
+      };
+    }
+
+    pulse_count.fetch_add(1, std::memory_order_relaxed);
+    cv.notify_one();
+
+    return true;
+  }
+
+  [[nodiscard]] bool is_guiding() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pulses[0].has_value() || pulses[1].has_value();
+  }
+
+  // stops whatever is guiding now, for abortslew and disconnects
+  void cancel() {
+    for (int axis = 0; axis < 2; axis++) {
+      std::lock_guard<std::mutex> axis_lock(axis_mutex[axis]);
+
+      bool guiding;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        guiding = pulses[axis].has_value();
+      }
+
+      if (guiding)
+        stop(axis);
+    }
+  }
+
+  void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const {
+    writer->counter("alpaca_guide_pulses_total",
+      "Guide pulses started", labels,
+      pulse_count.load(std::memory_order_relaxed));
+    writer->counter("alpaca_guide_failures_total",
+      "Guide pulses that could not be started or stopped", labels,
+      failures.load(std::memory_order_relaxed));
+    writer->histogram("alpaca_guide_pulse_error_seconds",
+      "Difference between the requested and the acknowledged pulse length", labels,
+      pulse_error);
+  }
+};
+
+// Both values of a two value reply (RA/Dec, Azm/Alt) taken in one
+// transaction. Each half is handed out once within the coherence window,
+// so reading the paired property costs no round trip and comes from the
+// same instant, while reading the same property again goes to the mount.
+template<typename T>
+class paired_reading_t {
+  constexpr static std::int64_t coherence_window_micros = 250000;
+
+  std::mutex mutex;
+  std::optional<T> value;
+  alpaca::monotonic_t timestamp = {0};
+  std::uint8_t unread = 0;
+
+ public:
+  template<typename Fn>
+  [[nodiscard]] std::optional<T> get(int half, Fn&& read) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const std::uint8_t bit = static_cast<std::uint8_t>(1 << half);
+    alpaca::monotonic_t now = alpaca::monotonic_t::now();
+
+    if (value && (unread & bit) != 0 && now - timestamp <= coherence_window_micros) {
+      unread &= ~bit;
+      return value;
+    }
+
+    T reading = {0, 0};
+    if (!read(&reading)) {
+      value.reset();
+      unread = 0;
+      return std::nullopt;
+    }
+
+    value = reading;
+    timestamp = now;
+    unread = 0b11 & ~bit;
+
+    return value;
+  }
+
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    value.reset();
+    unread = 0;
+  }
+};
+
+class celestron_telescope : public alpaca::telescope, private link_listener {
   std::unique_ptr<nexstar_protocol> protocol;
 
+  mutable paired_reading_t<alpaca::coord_t> ra_de;
+  mutable paired_reading_t<alpaca::altazm_t> azm_alt;
+
+  // axes left running by moveaxis, the mount has no query for it
+  std::array<std::atomic<bool>, 2> axis_moving = {};
+
+  pulse_guider guider;
+
+  // deg/sec, half the sidereal rate until a client sets them
+  constexpr static float default_guide_rate = 0.5f * 15.041067f / 3600.0f;
+  constexpr static float max_guide_rate = 1.0f;
+
+  std::atomic<float> guide_rate_ra{default_guide_rate};
+  std::atomic<float> guide_rate_de{default_guide_rate};
+
+  // seconds a synchronous slew waits after the mount stopped
+  std::atomic<int> slew_settle_time{0};
+
+  struct site_t {
+    float latitude;
+    float longitude;
+  };
+
+  struct firmware_t {
+    std::int32_t major;
+    std::int32_t minor;
+  };
+
+  // the mount clock against the host's, which is the one kept disciplined
+  struct clock_sample_t {
+    std::int64_t offset_micros;  // mount minus host
+    alpaca::monotonic_t measured_at;
+  };
+
+  constexpr static std::int64_t clock_resync_micros = 600000000;
+
+  // the mount only reports whole seconds, smaller steps are its resolution
+  constexpr static std::int64_t clock_drift_warning_micros = 2000000;
+
+  // mount settings that only change through this driver. filled when the
+  // link comes up, written through on every successful put and dropped on
+  // disconnect (and when the link comes back, the mount may have been
+  // swapped) so they are read again.
+  struct mount_cache_t {
+    std::optional<site_t> site;
+    std::optional<alpaca::astronomy::observer_t> observer;  // follows site
+    std::optional<int> model;
+    std::optional<firmware_t> firmware;
+    std::optional<bool> aligned;
+    std::optional<clock_sample_t> clock;
+  };
+
+  mutable std::mutex cache_mutex;
+  mutable mount_cache_t cache;
+
+  // cache_mutex held
+  void emplace_observer(site_t site) const {
+    if (const alpaca::virtual_clock_t* clock = protocol->get_clock())
+      cache.observer.emplace(site.latitude, site.longitude, clock->utc(), clock->monotonic());
+    else
+      cache.observer.emplace(site.latitude, site.longitude);
+  }
+
+  [[nodiscard]] std::optional<site_t> read_site() const {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.site) return cache.site;
+    }
+
+    site_t site = {0, 0};
+    if (!protocol->get_location(&site.latitude, &site.longitude))
+      return std::nullopt;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.site = site;
+    emplace_observer(site);
+    return site;
+  }
+
+  [[nodiscard]] bool write_site(site_t site) {
+    if (!protocol->set_location(site.latitude, site.longitude))
+      return false;
+
+    // keep what the mount stores, it only has arcsecond resolution
+    const location_t stored{site.latitude, site.longitude};
+    (void) stored.parse(&site.latitude, &site.longitude);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.site = site;
+    emplace_observer(site);
+    return true;
+  }
+
+  // the observer of the site and its local sidereal time, on the protocol's
+  // clock when it has one
+  [[nodiscard]] std::optional<alpaca::sky_t> read_sky() const {
+    if (!read_site()) return std::nullopt;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    // a disconnect may have dropped the cache in between
+    if (!cache.observer) return std::nullopt;
+
+    if (const alpaca::virtual_clock_t* clock = protocol->get_clock()) {
+      alpaca::monotonic_t now = clock->monotonic();
+      cache.observer->refresh(clock->utc(), now);
+      return alpaca::sky_t{ *cache.observer, cache.observer->lst(now) };
+    }
+
+    cache.observer->refresh();
+    return alpaca::sky_t{ *cache.observer, cache.observer->lst() };
+  }
+
+  // local sidereal time in degrees
+  [[nodiscard]] std::optional<float> read_lst() const {
+    auto sky = read_sky();
+    if (!sky) return std::nullopt;
+
+    return sky->lst;
+  }
+
+  [[nodiscard]] std::optional<int> read_model() const {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.model) return cache.model;
+    }
+
+    int model = 0;
+    if (!protocol->get_model(&model))
+      return std::nullopt;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.model = model;
+    return model;
+  }
+
+  [[nodiscard]] std::optional<firmware_t> read_firmware() const {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.firmware) return cache.firmware;
+    }
+
+    firmware_t firmware = {0, 0};
+    if (!protocol->get_version(&firmware.major, &firmware.minor))
+      return std::nullopt;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.firmware = firmware;
+    return firmware;
+  }
+
+  // only changes through the hand controller, read once per link
+  [[nodiscard]] std::optional<bool> read_aligned() const {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.aligned) return cache.aligned;
+    }
+
+    bool aligned = false;
+    if (!protocol->is_aligned(&aligned))
+      return std::nullopt;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.aligned = aligned;
+    return aligned;
+  }
+
+  [[nodiscard]] alpaca::utcdate_t host_utc() const {
+    const alpaca::virtual_clock_t* clock = protocol->get_clock();
+    return clock != nullptr ? clock->utc() : alpaca::utcdate_t::now();
+  }
+
+  [[nodiscard]] alpaca::monotonic_t host_monotonic() const {
+    const alpaca::virtual_clock_t* clock = protocol->get_clock();
+    return clock != nullptr ? clock->monotonic() : alpaca::monotonic_t::now();
+  }
+
+  // cache_mutex held
+  void log_clock(const clock_sample_t& sample) const {
+    auto seconds = [](std::int64_t micros) { return static_cast<double>(micros) / 1000000.0; };
+
+    if (cache.clock) {
+      const std::int64_t drift = sample.offset_micros - cache.clock->offset_micros;
+      if (std::abs(drift) >= clock_drift_warning_micros)
+        alpaca::logger::instance().message(
+          alpaca::log_level_t::info, "mount clock drifted %+.1f s in %.0f min",
+          seconds(drift), seconds(sample.measured_at - cache.clock->measured_at) / 60.0);
+    } else if (std::abs(sample.offset_micros) >= clock_drift_warning_micros) {
+      alpaca::logger::instance().message(
+        alpaca::log_level_t::info, "mount clock is %+.1f s off the host clock",
+        seconds(sample.offset_micros));
+    }
+  }
+
+  // one read of the mount clock. it reports the second it is in, so on
+  // average it is half a second past what it says, and it was read about
+  // halfway through the round trip.
+  [[nodiscard]] std::optional<std::int64_t> measure_clock() const {
+    const alpaca::monotonic_t started = host_monotonic();
+    const alpaca::utcdate_t host = host_utc();
+
+    alpaca::utcdate_t mount = {0};
+    if (!protocol->get_utcdate(&mount))
+      return std::nullopt;
+
+    const std::int64_t half_trip = (host_monotonic() - started) / 2;
+    const clock_sample_t sample = {
+      static_cast<std::int64_t>(mount.micros) + 500000 - static_cast<std::int64_t>(host.micros) - half_trip,
+      started + half_trip
+    };
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    log_clock(sample);
+    cache.clock = sample;
+    return sample.offset_micros;
+  }
+
+  [[nodiscard]] std::optional<std::int64_t> read_clock_offset() const {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.clock && host_monotonic() - cache.clock->measured_at < clock_resync_micros)
+        return cache.clock->offset_micros;
+    }
+
+    return measure_clock();
+  }
+
+  void reset_cache() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache = mount_cache_t{};
+  }
+
+  // a link that is down fails every read at once, they are retried lazily
+  void warm_cache() const {
+    if (!protocol->is_online()) return;
+
+    (void) read_site();
+
+    (void) read_clock_offset();
+
+    auto model = read_model();
+    auto firmware = read_firmware();
+    auto aligned = read_aligned();
+
+    if (model && firmware && aligned)
+      alpaca::logger::instance().message(
+        alpaca::log_level_t::info, "%s firmware %d.%d, %s",
+        protocol->get_model_string(*model).c_str(), firmware->major, firmware->minor,
+        *aligned ? "aligned" : "not aligned");
+  }
+
+  // on the protocol's thread, before any request sees the link up
+  virtual void link_up() override {
+    reset_cache();
+    state_changed();
+    warm_cache();
+  }
+
+  [[nodiscard]] virtual bool is_link_up() const override {
+    return protocol->is_online();
+  }
+
+  [[nodiscard]] std::optional<alpaca::coord_t> read_ra_de(int half) const {
+    return ra_de.get(half, [this](alpaca::coord_t* coord) {
+      return protocol->get_ra_de(coord, false);
+    });
+  }
+
+  [[nodiscard]] std::optional<alpaca::altazm_t> read_azm_alt(int half) const {
+    return azm_alt.get(half, [this](alpaca::altazm_t* altazm) {
+      return protocol->get_azm_alt(altazm, false);
+    });
+  }
+
  public:
   celestron_telescope(
     const alpaca::telescopeinfo_t& info,
     std::unique_ptr<nexstar_protocol>&& protocol)
   : alpaca::telescope(info)
   , protocol(std::move(protocol))
-  { }
+  , guider(this->protocol.get())
+  {
+    this->protocol->set_link_listener(this);
+  }
+
+  virtual ~celestron_telescope() override {
+    protocol->set_link_listener(nullptr);
+  }
 
-  virtual ~celestron_telescope() override
-  { }
+  virtual void state_changed() override {
+    alpaca::telescope::state_changed();
+
+    ra_de.invalidate();
+    azm_alt.invalidate();
+  }
+
+  virtual void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const override {
+    alpaca::telescope::write_metrics(writer, labels);
+    guider.write_metrics(writer, labels);
+    protocol->write_metrics(writer, labels);
+  }
 
   // device
+  virtual alpaca::return_t<void> put_connected(bool connected) override {
+    if (connected != is_connected) {
+      // a serial link is opened and warmed at startup, connecting only
+      // reads what a disconnect dropped
+      if (connected) {
+        warm_cache();
+      } else {
+        guider.cancel();
+        reset_cache();
+      }
+    }
+
+    return alpaca::telescope::put_connected(connected);
+  }
+
   virtual alpaca::return_t<alpaca::deviceinfo_t> get_deviceinfo() const override {
-    int model = 0;
+    auto model = read_model();
+
+    return check_op(model.has_value())
+      .map([this, &model]() -> alpaca::deviceinfo_t {
+        // one daemon can drive several mounts, keep the ids apart
+        char unique_id[40];
+        std::snprintf(unique_id, sizeof(unique_id), "fb9472c8-6217-4140-9ebe-67d9ca07%04x",
+          static_cast<unsigned>((0x54c1 + device_number) & 0xffff));
 
-    return check_op(protocol->get_model(&model))
-      .map([this, model]() -> alpaca::deviceinfo_t {
         return {
-          .name = protocol->get_model_string(model),
+          .name = protocol->get_model_string(*model),
           .device_type = "telescope",
           .device_number = device_number,
-          .unique_id = "fb9472c8-6217-4140-9ebe-67d9ca0754c1"
+          .unique_id = unique_id
         };
       });
   }
 
   // telescope
+  virtual void get_telemetry(alpaca::telemetry_t* snapshot, std::uint32_t wanted) const override {
+    using field_t = alpaca::telemetry_field_t;
+
+    auto want = [wanted](field_t field) {
+      return (wanted & alpaca::telemetry_t::bit(field)) != 0;
+    };
+
+    mount_state_t state = {
+      {0, 0}, {0, 0}, false, tracking_mode_kind::off,
+      want(field_t::rightascension) || want(field_t::declination),
+      want(field_t::altitude) || want(field_t::azimuth),
+      want(field_t::slewing),
+      want(field_t::tracking)
+    };
+
+    protocol->get_mount_state(&state, false);
+
+    if (state.has_coord) {
+      snapshot->rightascension = state.coord.rightascension;
+      snapshot->declination = state.coord.declination;
+      snapshot->set(alpaca::telemetry_field_t::rightascension);
+      snapshot->set(alpaca::telemetry_field_t::declination);
+    }
+
+    if (state.has_altazm) {
+      snapshot->altitude = state.altazm.altitude;
+      snapshot->azimuth = state.altazm.azimuth;
+      snapshot->set(alpaca::telemetry_field_t::altitude);
+      snapshot->set(alpaca::telemetry_field_t::azimuth);
+    }
+
+    if (state.has_slewing) {
+      snapshot->slewing = state.slewing;
+      snapshot->set(alpaca::telemetry_field_t::slewing);
+    }
+
+    if (state.has_tracking_mode) {
+      snapshot->tracking = state.tracking_mode != tracking_mode_kind::off;
+      snapshot->set(alpaca::telemetry_field_t::tracking);
+    }
+
+    // resyncs the clock model on the poller's thread every
+    // clock_resync_micros, a GET only measures when nothing polls
+    (void) read_clock_offset();
+  }
 
   // read-only properties
   virtual alpaca::return_t<float> get_altitude() const override {
-    alpaca::altazm_t altazm = {0, 0};
+    auto altazm = read_azm_alt(0);
 
-    return check_op(protocol->get_azm_alt(&altazm, false))
-      .map([altazm]() {
-        return altazm.altitude;
+    return check_op(altazm.has_value())
+      .map([&altazm]() {
+        return altazm->altitude;
       });
   }
 
   virtual alpaca::return_t<float> get_azimuth() const override {
-    alpaca::altazm_t altazm = {0, 0};
+    auto altazm = read_azm_alt(1);
 
-    return check_op(protocol->get_azm_alt(&altazm, false))
-      .map([altazm]() {
-        return altazm.azimuth;
+    return check_op(altazm.has_value())
+      .map([&altazm]() {
+        return altazm->azimuth;
       });
   }
 
   virtual alpaca::return_t<float> get_declination() const override {
-    alpaca::coord_t coord = {0, 0};
+    auto coord = read_ra_de(1);
 
-    return check_op(protocol->get_ra_de(&coord, false))
-      .map([coord]() {
-        return coord.declination;
+    return check_op(coord.has_value())
+      .map([&coord]() {
+        return coord->declination;
       });
   }
 
   virtual alpaca::return_t<float> get_rightascension() const override {
-    alpaca::coord_t coord = {0, 0};
+    auto coord = read_ra_de(0);
 
-    return check_op(protocol->get_ra_de(&coord, false))
-      .map([coord]() {
-         return coord.rightascension;
+    return check_op(coord.has_value())
+      .map([&coord]() {
+         return coord->rightascension;
       });
   }
 
@@ -1125,7 +1663,44 @@ class celestron_telescope : public alpaca::telescope {
   }
 
   virtual alpaca::return_t<bool> get_ispulseguiding() const override {
-    return false;
+    return guider.is_guiding();
+  }
+
+  virtual bool is_moving() const override {
+    return axis_moving[0].load(std::memory_order_relaxed)
+      || axis_moving[1].load(std::memory_order_relaxed)
+      || guider.is_guiding();
+  }
+
+  virtual alpaca::return_t<int> get_slewsettletime() const override {
+    return slew_settle_time.load(std::memory_order_relaxed);
+  }
+
+  virtual alpaca::return_t<void> put_slewsettletime(int seconds) override {
+    slew_settle_time.store(seconds, std::memory_order_relaxed);
+    return {};
+  }
+
+  virtual alpaca::return_t<float> get_guideratedeclination() const override {
+    return guide_rate_de.load(std::memory_order_relaxed);
+  }
+
+  virtual alpaca::return_t<void> put_guideratedeclination(float rate) override {
+    if (!(rate > 0.0f && rate <= max_guide_rate)) return alpaca::invalid_value();
+
+    guide_rate_de.store(rate, std::memory_order_relaxed);
+    return {};
+  }
+
+  virtual alpaca::return_t<float> get_guideraterightascension() const override {
+    return guide_rate_ra.load(std::memory_order_relaxed);
+  }
+
+  virtual alpaca::return_t<void> put_guideraterightascension(float rate) override {
+    if (!(rate > 0.0f && rate <= max_guide_rate)) return alpaca::invalid_value();
+
+    guide_rate_ra.store(rate, std::memory_order_relaxed);
+    return {};
   }
 
   virtual alpaca::return_t<bool> get_slewing() const override {
@@ -1137,52 +1712,74 @@ class celestron_telescope : public alpaca::telescope {
   }
 
   virtual alpaca::return_t<float> get_siderealtime() const override {
-    float latitude = 0, longitude = 0;
+    auto lst = read_lst();
+
+    return check_op(lst.has_value())
+      .map([&lst]() {
+        return *lst / 15.0f;
+      });
+  }
+
+  virtual alpaca::return_t<alpaca::sky_t> get_sky() const override {
+    auto sky = read_sky();
 
-    return check_op(protocol->get_location(&latitude, &longitude))
-      .map([longitude]() {
-        return alpaca::astronomy::to_lst(alpaca::utcdate_t::now(), longitude) / 15.0f;
+    return check_op(sky.has_value())
+      .map([&sky]() {
+        return *sky;
       });
   }
 
+  virtual alpaca::return_t<void> get_horizontalcoordinates(
+    const alpaca::targets_t& targets, std::span<float> azimuth, std::span<float> altitude) const override {
+    auto sky = read_sky();
+    if (!sky) return check_op(false);
+
+    alpaca::astronomy::ra_de_to_azm_alt(
+      sky->observer, sky->lst,
+      targets.rightascension, targets.declination,
+      azimuth, altitude);
+
+    return {};
+  }
+
   virtual alpaca::return_t<alpaca::destination_side_of_pier_t> get_destinationsideofpier(const alpaca::coord_t&) const override {
     return alpaca::destination_side_of_pier_t::pier_unknown;
   }
 
   // read-wrie properties
   virtual alpaca::return_t<float> get_sitelatitude() const override {
-    float latitude = 0, longitude = 0;
+    auto site = read_site();
 
-    return check_op(protocol->get_location(&latitude, &longitude))
-      .map([latitude]() {
-        return latitude;
+    return check_op(site.has_value())
+      .map([&site]() {
+        return site->latitude;
       });
   }
 
   virtual alpaca::return_t<void> put_sitelatitude(float angle) override {
-    float latitude = 0, longitude = 0;
+    auto site = read_site();
 
-    return check_op(protocol->get_location(&latitude, &longitude))
-      .flat_map([this, angle, longitude]() {
-        return check_op(protocol->set_location(angle, longitude));
+    return check_op(site.has_value())
+      .flat_map([this, angle, &site]() {
+        return check_op(write_site({angle, site->longitude}));
       });
   }
 
   virtual alpaca::return_t<float> get_sitelongitude() const override {
-    float latitude = 0, longitude = 0;
+    auto site = read_site();
 
-    return check_op(protocol->get_location(&latitude, &longitude))
-      .map([longitude]() {
-        return longitude;
+    return check_op(site.has_value())
+      .map([&site]() {
+        return site->longitude;
       });
   }
 
   virtual alpaca::return_t<void> put_sitelongitude(float angle) override {
-    float latitude = 0, longitude = 0;
+    auto site = read_site();
 
-    return check_op(protocol->get_location(&latitude, &longitude))
-      .flat_map([this, latitude, angle]() {
-        return check_op(protocol->set_location(latitude, angle));
+    return check_op(site.has_value())
+      .flat_map([this, angle, &site]() {
+        return check_op(write_site({site->latitude, angle}));
       });
   }
 
@@ -1233,17 +1830,40 @@ class celestron_telescope : public alpaca::telescope {
     return {};
   }
 
+  // the host clock moved by the offset of the mount's, no serial i/o
+  // between resyncs
   virtual alpaca::return_t<void> get_utctm(alpaca::utcdate_t* utcdate) const override {
-    return check_op(protocol->get_utcdate(utcdate));
+    auto offset = read_clock_offset();
+
+    return check_op(offset.has_value())
+      .map([this, utcdate, &offset]() {
+        *utcdate = { static_cast<std::uint64_t>(static_cast<std::int64_t>(host_utc().micros) + *offset) };
+      });
   }
 
   virtual alpaca::return_t<void> put_utctm(alpaca::utcdate_t utcdate) override {
-    return check_op(protocol->set_utcdate(utcdate));
+    return check_op(protocol->set_utcdate(utcdate))
+      .map([this, utcdate]() {
+        // a clock set on purpose is not drift
+        const clock_sample_t sample = {
+          static_cast<std::int64_t>(utcdate.micros) - static_cast<std::int64_t>(host_utc().micros),
+          host_monotonic()
+        };
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache.clock = sample;
+      });
   }
 
   // operations
   virtual alpaca::return_t<void> abortslew() override {
-    return check_op(protocol->cancel_goto());
+    guider.cancel();
+
+    return check_op(protocol->cancel_goto())
+      .map([this]() {
+        for (auto& moving : axis_moving)
+          moving.store(false, std::memory_order_relaxed);
+      });
   }
 
   virtual alpaca::return_t<void> findhome() override {
@@ -1251,30 +1871,38 @@ class celestron_telescope : public alpaca::telescope {
   }
 
   virtual alpaca::return_t<void> moveaxis(const alpaca::move_t& move) override {
-    return check_op(protocol->slew_variable(move));
+    return check_op(protocol->slew_variable(move))
+      .map([this, &move]() {
+        if (move.axis >= 0 && move.axis < 2)
+          axis_moving[move.axis].store(move.rate != 0, std::memory_order_relaxed);
+      });
   }
 
   virtual alpaca::return_t<void> park() override {
     return {};
   }
 
-  virtual alpaca::return_t<void> pulseguide(const alpaca::pulse_t&) override {
-    return {};
-  }
+  // north and south move declination, east and west right ascension
+  virtual alpaca::return_t<void> pulseguide(const alpaca::pulse_t& pulse) override {
+    enum { north = 0, south = 1, east = 2, west = 3 };
 
-  virtual alpaca::return_t<void> setpark() override {
-    return {};
-  }
+    if (pulse.direction < north || pulse.direction > west || pulse.duration < 0)
+      return alpaca::invalid_value();
 
-  virtual alpaca::return_t<void> slewtoaltaz(const alpaca::altazm_t&) override {
-    return {};
+    const bool declination = pulse.direction == north || pulse.direction == south;
+    const float rate = declination
+      ? guide_rate_de.load(std::memory_order_relaxed)
+      : guide_rate_ra.load(std::memory_order_relaxed);
+    const bool positive = pulse.direction == north || pulse.direction == west;
+
+    return check_op(guider.pulse(declination ? 1 : 0, positive ? rate : -rate, pulse.duration));
   }
 
-  virtual alpaca::return_t<void> slewtoaltazasync(const alpaca::altazm_t&) override {
+  virtual alpaca::return_t<void> setpark() override {
     return {};
   }
 
-  virtual alpaca::return_t<void> slewtocoordinates(const alpaca::coord_t&) override {
+  virtual alpaca::return_t<void> slewtoaltazasync(const alpaca::altazm_t&) override {
     return {};
   }
 
@@ -1283,10 +1911,6 @@ class celestron_telescope : public alpaca::telescope {
     return check_op(protocol->goto_ra_de(target, false));
   }
 
-  virtual alpaca::return_t<void> slewtotarget() override {
-    return {};
-  }
-
   virtual alpaca::return_t<void> slewtotargetasync() override {
     return check_op(protocol->goto_ra_de(target, false));
   }
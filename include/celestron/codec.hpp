@@ -0,0 +1,644 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_CELESTRON_CODEC_HPP_
+#define INCLUDE_CELESTRON_CODEC_HPP_
+
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+
+#include <astronomy.hpp>
+#include <time.hpp>
+
+namespace celestron {
+
+enum class tracking_mode_kind : std::uint8_t {
+  off      = 0,
+  alt_azm  = 1,
+  eq_north = 2,
+  eq_south = 3
+};
+
+  //dev
+  // 16 = azm/ra motor
+  // 17 = alt/de motor
+  // 176 = gps
+  // 178 = rtc
+enum class device_kind : std::uint8_t {
+  azm_motor = 16,
+  alt_motor = 17,
+  gps       = 176,
+  rtc       = 178
+};
+
+enum class passthrough_command_kind : std::uint8_t {
+  slew_variable_positive = 6,
+  slew_variable_negative = 7,
+  slew_fixed_positive = 36,
+  slew_fixed_negative = 37,
+
+  // [ 'P', req_size, dev, cmd/arg0, arg1, arg2, arg3, resp_size ]
+
+  // azm motor
+  // + var azm    = 3, 16, 6, hi, lo, 0, 0
+  // - var azm    = 3, 16, 7, hi, lo, 0, 0
+  // + fix azm    = 2, 16, 36, rate, 0, 0, 0
+  // - fix azm    = 2, 16, 37, rate, 0, 0, 0
+
+  // alt motor
+  // + var alt    = 3, 17, 6, hi, lo, 0, 0
+  // - var alt    = 3, 17, 7, hi, lo, 0, 0
+  // + fix azm    = 2, 17, 36, rate, 0, 0, 0
+  // - fix azm    = 2, 17, 37, rate, 0, 0, 0
+
+  //gps
+  //is gps linked = 1, 176, 55, 0, 0, 0, 1
+  //get latitude  = 1, 176, 1, 0, 0, 0, 3
+  //get longitude = 1, 176, 2, 0, 0, 0, 3
+  //get date      = 1, 176, 3, 0, 0, 0, 2
+  //get year      = 1, 176, 4, 0, 0, 0, 2
+  //get time      = 1, 176, 51, 0, 0, 0, 3
+
+  //rtc
+  //get date      = 1, 178, 3, 0, 0, 0, 2
+  //get year      = 1, 178, 4, 0, 0, 0, 2
+  //get time      = 1, 178, 51, 0, 0, 0, 3
+  //set date      = 3, 178, 131, x, y, 0, 0
+  //set year      = 3, 178, 132, x, y, 0, 0
+  //set time      = 4, 178, 179, x, y, z, 0
+
+  //misc
+  //get dev ver   = 1, dev, 254, 0, 0, 0, 2
+
+};
+
+// how the reply to a command is delimited on the wire
+struct expect_t {
+  // '#' for ascii replies, which also end early on errors. binary payloads
+  // can contain 0x23 so they are only complete at their full length (-1).
+  int terminator;
+  std::int64_t timeout_micros;
+};
+
+// deadlines are generous compared to the wire time, 18 bytes at 9600
+// baud take ~19ms, the hand controller may need longer to apply a setting
+constexpr expect_t ascii_query  = { '#',  250000 };
+constexpr expect_t binary_query = { -1,   250000 };
+constexpr expect_t ascii_set    = { '#', 1000000 };
+
+// How a command goes on the wire. Sizes count the command letter and the
+// reply's '#'. Passthrough replies also carry the bytes asked for in the
+// last byte of the command.
+struct command_spec_t {
+  char letter;   // 0 for commands the mount does not know
+  char variant;  // the same command at the other precision, 0 for none
+  bool precise;  // 32 bit instead of 16 bit positions
+  bool query;    // only reads mount state
+  std::uint8_t request_size;
+  std::uint8_t reply_size;
+  expect_t expect;
+};
+
+constexpr command_spec_t command_specs[] = {
+  { 'K', 0,   false, false,  2,  2, binary_query },  // echo
+  { 'V', 0,   false, true,   1,  3, binary_query },  // version
+  { 'm', 0,   false, true,   1,  2, binary_query },  // model
+  { 'J', 0,   false, true,   1,  2, binary_query },  // alignment complete
+  { 'h', 0,   false, true,   1,  9, binary_query },  // get time
+  { 'H', 0,   false, false,  9,  1, ascii_set },     // set time
+  { 'w', 0,   false, true,   1,  9, binary_query },  // get location
+  { 'W', 0,   false, false,  9,  1, ascii_set },     // set location
+  { 'E', 'e', false, true,   1, 10, ascii_query },   // get ra/de
+  { 'e', 'E', true,  true,   1, 18, ascii_query },
+  { 'Z', 'z', false, true,   1, 10, ascii_query },   // get azm/alt
+  { 'z', 'Z', true,  true,   1, 18, ascii_query },
+  { 'R', 'r', false, false, 10,  1, ascii_set },     // goto ra/de
+  { 'r', 'R', true,  false, 18,  1, ascii_set },
+  { 'B', 'b', false, false, 10,  1, ascii_set },     // goto azm/alt
+  { 'b', 'B', true,  false, 18,  1, ascii_set },
+  { 'S', 's', false, false, 10,  1, ascii_set },     // sync ra/de
+  { 's', 'S', true,  false, 18,  1, ascii_set },
+  { 't', 0,   false, true,   1,  2, binary_query },  // get tracking mode
+  { 'T', 0,   false, false,  2,  1, ascii_set },     // set tracking mode
+  { 'L', 0,   false, true,   1,  2, ascii_query },   // goto in progress
+  { 'M', 0,   false, false,  1,  1, ascii_set },     // cancel goto
+  { 'P', 0,   false, false,  8,  1, ascii_set },     // passthrough
+};
+
+// indexed by command letter
+constexpr std::array<command_spec_t, 128> command_table = [] {
+  std::array<command_spec_t, 128> table{};
+  for (const auto& spec : command_specs)
+    table[static_cast<std::uint8_t>(spec.letter)] = spec;
+  return table;
+}();
+
+[[nodiscard]] constexpr const command_spec_t& command_spec(std::uint8_t letter) {
+  return command_table[letter < command_table.size() ? letter : 0];
+}
+
+// hex the mount reads and writes for positions, always upper case
+constexpr std::array<char, 16> hex_digits = {
+  '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+constexpr void encode_hex(std::uint32_t value, int digits, std::uint8_t* out) {
+  for (int i = 0; i < digits; i++)
+    out[i] = static_cast<std::uint8_t>(hex_digits[(value >> ((digits - 1 - i) * 4)) & 0xf]);
+}
+
+// either case, every digit is decoded with masks so a reply costs the same
+// whatever its digits are
+[[nodiscard]] constexpr bool decode_hex(const std::uint8_t* in, int digits, std::uint32_t* value) {
+  std::uint32_t result = 0;
+  std::uint32_t valid = 1;
+
+  for (int i = 0; i < digits; i++) {
+    const std::uint32_t digit = static_cast<std::uint32_t>(in[i]) - '0';
+    const std::uint32_t letter = (static_cast<std::uint32_t>(in[i]) | 0x20) - 'a';
+
+    const std::uint32_t is_digit = digit < 10;
+    const std::uint32_t is_letter = letter < 6;
+
+    result = result << 4 | (digit & (0u - is_digit)) | ((letter + 10) & (0u - is_letter));
+    valid &= is_digit | is_letter;
+  }
+
+  *value = result;
+  return valid != 0;
+}
+
+// a command or a reply as it goes on the wire
+struct message_t {
+  constexpr static int capacity = 18;
+
+  std::array<std::uint8_t, capacity> bytes{};
+  int size = 0;
+
+  constexpr message_t() = default;
+
+  constexpr void push(std::uint8_t byte) {
+    bytes[size++] = byte;
+  }
+
+  [[nodiscard]] constexpr const command_spec_t& spec() const {
+    return command_spec(bytes[0]);
+  }
+
+  // bytes the reply to this command takes
+  [[nodiscard]] constexpr int reply_size() const {
+    return bytes[0] == 'P' ? bytes[7] + 1 : spec().reply_size;
+  }
+
+  // the reply is complete and ends in '#'
+  [[nodiscard]] constexpr bool is_reply(int expected) const {
+    return size == expected && bytes[size - 1] == '#';
+  }
+};
+
+// payloads that go on the wire as a fixed number of raw bytes
+template<typename Payload>
+concept wire_payload_t = requires(const Payload payload, std::uint8_t* out, const std::uint8_t* in) {
+  { Payload::size } -> std::convertible_to<int>;
+  payload.write(out);
+  { Payload::read(in) } -> std::same_as<Payload>;
+};
+
+struct location_t {
+  constexpr static int size = 8;
+
+  std::uint8_t latitude_degree;
+  std::uint8_t latitude_minute;
+  std::uint8_t latitude_second;
+  std::uint8_t is_south;
+  std::uint8_t longitude_degree;
+  std::uint8_t longitude_minute;
+  std::uint8_t longitude_second;
+  std::uint8_t is_west;
+
+  constexpr location_t() = default;
+
+  constexpr location_t(float latitude, float longitude) {
+    alpaca::astronomy::dms_t lat{ latitude };
+    alpaca::astronomy::dms_t lon{ longitude };
+
+    latitude_degree  = static_cast<std::uint8_t>(std::abs(lat.degree));
+    latitude_minute  = static_cast<std::uint8_t>(lat.minute);
+    latitude_second  = static_cast<std::uint8_t>(lat.second);
+    is_south         = static_cast<std::uint8_t>(lat.negative ? 1 : 0);
+    longitude_degree = static_cast<std::uint8_t>(std::abs(lon.degree));
+    longitude_minute = static_cast<std::uint8_t>(lon.minute);
+    longitude_second = static_cast<std::uint8_t>(lon.second);
+    is_west          = static_cast<std::uint8_t>(lon.negative ? 1 : 0);
+  }
+
+  constexpr void write(std::uint8_t* out) const {
+    out[0] = latitude_degree;
+    out[1] = latitude_minute;
+    out[2] = latitude_second;
+    out[3] = is_south;
+    out[4] = longitude_degree;
+    out[5] = longitude_minute;
+    out[6] = longitude_second;
+    out[7] = is_west;
+  }
+
+  [[nodiscard]] constexpr static location_t read(const std::uint8_t* in) {
+    location_t location;
+    location.latitude_degree  = in[0];
+    location.latitude_minute  = in[1];
+    location.latitude_second  = in[2];
+    location.is_south         = in[3];
+    location.longitude_degree = in[4];
+    location.longitude_minute = in[5];
+    location.longitude_second = in[6];
+    location.is_west          = in[7];
+    return location;
+  }
+
+  [[nodiscard]] constexpr auto parse(float* latitude, float* longitude) const -> bool {
+    alpaca::astronomy::dms_t lat{ latitude_degree, latitude_minute, latitude_second };
+    alpaca::astronomy::dms_t lon{ longitude_degree, longitude_minute, longitude_second };
+
+    *latitude = is_south == 1 ? -lat.to_decimal() : +lat.to_decimal();
+    *longitude = is_west == 1 ? -lon.to_decimal() : +lon.to_decimal();
+
+    return true;
+  }
+};
+
+struct utcdate_t {
+  constexpr static int size = 8;
+
+  std::uint8_t hour;
+  std::uint8_t minute;
+  std::uint8_t second;
+  std::uint8_t month;
+  std::uint8_t day;
+  std::uint8_t year;
+  std::uint8_t offset;
+  std::uint8_t isdst;
+
+  constexpr utcdate_t() = default;
+
+  // not constexpr, the local time comes from the tz database
+  utcdate_t(alpaca::utcdate_t utcdate, int offset_micros) {
+    utcdate += offset_micros;
+
+    std::tm local_tm;
+    utcdate.to_local_tm(&local_tm);
+
+    int gmt_offset = local_tm.tm_gmtoff/3600;
+
+    if (gmt_offset < 0)
+      gmt_offset += 256;
+
+    hour   = static_cast<std::uint8_t>(local_tm.tm_hour); // hour (24 hour)
+    minute = static_cast<std::uint8_t>(local_tm.tm_min); // minutes
+    second = static_cast<std::uint8_t>(local_tm.tm_sec); // seconds
+    month  = static_cast<std::uint8_t>(local_tm.tm_mon + 1); // month
+    day    = static_cast<std::uint8_t>(local_tm.tm_mday); // day
+    year   = static_cast<std::uint8_t>(local_tm.tm_year + 1900 - 2000); // year (century is 20)
+    offset = static_cast<std::uint8_t>(gmt_offset); // gmt offset
+    isdst  = static_cast<std::uint8_t>(local_tm.tm_isdst > 0 ? 1 : 0); // 1 dst, 0 std time
+  }
+
+  constexpr void write(std::uint8_t* out) const {
+    out[0] = hour;
+    out[1] = minute;
+    out[2] = second;
+    out[3] = month;
+    out[4] = day;
+    out[5] = year;
+    out[6] = offset;
+    out[7] = isdst;
+  }
+
+  [[nodiscard]] constexpr static utcdate_t read(const std::uint8_t* in) {
+    utcdate_t date;
+    date.hour   = in[0];
+    date.minute = in[1];
+    date.second = in[2];
+    date.month  = in[3];
+    date.day    = in[4];
+    date.year   = in[5];
+    date.offset = in[6];
+    date.isdst  = in[7];
+    return date;
+  }
+
+  [[nodiscard]] auto parse(alpaca::utcdate_t* utcdate) const -> bool {
+    int gmt_offset = offset;
+
+    if (gmt_offset > 127)
+      gmt_offset -= 256;
+
+    std::tm local_tm;
+    local_tm.tm_hour   = hour;
+    local_tm.tm_min    = minute;
+    local_tm.tm_sec    = second;
+    local_tm.tm_mon    = month - 1;
+    local_tm.tm_mday   = day;
+    local_tm.tm_year   = year + 2000 - 1900;
+    local_tm.tm_gmtoff = gmt_offset;
+    local_tm.tm_isdst  = isdst;
+
+    *utcdate = alpaca::utcdate_t::from_local_tm(&local_tm);
+
+    return true;
+  }
+};
+
+struct version_t {
+  constexpr static int size = 2;
+
+  std::uint8_t major;
+  std::uint8_t minor;
+
+  constexpr version_t() = default;
+
+  constexpr version_t(std::uint8_t major, std::uint8_t minor)
+  : major(major)
+  , minor(minor)
+  { }
+
+  constexpr void write(std::uint8_t* out) const {
+    out[0] = major;
+    out[1] = minor;
+  }
+
+  [[nodiscard]] constexpr static version_t read(const std::uint8_t* in) {
+    return version_t(in[0], in[1]);
+  }
+
+  [[nodiscard]] constexpr auto parse(std::int32_t* major, std::int32_t* minor) const -> bool {
+    *major = this->major;
+    *minor = this->minor;
+    return true;
+  }
+};
+
+struct passthrough_command_t {
+  constexpr static int size = 8;
+
+  // [ 'P', req_size, dev, cmd/arg0, arg1, arg2, arg3, resp_size ]
+  std::uint8_t always_P;
+  std::uint8_t request_arguments;
+  device_kind device;
+  passthrough_command_kind command;
+  std::uint8_t args[3];
+  std::uint8_t response_arguments;
+
+  constexpr passthrough_command_t() = default;
+
+  constexpr passthrough_command_t(device_kind device, passthrough_command_kind command, char arg0, char arg1, char arg2, char args_size, char response_size) {
+    this->always_P = 'P';
+    this->request_arguments = args_size + 1;
+    this->device = device;
+    this->command = command;
+    this->args[0] = arg0;
+    this->args[1] = arg1;
+    this->args[2] = arg2;
+    this->response_arguments = response_size;
+  }
+
+  constexpr void write(std::uint8_t* out) const {
+    out[0] = always_P;
+    out[1] = request_arguments;
+    out[2] = static_cast<std::uint8_t>(device);
+    out[3] = static_cast<std::uint8_t>(command);
+    out[4] = args[0];
+    out[5] = args[1];
+    out[6] = args[2];
+    out[7] = response_arguments;
+  }
+
+  [[nodiscard]] constexpr static passthrough_command_t read(const std::uint8_t* in) {
+    passthrough_command_t passthrough;
+    passthrough.always_P = in[0];
+    passthrough.request_arguments = in[1];
+    passthrough.device = static_cast<device_kind>(in[2]);
+    passthrough.command = static_cast<passthrough_command_kind>(in[3]);
+    passthrough.args[0] = in[4];
+    passthrough.args[1] = in[5];
+    passthrough.args[2] = in[6];
+    passthrough.response_arguments = in[7];
+    return passthrough;
+  }
+};
+
+std::ostream& operator<<(std::ostream& os, const passthrough_command_t& p) {
+  std::cout << p.always_P << std::endl;
+  std::cout << static_cast<int>(p.request_arguments) << std::endl;
+  std::cout << static_cast<int>(p.device) << std::endl;
+  std::cout << static_cast<int>(p.command) << std::endl;
+  std::cout << static_cast<int>(p.args[0]) << std::endl;
+  std::cout << static_cast<int>(p.args[1]) << std::endl;
+  std::cout << static_cast<int>(p.args[2]) << std::endl;
+  std::cout << static_cast<int>(p.response_arguments) << std::endl;
+  return os;
+}
+
+// commands
+
+[[nodiscard]] constexpr message_t encode_command(char letter) {
+  message_t message;
+  message.push(static_cast<std::uint8_t>(letter));
+  return message;
+}
+
+[[nodiscard]] constexpr message_t encode_command(char letter, std::uint8_t argument) {
+  message_t message = encode_command(letter);
+  message.push(argument);
+  return message;
+}
+
+template<wire_payload_t Payload>
+[[nodiscard]] constexpr message_t encode_command(char letter, const Payload& payload) {
+  message_t message = encode_command(letter);
+  payload.write(message.bytes.data() + message.size);
+  message.size += Payload::size;
+  return message;
+}
+
+// the passthrough carries its own 'P'
+[[nodiscard]] constexpr message_t encode_command(const passthrough_command_t& passthrough) {
+  message_t message;
+  passthrough.write(message.bytes.data());
+  message.size = passthrough_command_t::size;
+  return message;
+}
+
+// "XXXX,YYYY" or "XXXXXXXX,YYYYYYYY" at `out`
+constexpr void encode_pair(std::uint32_t first, std::uint32_t second, bool precise, std::uint8_t* out) {
+  const int digits = precise ? 8 : 4;
+
+  encode_hex(first, digits, out);
+  out[digits] = ',';
+  encode_hex(second, digits, out + digits + 1);
+}
+
+[[nodiscard]] constexpr bool decode_pair(const std::uint8_t* in, bool precise, std::uint32_t* first, std::uint32_t* second) {
+  const int digits = precise ? 8 : 4;
+
+  bool ok_first = decode_hex(in, digits, first);
+  bool ok_second = decode_hex(in + digits + 1, digits, second);
+
+  return ok_first & ok_second & (in[digits] == ',');
+}
+
+// a goto or sync with its two positions, the letter picks the precision
+[[nodiscard]] constexpr message_t encode_command(char letter, std::uint32_t first, std::uint32_t second) {
+  message_t message = encode_command(letter);
+  encode_pair(first, second, message.spec().precise, message.bytes.data() + 1);
+  message.size = message.spec().request_size;
+  return message;
+}
+
+// positions of a goto or sync, false when it is not one of the right length
+[[nodiscard]] constexpr bool decode_command(
+  const std::uint8_t* in, int in_size, std::uint32_t* first, std::uint32_t* second) {
+  const command_spec_t& spec = command_spec(in[0]);
+  if (in_size != spec.request_size || in_size < 10) return false;
+
+  return decode_pair(in + 1, spec.precise, first, second);
+}
+
+// rate in degrees per second, the hand controller takes it in units of
+// 1/4 arcsecond per second
+[[nodiscard]] constexpr message_t encode_slew_variable(int axis, float rate) {
+  int rate_abs = static_cast<int>(std::abs(rate * 3600 * 4));
+
+  passthrough_command_kind command = rate >= 0
+      ? passthrough_command_kind::slew_variable_negative
+      : passthrough_command_kind::slew_variable_positive;
+
+  device_kind device = axis == 0
+      ? device_kind::azm_motor
+      : device_kind::alt_motor;
+
+  char hi = static_cast<char>((rate_abs >> 8) & 0xff);
+  char lo = static_cast<char>(rate_abs & 0xff);
+
+  return encode_command(passthrough_command_t(device, command, hi, lo, 0, 2, 0));
+}
+
+[[nodiscard]] constexpr bool decode_slew_variable(const std::uint8_t* in, int in_size, int* axis, float* rate) {
+  if (in_size != passthrough_command_t::size || in[0] != 'P') return false;
+
+  const passthrough_command_t cmd = passthrough_command_t::read(in);
+  std::int32_t rate_int = cmd.args[0] << 8 | cmd.args[1];
+
+  switch (cmd.device) {
+    case device_kind::azm_motor:
+      *axis = 0;
+      break;
+
+    case device_kind::alt_motor:
+      *axis = 1;
+      break;
+
+    default:
+      return false;
+  }
+
+  switch (cmd.command) {
+    case passthrough_command_kind::slew_variable_positive:
+      *rate = +rate_int / (3600.0f * 4);
+      break;
+
+    case passthrough_command_kind::slew_variable_negative:
+      *rate = -rate_int / (3600.0f * 4);
+      break;
+
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+// replies
+
+[[nodiscard]] constexpr message_t encode_ack() {
+  message_t message;
+  message.push('#');
+  return message;
+}
+
+[[nodiscard]] constexpr message_t encode_reply(std::uint8_t value) {
+  message_t message;
+  message.push(value);
+  message.push('#');
+  return message;
+}
+
+template<wire_payload_t Payload>
+[[nodiscard]] constexpr message_t encode_reply(const Payload& payload) {
+  message_t message;
+  payload.write(message.bytes.data());
+  message.size = Payload::size;
+  message.push('#');
+  return message;
+}
+
+[[nodiscard]] constexpr message_t encode_reply(std::uint32_t first, std::uint32_t second, bool precise) {
+  message_t message;
+  encode_pair(first, second, precise, message.bytes.data());
+  message.size = precise ? 17 : 9;
+  message.push('#');
+  return message;
+}
+
+[[nodiscard]] constexpr bool decode_ack(const message_t& reply) {
+  return reply.is_reply(1);
+}
+
+[[nodiscard]] constexpr bool decode_reply(const message_t& reply, std::uint8_t* value) {
+  if (!reply.is_reply(2)) return false;
+
+  *value = reply.bytes[0];
+  return true;
+}
+
+template<wire_payload_t Payload>
+[[nodiscard]] constexpr bool decode_reply(const message_t& reply, Payload* payload) {
+  if (!reply.is_reply(Payload::size + 1)) return false;
+
+  *payload = Payload::read(reply.bytes.data());
+  return true;
+}
+
+[[nodiscard]] constexpr bool decode_reply(
+  const message_t& reply, bool precise, std::uint32_t* first, std::uint32_t* second) {
+  if (!reply.is_reply(precise ? 18 : 10)) return false;
+
+  return decode_pair(reply.bytes.data(), precise, first, second);
+}
+
+static_assert(command_spec('e').reply_size == 18 && command_spec('E').variant == 'e');
+static_assert(command_spec('r').request_size == 18 && command_spec('R').request_size == 10);
+static_assert(command_spec(0xc5).letter == 0);
+static_assert(encode_command('R', 0x12ab, 0xffff).bytes[5] == ',');
+static_assert(encode_command('r', 0x12ab, 0xffff).bytes[8] == 'B');
+static_assert(encode_slew_variable(1, -1.0f).size == command_spec('P').request_size);
+static_assert(encode_slew_variable(1, -1.0f).reply_size() == 1);
+static_assert([] {
+  std::uint32_t first = 0, second = 0;
+  return decode_reply(encode_reply(0x89abcdefu, 0x01234567u, true), true, &first, &second)
+    && first == 0x89abcdefu && second == 0x01234567u;
+}());
+static_assert([] {
+  // a site within a degree south and west of 0, 0
+  float latitude = 0, longitude = 0;
+  const location_t location(-0.5f, -0.25f);
+  return location.is_south == 1 && location.is_west == 1 && location.latitude_minute == 30
+    && location.parse(&latitude, &longitude) && latitude == -0.5f && longitude == -0.25f;
+}());
+
+}  // namespace celestron
+
+#endif  // INCLUDE_CELESTRON_CODEC_HPP_
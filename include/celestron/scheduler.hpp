@@ -0,0 +1,430 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_CELESTRON_SCHEDULER_HPP_
+#define INCLUDE_CELESTRON_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <celestron/celestron.hpp>
+
+namespace celestron {
+
+// Owns the underlying protocol and runs every transaction on a single i/o
+// thread, in submission order. Identical query commands that are already
+// queued or on the wire share the same transaction and the same reply.
+// The queue is bounded, a mount that stops answering fails new commands
+// at once instead of growing a backlog that would be sent much later.
+// Queries waiting next to each other go out as one pipelined burst.
+// Guide commands jump the queue, they only wait for what is on the wire.
+class scheduled_protocol : public nexstar_protocol {
+ public:
+  constexpr static int max_message_size = 32;
+
+  struct reply_t {
+    int nbytes;
+    std::array<std::uint8_t, max_message_size> data;
+  };
+
+ private:
+  struct transaction_t {
+    std::array<std::uint8_t, max_message_size> command;
+    int command_size;
+    int reply_size;
+    expect_t expect;
+    bool coalesce;
+    bool priority;
+    std::promise<reply_t> promise;
+    std::shared_future<reply_t> future;
+
+    [[nodiscard]] bool same_as(const std::uint8_t* in, int in_size, int out_size) const {
+      return command_size == in_size
+        && reply_size == out_size
+        && std::memcmp(command.data(), in, in_size) == 0;
+    }
+  };
+
+  std::unique_ptr<nexstar_protocol> protocol;
+
+  // indexed by command letter, only written by the i/o thread
+  std::array<alpaca::command_metrics_t, 128> commands;
+  alpaca::counter_t coalesced{0};
+  alpaca::counter_t rejected{0};
+  alpaca::counter_t pipelined{0};
+  alpaca::counter_t prioritized{0};
+
+  // bit per axis left running by a variable rate slew, mutex held
+  std::uint8_t moving_axes = 0;
+
+  std::size_t max_queue;
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<transaction_t>> queue;
+  std::vector<std::shared_ptr<transaction_t>> in_flight;
+  bool running = true;
+
+  std::thread worker;
+
+  [[nodiscard]] std::shared_future<reply_t> submit_locked(
+    const void* in, int in_size, int out_size, expect_t expect) {
+    const std::uint8_t* in_bytes = reinterpret_cast<const std::uint8_t*>(in);
+
+    if (in_size <= 0 || in_size > max_message_size || out_size > max_message_size)
+      return failed();
+
+    // nothing to wait in the queue for
+    if (!protocol->is_online())
+      return failed();
+
+    bool coalesce = is_query(in_bytes[0]);
+
+    if (coalesce) {
+      if (auto pending = find_pending(in_bytes, in_size, out_size)) {
+        coalesced.fetch_add(1, std::memory_order_relaxed);
+        return pending->future;
+      }
+    }
+
+    bool priority = is_priority(in_bytes, in_size);
+
+    // a guide stop that does not go out leaves the axis running
+    if (!priority && queue.size() >= max_queue) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return failed();
+    }
+
+    auto transaction = std::make_shared<transaction_t>();
+    transaction->command = {};
+    std::memcpy(transaction->command.data(), in_bytes, in_size);
+    transaction->command_size = in_size;
+    transaction->reply_size = out_size;
+    transaction->expect = expect;
+    transaction->coalesce = coalesce;
+    transaction->priority = priority;
+    transaction->future = transaction->promise.get_future().share();
+
+    if (priority) {
+      // ahead of everything but earlier guide commands, in order among them
+      auto position = std::find_if(queue.begin(), queue.end(),
+        [](const auto& queued) { return !queued->priority; });
+      queue.insert(position, transaction);
+      prioritized.fetch_add(1, std::memory_order_relaxed);
+
+      // a nonzero rate leaves the axis moving until the next slew for it
+      const std::uint8_t axis = in_bytes[2] == static_cast<std::uint8_t>(device_kind::azm_motor) ? 1 : 2;
+      if (in_bytes[4] != 0 || in_bytes[5] != 0)
+        moving_axes |= axis;
+      else
+        moving_axes &= ~axis;
+    } else {
+      queue.push_back(transaction);
+    }
+    cv.notify_one();
+
+    return transaction->future;
+  }
+
+  // commands that only read mount state, safe to answer from a shared reply
+  [[nodiscard]] static bool is_query(std::uint8_t cmd) {
+    return command_spec(cmd).query;
+  }
+
+  // variable rate slews start and end guide pulses, the length of a pulse
+  // depends on how soon they reach the mount
+  [[nodiscard]] static bool is_priority(const std::uint8_t* in, int in_size) {
+    if (in_size != passthrough_command_t::size || in[0] != 'P') return false;
+
+    switch (static_cast<passthrough_command_kind>(in[3])) {
+      case passthrough_command_kind::slew_variable_positive:
+      case passthrough_command_kind::slew_variable_negative:
+        return true;
+
+      default:
+        return false;
+    }
+  }
+
+  [[nodiscard]] static std::shared_future<reply_t> failed() {
+    std::promise<reply_t> promise;
+    promise.set_value(reply_t{-1, {}});
+    return promise.get_future().share();
+  }
+
+  [[nodiscard]] std::shared_ptr<transaction_t> find_pending(
+    const std::uint8_t* in, int in_size, int out_size) const {
+    for (auto& transaction : in_flight) {
+      if (transaction->coalesce && transaction->same_as(in, in_size, out_size))
+        return transaction;
+    }
+
+    for (auto& transaction : queue) {
+      if (transaction->coalesce && transaction->same_as(in, in_size, out_size))
+        return transaction;
+    }
+
+    return nullptr;
+  }
+
+  void record(
+    const transaction_t& transaction, const reply_t& reply,
+    std::chrono::steady_clock::duration elapsed) {
+    alpaca::command_metrics_t& metrics = commands[transaction.command[0] & 0x7f];
+
+    metrics.transactions.fetch_add(1, std::memory_order_relaxed);
+    metrics.bytes_sent.fetch_add(transaction.command_size, std::memory_order_relaxed);
+    metrics.round_trip.observe(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+    if (reply.nbytes < 0) {
+      metrics.errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    metrics.bytes_received.fetch_add(reply.nbytes, std::memory_order_relaxed);
+
+    int terminator = transaction.expect.terminator;
+
+    if (reply.nbytes == 0)
+      metrics.timeouts.fetch_add(1, std::memory_order_relaxed);
+    else if (terminator >= 0 ? reply.data[reply.nbytes - 1] != terminator : reply.nbytes < transaction.reply_size)
+      metrics.short_reads.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The front of the queue, with the queries right behind a query. While
+  // an axis runs at a variable rate the command that stops it must not wait
+  // behind a whole burst, so commands go out one at a time.
+  void take_burst() {
+    const std::size_t limit = moving_axes != 0 ? 1 : max_burst;
+
+    do {
+      in_flight.push_back(std::move(queue.front()));
+      queue.pop_front();
+    } while (in_flight.front()->coalesce && in_flight.size() < limit
+             && !queue.empty() && queue.front()->coalesce);
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    std::vector<std::shared_ptr<transaction_t>> burst;
+    std::vector<reply_t> replies;
+    std::vector<batch_slot_t> slots;
+
+    while (true) {
+      cv.wait(lock, [this]() { return !running || !queue.empty(); });
+
+      if (!running) break;
+
+      take_burst();
+
+      burst = in_flight;
+      lock.unlock();
+
+      replies.assign(burst.size(), reply_t{});
+
+      auto started = std::chrono::steady_clock::now();
+
+      if (burst.size() == 1) {
+        replies[0].nbytes = protocol->send_command(
+          burst[0]->command.data(), burst[0]->command_size,
+          replies[0].data.data(), burst[0]->reply_size, burst[0]->expect);
+      } else {
+        slots.clear();
+        for (std::size_t i = 0; i < burst.size(); i++) {
+          slots.push_back(batch_slot_t{
+            burst[i]->command.data(), burst[i]->command_size,
+            replies[i].data.data(), burst[i]->reply_size, burst[i]->expect, -1
+          });
+        }
+
+        protocol->send_batch(slots);
+
+        for (std::size_t i = 0; i < burst.size(); i++)
+          replies[i].nbytes = slots[i].nbytes;
+
+        pipelined.fetch_add(burst.size(), std::memory_order_relaxed);
+      }
+
+      // a burst member's round trip counts from the write of the burst
+      auto elapsed = std::chrono::steady_clock::now() - started;
+      for (std::size_t i = 0; i < burst.size(); i++)
+        record(*burst[i], replies[i], elapsed);
+
+      lock.lock();
+      in_flight.clear();
+      lock.unlock();
+
+      for (std::size_t i = 0; i < burst.size(); i++)
+        burst[i]->promise.set_value(replies[i]);
+
+      burst.clear();
+
+      lock.lock();
+    }
+
+    // nothing will reach the wire anymore, release the waiters
+    for (auto& transaction : queue)
+      transaction->promise.set_value(reply_t{-1, {}});
+
+    queue.clear();
+  }
+
+ public:
+  constexpr static std::size_t default_max_queue = 64;
+  constexpr static std::size_t max_burst = 8;
+
+  explicit scheduled_protocol(
+    std::unique_ptr<nexstar_protocol>&& protocol,
+    std::size_t max_queue = default_max_queue)
+  : protocol(std::move(protocol))
+  , max_queue(std::max<std::size_t>(max_queue, 1))
+  , worker(&scheduled_protocol::run, this)
+  { }
+
+  virtual ~scheduled_protocol() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+
+    cv.notify_one();
+    worker.join();
+  }
+
+  // queues a transaction, or joins an identical pending query
+  [[nodiscard]] std::shared_future<reply_t> submit(
+    const void* in, int in_size, int out_size, expect_t expect) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return submit_locked(in, in_size, out_size, expect);
+  }
+
+  [[nodiscard]] virtual const alpaca::virtual_clock_t* get_clock() const override {
+    return protocol->get_clock();
+  }
+
+  [[nodiscard]] virtual bool is_online() const override {
+    return protocol->is_online();
+  }
+
+  virtual void set_link_listener(link_listener* listener) override {
+    protocol->set_link_listener(listener);
+  }
+
+  virtual void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const override {
+    std::size_t depth;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      depth = queue.size() + in_flight.size();
+    }
+
+    writer->gauge("alpaca_serial_queue_depth",
+      "Transactions queued or on the wire", labels, static_cast<std::int64_t>(depth));
+    writer->counter("alpaca_serial_coalesced_total",
+      "Queries answered by joining an identical pending transaction", labels,
+      coalesced.load(std::memory_order_relaxed));
+    writer->counter("alpaca_serial_pipelined_total",
+      "Transactions written back to back with other queries", labels,
+      pipelined.load(std::memory_order_relaxed));
+    writer->counter("alpaca_serial_prioritized_total",
+      "Guide commands queued ahead of other traffic", labels,
+      prioritized.load(std::memory_order_relaxed));
+    writer->counter("alpaca_serial_rejected_total",
+      "Transactions refused because the queue was full", labels,
+      rejected.load(std::memory_order_relaxed));
+
+    for (std::size_t letter = 0; letter < commands.size(); letter++) {
+      const alpaca::command_metrics_t& metrics = commands[letter];
+
+      std::uint64_t transactions = metrics.transactions.load(std::memory_order_relaxed);
+      if (transactions == 0) continue;
+
+      char command[8];
+      if (letter >= 0x20 && letter < 0x7f && letter != '"' && letter != '\\')
+        std::snprintf(command, sizeof(command), "%c", static_cast<char>(letter));
+      else
+        std::snprintf(command, sizeof(command), "0x%02x", static_cast<unsigned>(letter));
+
+      std::string command_labels(labels);
+      command_labels.append(",command=\"").append(command).append("\"");
+
+      writer->counter("alpaca_serial_transactions_total",
+        "Serial transactions per command letter", command_labels, transactions);
+      writer->counter("alpaca_serial_bytes_sent_total",
+        "Bytes written to the mount", command_labels,
+        metrics.bytes_sent.load(std::memory_order_relaxed));
+      writer->counter("alpaca_serial_bytes_received_total",
+        "Bytes read from the mount", command_labels,
+        metrics.bytes_received.load(std::memory_order_relaxed));
+      writer->counter("alpaca_serial_timeouts_total",
+        "Transactions without any reply before the deadline", command_labels,
+        metrics.timeouts.load(std::memory_order_relaxed));
+      writer->counter("alpaca_serial_short_reads_total",
+        "Replies that were cut short by the deadline", command_labels,
+        metrics.short_reads.load(std::memory_order_relaxed));
+      writer->counter("alpaca_serial_errors_total",
+        "Transactions that failed to open, write or read the port", command_labels,
+        metrics.errors.load(std::memory_order_relaxed));
+      writer->histogram("alpaca_serial_round_trip_seconds",
+        "Time from writing a command to the end of its reply", command_labels,
+        metrics.round_trip);
+    }
+
+    // whatever the wrapped protocol counts itself
+    protocol->write_metrics(writer, labels);
+  }
+
+  virtual int send_command(
+    const void* in, int in_size, void* out, int out_size, expect_t expect) override {
+
+    std::shared_future<reply_t> future = submit(in, in_size, out_size, expect);
+    const reply_t& reply = future.get();
+
+    if (reply.nbytes > 0)
+      std::memcpy(out, reply.data.data(), std::min(reply.nbytes, out_size));
+
+    return reply.nbytes;
+  }
+
+  // queued together so the i/o thread can send them as one burst
+  virtual void send_batch(std::span<batch_slot_t> slots) override {
+    std::vector<std::shared_future<reply_t>> futures;
+    futures.reserve(slots.size());
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (const auto& slot : slots)
+        futures.push_back(submit_locked(slot.in, slot.in_size, slot.out_size, slot.expect));
+    }
+
+    for (std::size_t i = 0; i < slots.size(); i++) {
+      const reply_t& reply = futures[i].get();
+
+      if (reply.nbytes > 0)
+        std::memcpy(slots[i].out, reply.data.data(), std::min(reply.nbytes, slots[i].out_size));
+
+      slots[i].nbytes = reply.nbytes;
+    }
+  }
+};
+
+}  // namespace celestron
+
+#endif  // INCLUDE_CELESTRON_SCHEDULER_HPP_
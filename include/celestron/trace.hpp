@@ -0,0 +1,368 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_CELESTRON_TRACE_HPP_
+#define INCLUDE_CELESTRON_TRACE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <celestron/celestron.hpp>
+
+namespace celestron {
+
+// Binary trace of the exchanges with a mount, in native byte order:
+//
+//   header  "NXTRACE" 1
+//   record  gap_micros u32, duration_micros u32, in_size u8, nbytes i16,
+//           in_size bytes of command, max(nbytes, 0) bytes of reply
+//
+// gap_micros is the time since the previous exchange started, it keeps the
+// pacing of the capture. duration_micros is the time the mount took to
+// answer, transfer time included, and any wait for an exchange still on the
+// wire. Commands pipelined in one burst carry the duration of the whole
+// burst on the first one and 0 on the rest. Both saturate at ~71 minutes.
+constexpr std::string_view trace_magic{"NXTRACE\1", 8};
+
+struct trace_record_t {
+  std::uint32_t gap_micros;
+  std::uint32_t duration_micros;
+  int nbytes;
+  std::vector<std::uint8_t> command;
+  std::vector<std::uint8_t> reply;
+};
+
+static inline bool read_trace(std::FILE* file, std::vector<trace_record_t>* records) {
+  char magic[8];
+  if (std::fread(magic, 1, sizeof(magic), file) != sizeof(magic)) return false;
+  if (std::string_view(magic, sizeof(magic)) != trace_magic) return false;
+
+  constexpr std::size_t header_size = 4 + 4 + 1 + 2;
+
+  std::uint8_t header[header_size];
+  while (std::fread(header, 1, header_size, file) == header_size) {
+    trace_record_t record;
+
+    std::int16_t nbytes;
+    std::memcpy(&record.gap_micros, header, 4);
+    std::memcpy(&record.duration_micros, header + 4, 4);
+    std::memcpy(&nbytes, header + 9, 2);
+
+    record.nbytes = nbytes;
+    record.command.resize(header[8]);
+    record.reply.resize(std::max(0, record.nbytes));
+
+    // a capture cut short ends with a partial record, it is dropped
+    if (std::fread(record.command.data(), 1, record.command.size(), file) != record.command.size())
+      break;
+    if (std::fread(record.reply.data(), 1, record.reply.size(), file) != record.reply.size())
+      break;
+
+    records->push_back(std::move(record));
+  }
+
+  return std::ferror(file) == 0;
+}
+
+static inline bool read_trace(const char* path, std::vector<trace_record_t>* records) {
+  std::FILE* file = std::fopen(path, "rb");
+  if (file == nullptr) return false;
+
+  bool ok = read_trace(file, records);
+  std::fclose(file);
+
+  return ok;
+}
+
+// Passes every exchange through to the wrapped protocol and appends it to
+// a trace, flushed per exchange so a capture survives the daemon being
+// killed.
+class recording_protocol : public nexstar_protocol {
+  std::unique_ptr<nexstar_protocol> protocol;
+
+  std::mutex mutex;
+  std::FILE* file;
+  alpaca::monotonic_t last_started;
+  std::vector<std::uint8_t> buffer;
+
+  // mutex held
+  void append(const void* in, int in_size, const void* out, int nbytes,
+    alpaca::monotonic_t started, std::int64_t duration_micros) {
+    if (file == nullptr) return;
+
+    constexpr std::int64_t max_micros = std::numeric_limits<std::uint32_t>::max();
+
+    const std::uint32_t gap = static_cast<std::uint32_t>(std::clamp<std::int64_t>(started - last_started, 0, max_micros));
+    const std::uint32_t duration = static_cast<std::uint32_t>(std::clamp<std::int64_t>(duration_micros, 0, max_micros));
+    const std::uint8_t size = static_cast<std::uint8_t>(in_size);
+    const std::int16_t reply_size = static_cast<std::int16_t>(nbytes);
+    last_started = started;
+
+    auto put = [this](const void* data, std::size_t size) {
+      const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+      buffer.insert(buffer.end(), bytes, bytes + size);
+    };
+
+    buffer.clear();
+    put(&gap, sizeof(gap));
+    put(&duration, sizeof(duration));
+    put(&size, sizeof(size));
+    put(&reply_size, sizeof(reply_size));
+    put(in, size);
+    if (nbytes > 0)
+      put(out, nbytes);
+
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+  }
+
+ public:
+  recording_protocol(std::unique_ptr<nexstar_protocol>&& protocol, const char* path)
+  : protocol(std::move(protocol))
+  , file(std::fopen(path, "wb"))
+  , last_started(alpaca::monotonic_t::now()) {
+    if (file != nullptr)
+      std::fwrite(trace_magic.data(), 1, trace_magic.size(), file);
+  }
+
+  virtual ~recording_protocol() override {
+    if (file != nullptr)
+      std::fclose(file);
+  }
+
+  recording_protocol(const recording_protocol&) = delete;
+  recording_protocol& operator=(const recording_protocol&) = delete;
+
+  [[nodiscard]] bool is_open() const {
+    return file != nullptr;
+  }
+
+  virtual int send_command(
+    const void* in, int in_size, void* out, int out_size, expect_t expect) override {
+    alpaca::monotonic_t started = alpaca::monotonic_t::now();
+    int nbytes = protocol->send_command(in, in_size, out, out_size, expect);
+    std::int64_t duration = alpaca::monotonic_t::now() - started;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    append(in, in_size, out, nbytes, started, duration);
+    if (file != nullptr) std::fflush(file);
+
+    return nbytes;
+  }
+
+  virtual void send_batch(std::span<batch_slot_t> slots) override {
+    alpaca::monotonic_t started = alpaca::monotonic_t::now();
+    protocol->send_batch(slots);
+    std::int64_t duration = alpaca::monotonic_t::now() - started;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& slot : slots) {
+      append(slot.in, slot.in_size, slot.out, slot.nbytes, started, duration);
+      duration = 0;
+    }
+    if (file != nullptr) std::fflush(file);
+  }
+
+  [[nodiscard]] virtual const alpaca::virtual_clock_t* get_clock() const override {
+    return protocol->get_clock();
+  }
+
+  [[nodiscard]] virtual bool is_online() const override {
+    return protocol->is_online();
+  }
+
+  virtual void set_link_listener(link_listener* listener) override {
+    protocol->set_link_listener(listener);
+  }
+
+  virtual void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const override {
+    protocol->write_metrics(writer, labels);
+  }
+};
+
+// Answers from a trace instead of a mount. Replies of a command are handed
+// out in the order they were captured, wrapping around, and each takes the
+// time the mount took for it, so caching and pipelining can be measured
+// against the latency of real hardware. A command missing from the trace
+// fails the way a mount that does not answer would.
+//
+// The capture is laid out again on its own timeline, from gap_micros, and
+// an exchange keeps only the time the link was busy with it, not the time
+// it waited behind the exchange before it. Replayed exchanges take turns on
+// one emulated link, paced by those times, so concurrent callers queue the
+// way they would on the serial port. A batch is one burst on the link.
+class replay_protocol : public nexstar_protocol {
+  struct exchange_t {
+    std::uint32_t busy_micros;   // link time charged to the exchange
+    std::uint32_t burst_micros;  // link time of the burst it was sent in
+    int nbytes;
+    std::vector<std::uint8_t> reply;
+  };
+
+  struct replies_t {
+    std::vector<exchange_t> exchanges;
+    std::size_t next = 0;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, replies_t> replies;
+
+  // 0 answers at once, 1 at the captured latency
+  double latency_scale;
+
+  // when the emulated link is done with the exchanges already replayed,
+  // mutex held
+  alpaca::monotonic_t link_free;
+
+  alpaca::counter_t replayed{0};
+  alpaca::counter_t misses{0};
+
+  // mutex held, nullptr when the trace has no reply for `in`
+  const exchange_t* next_exchange(const void* in, int in_size) {
+    auto it = replies.find(std::string(static_cast<const char*>(in), in_size));
+    if (it == replies.end()) {
+      misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    replies_t& command = it->second;
+    const exchange_t& exchange = command.exchanges[command.next];
+    command.next = (command.next + 1) % command.exchanges.size();
+
+    replayed.fetch_add(1, std::memory_order_relaxed);
+    return &exchange;
+  }
+
+  // mutex held, takes the link for `micros` after what is already on it and
+  // returns when the exchange is answered
+  alpaca::monotonic_t take_link(std::uint32_t micros) {
+    if (latency_scale <= 0.0) return link_free;
+
+    const alpaca::monotonic_t now = alpaca::monotonic_t::now();
+    if (link_free - now < 0) link_free = now;
+
+    link_free = link_free + static_cast<std::int64_t>(micros * latency_scale);
+    return link_free;
+  }
+
+  static void wait_until(alpaca::monotonic_t answered) {
+    const std::int64_t micros = answered - alpaca::monotonic_t::now();
+
+    if (micros > 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(micros));
+  }
+
+  static int copy_reply(const exchange_t& exchange, void* out, int out_size) {
+    const int nbytes = std::min(exchange.nbytes, out_size);
+    if (nbytes > 0)
+      std::memcpy(out, exchange.reply.data(), nbytes);
+
+    return nbytes;
+  }
+
+ public:
+  explicit replay_protocol(double latency_scale = 1.0)
+  : latency_scale(latency_scale)
+  , link_free(alpaca::monotonic_t::now()) {
+  }
+
+  [[nodiscard]] bool load(const char* path) {
+    std::vector<trace_record_t> records;
+    if (!read_trace(path, &records)) return false;
+
+    // the capture's timeline, in micros since its first exchange started
+    std::int64_t started = 0;
+    std::int64_t wire_free = 0;
+    std::int64_t burst = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t i = 0; i < records.size(); ++i) {
+      trace_record_t& record = records[i];
+      started += record.gap_micros;
+
+      const std::int64_t answered = started + record.duration_micros;
+      const std::int64_t busy = std::max<std::int64_t>(0, answered - std::max(started, wire_free));
+      wire_free = std::max(wire_free, answered);
+
+      // the rest of a burst starts with its first command and adds nothing
+      // to its duration
+      const bool in_burst = i > 0 && record.gap_micros == 0 && record.duration_micros == 0;
+      if (!in_burst) burst = busy;
+
+      std::string command(record.command.begin(), record.command.end());
+      replies[command].exchanges.push_back({
+        static_cast<std::uint32_t>(busy),
+        static_cast<std::uint32_t>(burst),
+        record.nbytes,
+        std::move(record.reply) });
+    }
+
+    return !replies.empty();
+  }
+
+  virtual int send_command(
+    const void* in, int in_size, void* out, int out_size, expect_t) override {
+    alpaca::monotonic_t answered;
+    int nbytes;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      const exchange_t* exchange = next_exchange(in, in_size);
+      if (exchange == nullptr) return -1;
+
+      nbytes = copy_reply(*exchange, out, out_size);
+      answered = take_link(exchange->busy_micros);
+    }
+
+    wait_until(answered);
+    return nbytes;
+  }
+
+  // every reply of the batch arrives at the end of one burst, as long as
+  // the longest burst its commands were captured in
+  virtual void send_batch(std::span<batch_slot_t> slots) override {
+    alpaca::monotonic_t answered;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      std::uint32_t burst_micros = 0;
+      for (auto& slot : slots) {
+        const exchange_t* exchange = next_exchange(slot.in, slot.in_size);
+        if (exchange == nullptr) {
+          slot.nbytes = -1;
+          continue;
+        }
+
+        slot.nbytes = copy_reply(*exchange, slot.out, slot.out_size);
+        burst_micros = std::max(burst_micros, exchange->burst_micros);
+      }
+
+      answered = take_link(burst_micros);
+    }
+
+    wait_until(answered);
+  }
+
+  virtual void write_metrics(alpaca::metrics_writer* writer, std::string_view labels) const override {
+    writer->counter("alpaca_trace_replayed_total",
+      "Commands answered from the replayed trace", labels,
+      replayed.load(std::memory_order_relaxed));
+    writer->counter("alpaca_trace_misses_total",
+      "Commands with no reply in the replayed trace", labels,
+      misses.load(std::memory_order_relaxed));
+  }
+};
+
+}  // namespace celestron
+
+#endif  // INCLUDE_CELESTRON_TRACE_HPP_
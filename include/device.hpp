@@ -3,20 +3,29 @@
 #ifndef INCLUDE_DEVICE_HPP_
 #define INCLUDE_DEVICE_HPP_
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <span>
 #include <string>
 #include <vector>
-#include <map>
 #include <cstddef>
 #include <exception>
 #include <iomanip>
 #include <iostream>
 #include <string_view>
+#include <utility>
 
 #include <resource.hpp>
+#include <dispatch.hpp>
+#include <metrics.hpp>
 #include <util.hpp>
 #include <json.hpp>
 #include <parser.hpp>
 #include <fields.hpp>
+#include <time.hpp>
 
 namespace alpaca {
 
@@ -29,14 +38,31 @@ struct deviceinfo_t {
 
 using check_t = result<void, alpaca_error>;
 
+// Action answered by every device. Parameters lists property names separated
+// by commas, the Value is an object with the GET of each one under the name
+// it was asked by, the UTC Timestamp of the oldest reading, and Errors with
+// the properties that failed.
+constexpr std::string_view read_properties_action = "ReadProperties";
+
+// Thread safety: the http server calls into a device from any of its
+// workers at once (one per connection by default), and the telemetry
+// poller calls get_telemetry() from its own thread. Drivers guard their
+// own state; a device_resource only bounds how many requests wait on one
+// device and never serializes them. Calls must not block longer than the
+// driver's i/o deadline, a slow device holds one worker per waiting call.
 class device {
  protected:
   int device_number = -1;
   bool is_connected = false;
 
+  // false while a connected driver has lost its link to the hardware
+  [[nodiscard]] virtual bool is_link_up() const {
+    return true;
+  }
+
   [[nodiscard]]
   inline auto check_connected() const -> check_t {
-    if (!is_connected) return not_connected();
+    if (!is_connected || !is_link_up()) return not_connected();
 
     return {};
   }
@@ -86,6 +112,14 @@ class device {
     this->device_number = device_number;
   }
 
+  // called after every PUT, drivers drop any cached mount state here
+  virtual void state_changed() {
+  }
+
+  // driver specific metrics, labels identify the device
+  virtual void write_metrics(metrics_writer*, std::string_view) const {
+  }
+
   virtual return_t<void> put_connected(bool connected) {
     if (is_connected && connected) return {};
     if (!is_connected && !connected) return {};
@@ -97,8 +131,15 @@ class device {
     return is_connected;
   }
 
-  virtual return_t<void> put_action() {
-    return {};
+  // device specific actions, ReadProperties is answered before reaching it
+  virtual return_t<json_value> put_action(std::string_view, std::string_view) {
+    return action_not_implemented();
+  }
+
+  // called with the names of a ReadProperties before they are read, drivers
+  // fetch what they can in one go. returns when the oldest value was read.
+  virtual monotonic_t prefetch(std::span<const std::string_view>) const {
+    return monotonic_t::now();
   }
 
   virtual return_t<void> put_commandblind() {
@@ -122,29 +163,171 @@ class device {
   virtual return_t<deviceinfo_t> get_deviceinfo() const = 0;
 };
 
+// operations every device type answers, device types append their own
+template<typename T>
+requires std::is_base_of_v<device, T>
+[[nodiscard]] constexpr auto device_operations() {
+  using ops = operations<T>;
+
+  return std::array {
+    ops::action("action", [](T* device, const arguments_t& args) {
+      return visit(
+        [device](std::string_view action, std::string_view parameters) {
+          return device->put_action(action, parameters);
+        },
+        fields::action_f.get(args),
+        fields::parameters_f.get_or(args, ""));
+    }),
+    ops::put("commandblind", [](T* device, const arguments_t&) {
+      return device->put_commandblind();
+    }),
+    ops::put("commandbool", [](T* device, const arguments_t&) {
+      return device->put_commandbool();
+    }),
+    ops::put("commandstring", [](T* device, const arguments_t&) {
+      return device->put_commandstring();
+    }),
+
+    ops::get_put(
+      "connected",
+      [](const T* dev, const arguments_t&) {
+        return dev->get_connected();
+      },
+      [](T* dev, const arguments_t& args) {
+        return parser::parser_t::parse<bool>(args, fields::connected_f)
+          .map([dev](bool connected) {
+            dev->put_connected(connected);
+          });
+      }),
+
+    ops::get_constant("description", [](const T* dev, const arguments_t&) {
+      return dev->get_description();
+    }),
+    ops::get_constant("driverinfo", [](const T* dev, const arguments_t&) {
+      return dev->get_driverinfo();
+    }),
+    ops::get_constant("driverversion", [](const T* dev, const arguments_t&) {
+      return dev->get_driverversion();
+    }),
+    ops::get_constant("interfaceversion", [](const T* dev, const arguments_t&) {
+      return dev->get_interfaceversion();
+    }),
+    ops::get_constant("name", [](const T* dev, const arguments_t&) {
+      return dev->get_name();
+    }),
+
+    ops::get_constant("supportedactions", [](const T* dev, const arguments_t&) {
+      return dev->get_supportedactions().map([](const auto& supportedactions) {
+        json_array actions;
+        std::transform(
+          std::cbegin(supportedactions),
+          std::cend(supportedactions),
+          std::back_inserter(actions),
+          [](const auto& action) { return json_string(action); }
+        );
+        return actions;
+      });
+    }),
+  };
+}
+
 template<typename T>
 requires std::is_base_of_v<device, T>
 class device_resource : public alpaca_resource {
  protected:
+  using find_fn = const operation_t<T>* (*)(std::string_view);
+
+  // replaces the server wide transaction counter, one set per device
+  struct device_metrics_t {
+    std::atomic<std::uint32_t> server_transaction_id{0};
+    std::atomic<int> pending{0};
+    counter_t busy{0};
+    std::unique_ptr<operation_metrics_t[]> operations;
+
+    // Value of every constant operation, empty for the rest
+    std::unique_ptr<std::string[]> serialized;
+  };
+
+  // holds one of the device's admission slots for the length of a request
+  class admission_t {
+    device_metrics_t* metrics;
+
+   public:
+    admission_t(device_metrics_t* metrics, int max_pending)
+    : metrics(metrics) {
+      if (metrics->pending.fetch_add(1, std::memory_order_acquire) >= max_pending) {
+        metrics->pending.fetch_sub(1, std::memory_order_release);
+        metrics->busy.fetch_add(1, std::memory_order_relaxed);
+        this->metrics = nullptr;
+      }
+    }
+
+    ~admission_t() {
+      if (metrics != nullptr)
+        metrics->pending.fetch_sub(1, std::memory_order_release);
+    }
+
+    admission_t(const admission_t&) = delete;
+    admission_t& operator=(const admission_t&) = delete;
+
+    [[nodiscard]] bool admitted() const {
+      return metrics != nullptr;
+    }
+  };
+
+  // requests let through to one device at a time, the rest fail fast instead
+  // of parking http workers behind a mount that stopped answering
+  int max_pending = 8;
+
   std::string device_type;
   std::vector<T*> devices;
+  std::vector<std::unique_ptr<device_metrics_t>> device_metrics;
+
+  find_fn find_operation;
+  std::span<const operation_t<T>> operation_list;
+
+  // a piece of /api/v1/<type>/<number>/<operation> as a view of the path,
+  // get_path_piece hands out a copy
+  [[nodiscard]] static std::string_view path_piece(const httpserver::http_request& req, int index) {
+    std::string_view path = req.get_path();
+    std::size_t begin = 0;
+
+    while (begin < path.size()) {
+      std::size_t end = std::min(path.find('/', begin), path.size());
+
+      if (end != begin && index-- == 0)
+        return path.substr(begin, end - begin);
 
-  using get_fn = std::function<return_t<json_value>(const T*, const arguments_t&)>;
-  using put_fn = return_t<void>(*)(T*, const arguments_t&);
+      begin = end + 1;
+    }
+
+    return path.substr(path.size());
+  }
 
-  std::map<std::string_view, get_fn> get_operations;
-  std::map<std::string_view, put_fn> put_operations;
+  [[nodiscard]] int find_device(const httpserver::http_request& req) const {
+    if (path_piece(req, 2) != device_type) return -1;
 
-  inline void define_get(std::string_view op, get_fn get) {
-    get_operations[op] = get;  }
+    int device_id = util::parse_int(path_piece(req, 3), -1);
 
-  inline void define_put(std::string_view op, put_fn put) {
-    put_operations[op] = put;
+    if (device_id < 0 || static_cast<std::size_t>(device_id) >= devices.size()) return -1;
+
+    return device_id;
   }
 
-  inline void define_ops(std::string_view op, get_fn get, put_fn put) {
-    get_operations[op] = get;
-    put_operations[op] = put;
+  template<typename Fn>
+  auto measure(int device_id, const operation_t<T>* op, Fn&& fn) {
+    auto started = std::chrono::steady_clock::now();
+    auto ret = fn();
+    auto elapsed = std::chrono::steady_clock::now() - started;
+
+    operation_metrics_t& metrics = device_metrics[device_id]->operations[op->index];
+    metrics.requests.fetch_add(1, std::memory_order_relaxed);
+    if (ret.is_error())
+      metrics.errors.fetch_add(1, std::memory_order_relaxed);
+    metrics.latency.observe(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+    return ret;
   }
 
  protected:
@@ -152,107 +335,284 @@ class device_resource : public alpaca_resource {
     const httpserver::http_request& req,
     const arguments_t& args) {
 
-    if (req.get_path_piece(2) != device_type) {
+    int device_id = find_device(req);
+
+    if (device_id < 0) {
       return http_error(404, "not found");
     }
 
-    int device_id = util::parse_int(req.get_path_piece(3), -1);
+    const std::string& method = req.get_method();
+    const bool is_get = method == "GET";
 
-    if (device_id < 0 || static_cast<std::size_t>(device_id) > devices.size()) {
-      return http_error(404, "not found");
+    if (!is_get && method != "PUT") {
+      return http_error(400, "bad request");
     }
 
-    T* device = devices[device_id];
+    return dispatch(device_id, !is_get, path_piece(req, 4), args);
+  }
 
-    auto operation = req.get_path_piece(4);
+  virtual std::unique_ptr<completion> find_completion(const httpserver::http_request& req) override {
+    int device_id = find_device(req);
+    if (device_id < 0) return nullptr;
 
-    if (req.get_method() == "GET") {
-      auto op = get_operations.find(operation);
-      if (op != get_operations.end()) {
-        return op->second(device, args);
-      } else {
-        return http_error(404, "not found");
-      }
-    }
+    const operation_t<T>* op = find_operation(path_piece(req, 4));
+    if (op == nullptr || op->complete == nullptr) return nullptr;
 
-    if (req.get_method() == "PUT") {
-      auto op = put_operations.find(operation);
-      if (op != put_operations.end()) {
-        return op->second(device, args).map([]() {
-          return static_cast<json_value>( nullptr );
-        });
-      } else {
-        return http_error(404, "not found");
-      }
-    }
+    return op->complete(devices[device_id]);
+  }
+
+  // constants skip admission, the device is never asked for them again
+  virtual const std::string* find_serialized(const httpserver::http_request& req) override {
+    if (req.get_method() != "GET") return nullptr;
+
+    int device_id = find_device(req);
+    if (device_id < 0) return nullptr;
+
+    const operation_t<T>* op = find_operation(path_piece(req, 4));
+    if (op == nullptr || !op->constant) return nullptr;
+
+    device_metrics_t& metrics = *device_metrics[device_id];
 
-    return http_error(400, "bad request");
+    const std::string& value = metrics.serialized[op->index];
+    if (value.empty()) return nullptr;
+
+    operation_metrics_t& op_metrics = metrics.operations[op->index];
+    op_metrics.requests.fetch_add(1, std::memory_order_relaxed);
+    op_metrics.latency.observe(0);
+
+    return &value;
+  }
+
+  virtual std::uint32_t next_transaction_id(const httpserver::http_request& req) override {
+    int device_id = find_device(req);
+
+    if (device_id < 0)
+      return alpaca_resource::next_transaction_id(req);
+
+    return ++device_metrics[device_id]->server_transaction_id;
   }
 
  public:
-  device_resource(const std::string& device_type)
-  : device_type(device_type), devices() {
-    define_put("action", [](T* device, const arguments_t&) {
-      return device->put_action();
-    });
+  device_resource(
+    const std::string& device_type,
+    find_fn find_operation,
+    std::span<const operation_t<T>> operation_list)
+  : device_type(device_type)
+  , devices()
+  , device_metrics()
+  , find_operation(find_operation)
+  , operation_list(operation_list) {
+  }
 
-    define_put("commandblind", [](T* device, const arguments_t&) {
-      return device->put_commandblind();
-    });
+  // nullptr when there is no such device
+  [[nodiscard]] T* get_device(int device_id) const {
+    if (device_id < 0 || static_cast<std::size_t>(device_id) >= devices.size()) return nullptr;
 
-    define_put("commandbool", [](T* device, const arguments_t&) {
-      return device->put_commandbool();
-    });
+    return devices[device_id];
+  }
 
-    define_put("commandstring", [](T* device, const arguments_t&) {
-      return device->put_commandstring();
+  // runs an operation without going through http, device_id must be valid.
+  // A deferred PUT is waited for here, before returning.
+  return_t<json_value> invoke(
+    int device_id, bool is_put, std::string_view operation, const arguments_t& args) {
+    const operation_t<T>* op = is_put ? find_operation(operation) : nullptr;
+    std::unique_ptr<completion> work = op != nullptr && op->complete != nullptr
+      ? op->complete(devices[device_id])
+      : nullptr;
+
+    auto ret = dispatch(device_id, is_put, operation, args);
+    if (ret.is_error() || work == nullptr) return ret;
+
+    return work->wait().map([]() {
+      return static_cast<json_value>( nullptr );
     });
+  }
 
-    define_ops(
-      "connected",
-      [](const T* dev, const arguments_t&) -> return_t<json_value> {
-        return dev->get_connected();
-      },
-      [](T* dev, const arguments_t& args) {
-        return parser::parser_t::parse<bool>(args, fields::connected_f)
-          .map([dev](bool connected) {
-            dev->put_connected(connected);
-          });
+  // runs `fn(device)` for work outside the Alpaca API under the same
+  // admission as the device's requests, device_id must be valid
+  template<typename Fn>
+  auto admitted(int device_id, Fn&& fn) -> decltype(fn(std::declval<T*>())) {
+    admission_t admission(device_metrics[device_id].get(), max_pending);
+    if (!admission.admitted()) {
+      return device_busy();
+    }
+
+    return fn(devices[device_id]);
+  }
+
+  // the PUT alone, http replies wait for a completion themselves
+  return_t<json_value> dispatch(
+    int device_id, bool is_put, std::string_view operation, const arguments_t& args) {
+    T* device = devices[device_id];
+    const operation_t<T>* op = find_operation(operation);
+
+    if (op == nullptr || (is_put ? op->put == nullptr && op->action == nullptr : op->get == nullptr)) {
+      return http_error(404, "not found");
+    }
+
+    admission_t admission(device_metrics[device_id].get(), max_pending);
+    if (!admission.admitted()) {
+      return device_busy();
+    }
+
+    if (is_put && op->action != nullptr) {
+      return measure(device_id, op, [&]() -> return_t<json_value> {
+        auto action = fields::action_f.get(args);
+        if (!action.is_error() && util::equals_insentive(action.get(), read_properties_action))
+          return read_properties(device_id, args);
+
+        return op->action(device, args);
       });
+    }
 
-    define_get("description", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_description();
-    });
-    define_get("driverinfo", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_driverinfo();
-    });
-    define_get("driverversion", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_driverversion();
-    });
-    define_get("interfaceversion", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_interfaceversion();
-    });
-    define_get("name", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_name();
-    });
+    if (!is_put) {
 
-    define_get("supportedactions", [](const T* dev, const arguments_t&) -> return_t<json_value> {
-      return dev->get_supportedactions().map([](const auto& supportedactions) {
-        json_array actions;
-        std::copy(
-          std::cbegin(supportedactions),
-          std::cend(supportedactions),
-          std::begin(actions)
-        );
-        return actions;
+      return measure(device_id, op, [&]() {
+        return op->get(device, args);
       });
+    }
+
+    auto ret = measure(device_id, op, [&]() {
+      return op->put(device, args);
     });
+
+    device->state_changed();
+
+    return ret.map([]() {
+      return static_cast<json_value>( nullptr );
+    });
+  }
+
+  // names after the first this many are refused, each one can mean a round
+  // trip to the device
+  constexpr static std::size_t max_read_properties = 32;
+
+  // the GETs of a ReadProperties action, measured as if they were requested
+  // one by one. They see the action's arguments, so properties that take
+  // some (DestinationSideOfPier) can be part of the batch.
+  return_t<json_value> read_properties(int device_id, const arguments_t& args) {
+    T* device = devices[device_id];
+
+    auto parameters = fields::parameters_f.get(args);
+    if (parameters.is_error()) return parameters.error();
+
+    thread_local std::vector<std::string_view> names;
+    thread_local std::vector<const operation_t<T>*> ops;
+    names.clear();
+    ops.clear();
+
+    for (std::string_view name : util::split(parameters.get(), ",")) {
+      while (!name.empty() && name.front() == ' ') name.remove_prefix(1);
+      while (!name.empty() && name.back() == ' ') name.remove_suffix(1);
+      if (name.empty()) continue;
+
+      const operation_t<T>* op = find_operation(name);
+      if (op == nullptr || op->get == nullptr || names.size() >= max_read_properties)
+        return invalid_value();
+
+      names.push_back(name);
+      ops.push_back(op);
+    }
+
+    if (names.empty()) return invalid_value();
+
+    const monotonic_t now = monotonic_t::now();
+    const monotonic_t read_at = device->prefetch(names);
+
+    json_object values;
+    json_object errors;
+
+    for (std::size_t i = 0; i < names.size(); i++) {
+      measure(device_id, ops[i], [&]() { return ops[i]->get(device, args); }).match(
+        [&](const json_value& value) {
+          values.insert_or_assign(json_string(names[i]), value);
+        },
+        [&](const alpaca_error& error) {
+          errors.insert_or_assign(json_string(names[i]), json_object {
+            {"ErrorNumber", error.error_number},
+            {"ErrorMessage", error.error_message},
+          });
+        });
+    }
+
+    const std::int64_t age = std::max<std::int64_t>(0, now - read_at);
+    char timestamp[utcdate_t::utc_size];
+    utcdate_t{utcdate_t::now().micros - age}.format_utc(timestamp);
+    values.insert_or_assign("Timestamp", json_string(timestamp, sizeof(timestamp)));
+
+    if (!errors.empty())
+      values.insert_or_assign("Errors", std::move(errors));
+
+    return static_cast<json_value>(values);
+  }
+
+  void set_max_pending(int max_pending) {
+    this->max_pending = std::max(max_pending, 1);
   }
 
   void add_device(T* device) {
     int device_number = static_cast<int>(devices.size());
     device->set_device_number(device_number);
     devices.push_back(device);
+
+    auto metrics = std::make_unique<device_metrics_t>();
+    metrics->operations = std::make_unique<operation_metrics_t[]>(operation_list.size());
+    metrics->serialized = std::make_unique<std::string[]>(operation_list.size());
+
+    // an error is left to the handler, it is asked again on every request
+    const arguments_t no_arguments(false);
+    for (const auto& op : operation_list) {
+      if (!op.constant) continue;
+
+      op.get(device, no_arguments).match(
+        [&](const json_value& value) {
+          json_writer(&metrics->serialized[op.index]).write(value);
+        },
+        [](const alpaca_error&) { });
+    }
+
+    device_metrics.push_back(std::move(metrics));
+  }
+
+  void write_metrics(metrics_writer* writer) const {
+    for (std::size_t id = 0; id < devices.size(); id++) {
+      std::string labels = "device_type=\"" + device_type
+        + "\",device_number=\"" + std::to_string(id) + "\"";
+
+      const device_metrics_t& metrics = *device_metrics[id];
+
+      writer->counter("alpaca_server_transactions_total",
+        "Alpaca transactions answered per device", labels,
+        metrics.server_transaction_id.load(std::memory_order_relaxed));
+      writer->gauge("alpaca_device_requests_pending",
+        "Requests admitted to the device and not answered yet", labels,
+        metrics.pending.load(std::memory_order_relaxed));
+      writer->counter("alpaca_device_busy_total",
+        "Requests refused because the device had no admission slot left", labels,
+        metrics.busy.load(std::memory_order_relaxed));
+
+      for (const auto& op : operation_list) {
+        const operation_metrics_t& op_metrics = metrics.operations[op.index];
+
+        // operations never called are left out to keep the scrape small
+        if (op_metrics.requests.load(std::memory_order_relaxed) == 0) continue;
+
+        std::string op_labels = labels;
+        op_labels.append(",operation=\"").append(op.name).append("\"");
+
+        writer->counter("alpaca_operation_requests_total",
+          "Requests handled per device operation", op_labels,
+          op_metrics.requests.load(std::memory_order_relaxed));
+        writer->counter("alpaca_operation_errors_total",
+          "Requests that returned an Alpaca error", op_labels,
+          op_metrics.errors.load(std::memory_order_relaxed));
+        writer->histogram("alpaca_operation_duration_seconds",
+          "Time spent in the device operation handler", op_labels,
+          op_metrics.latency);
+      }
+
+      devices[id]->write_metrics(writer, labels);
+    }
   }
 };
 
@@ -0,0 +1,181 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_DISPATCH_HPP_
+#define INCLUDE_DISPATCH_HPP_
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <json.hpp>
+#include <resource.hpp>
+#include <util.hpp>
+
+namespace alpaca {
+
+// One entry per operation name, GET and PUT resolve with the same lookup.
+template<typename T>
+struct operation_t {
+  using get_fn = return_t<json_value>(*)(const T*, const arguments_t&);
+  using put_fn = return_t<void>(*)(T*, const arguments_t&);
+  using action_fn = return_t<json_value>(*)(T*, const arguments_t&);
+  using complete_fn = std::unique_ptr<completion>(*)(T*);
+
+  std::string_view name = {};
+  get_fn get = nullptr;
+  put_fn put = nullptr;
+  std::uint8_t index = 0;  // position in its table, filled by operation_table
+
+  // the value never changes for a device and takes no arguments, it is
+  // serialized once when the device is added
+  bool constant = false;
+
+  // a PUT that answers a value, it decides itself whether the device
+  // state changed
+  action_fn action = nullptr;
+
+  // a PUT whose reply waits once the put succeeded, outside the request and
+  // its admission slot. Makes the wait before the put runs, so it can note
+  // what it waits from (see alpaca_resource::find_completion).
+  complete_fn complete = nullptr;
+};
+
+template<typename T>
+struct operations {
+  // getters return whatever result type suits them, converted here to json
+  template<typename Get>
+  static return_t<json_value> invoke_get(const T* device, const arguments_t& args) {
+    auto value = Get{}(device, args);
+
+    // plain strings are copied into the request arena
+    if constexpr (std::is_same_v<decltype(value), return_t<std::string>>)
+      return value.map([](const std::string& str) -> json_value { return json_string(str); });
+    else
+      return value;
+  }
+
+  template<typename Get>
+  [[nodiscard]] static constexpr operation_t<T> get(std::string_view name, Get) {
+    return {name, &invoke_get<Get>, nullptr, 0, false, nullptr};
+  }
+
+  template<typename Get>
+  [[nodiscard]] static constexpr operation_t<T> get_constant(std::string_view name, Get) {
+    return {name, &invoke_get<Get>, nullptr, 0, true, nullptr};
+  }
+
+  template<typename Put>
+  [[nodiscard]] static constexpr operation_t<T> put(std::string_view name, Put put) {
+    return {name, nullptr, put, 0, false, nullptr};
+  }
+
+  template<typename Put, typename Complete>
+  [[nodiscard]] static constexpr operation_t<T> put_deferred(std::string_view name, Put put, Complete complete) {
+    return {name, nullptr, put, 0, false, nullptr, complete};
+  }
+
+  template<typename Action>
+  [[nodiscard]] static constexpr operation_t<T> action(std::string_view name, Action action) {
+    return {name, nullptr, nullptr, 0, false, action};
+  }
+
+  template<typename Get, typename Put>
+  [[nodiscard]] static constexpr operation_t<T> get_put(std::string_view name, Get, Put put) {
+    return {name, &invoke_get<Get>, put, 0, false, nullptr};
+  }
+};
+
+template<typename T, std::size_t A, std::size_t B>
+[[nodiscard]] constexpr auto join(
+  const std::array<operation_t<T>, A>& a,
+  const std::array<operation_t<T>, B>& b) -> std::array<operation_t<T>, A + B> {
+  std::array<operation_t<T>, A + B> out = {};
+
+  for (std::size_t i = 0; i < A; i++) out[i] = a[i];
+  for (std::size_t i = 0; i < B; i++) out[A + i] = b[i];
+
+  return out;
+}
+
+// not constexpr on purpose, reaching it fails the build
+void operation_table_has_duplicated_names();
+
+// Perfect hash over the lowercased operation names, the seed is searched at
+// compile time so a lookup is one hash, one slot and one compare.
+template<typename T, std::size_t N>
+class operation_table {
+  static_assert(N > 0 && N < 255, "operation_table holds up to 254 operations");
+
+  constexpr static std::uint8_t empty = 0xff;
+  constexpr static std::size_t slot_count = std::bit_ceil(N * 4);
+
+  std::array<operation_t<T>, N> table;
+  std::array<std::uint8_t, slot_count> slots;
+  std::uint32_t seed;
+
+  [[nodiscard]] constexpr static std::size_t slot(std::uint32_t hash, std::uint32_t seed) {
+    // murmur3 finalizer, spreads fnv into the low bits
+    hash ^= seed;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash & (slot_count - 1);
+  }
+
+  [[nodiscard]] constexpr bool try_seed(const std::array<std::uint32_t, N>& hashes) {
+    slots.fill(empty);
+
+    for (std::size_t i = 0; i < N; i++) {
+      std::size_t s = slot(hashes[i], seed);
+      if (slots[s] != empty) return false;
+      slots[s] = static_cast<std::uint8_t>(i);
+    }
+
+    return true;
+  }
+
+ public:
+  consteval explicit operation_table(const std::array<operation_t<T>, N>& table)
+  : table(table)
+  , slots()
+  , seed(0) {
+    std::array<std::uint32_t, N> hashes = {};
+    for (std::size_t i = 0; i < N; i++) {
+      hashes[i] = util::hash_insensitive(table[i].name);
+      this->table[i].index = static_cast<std::uint8_t>(i);
+    }
+
+    for (seed = 0; seed < 0x10000; seed++) {
+      if (try_seed(hashes)) return;
+    }
+
+    operation_table_has_duplicated_names();
+  }
+
+  [[nodiscard]] constexpr std::span<const operation_t<T>> list() const {
+    return table;
+  }
+
+  [[nodiscard]] const operation_t<T>* find(std::string_view name) const {
+    std::uint8_t index = slots[slot(util::hash_insensitive(name), seed)];
+    if (index == empty) return nullptr;
+
+    const operation_t<T>* op = &table[index];
+    if (!util::equals_insentive(op->name, name)) return nullptr;
+
+    return op;
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_DISPATCH_HPP_
@@ -3,13 +3,16 @@
 #ifndef INCLUDE_ERRORS_HPP_
 #define INCLUDE_ERRORS_HPP_
 
-#include <string>
+#include <string_view>
+
+#include <arena.hpp>
 
 namespace alpaca {
 
+// the message lives in the request arena like the json values
 struct alpaca_error {
   int error_number;
-  std::string error_message;
+  arena_string error_message;
 };
 
 // reserved error code (0x400) for property or method not implemented.
@@ -58,12 +61,27 @@ auto action_not_implemented() {
 }
 
 // [0x500 - 0xfff] reserved for driver specific errors.
-auto custom_error(const std::string& str) {
-  return alpaca_error{0x500, str};
+auto custom_error(std::string_view str) {
+  return alpaca_error{0x500, arena_string(str)};
+}
+
+// a message naming a field, built in place
+auto custom_error(std::string_view prefix, std::string_view name, std::string_view suffix) {
+  arena_string message;
+  message.reserve(prefix.size() + name.size() + suffix.size());
+  message.append(prefix).append(name).append(suffix);
+
+  return alpaca_error{0x500, std::move(message)};
+}
+
+// driver specific (0x501), too many requests are already waiting on the
+// device, the client should retry later.
+auto device_busy() {
+  return alpaca_error{0x501, "Device busy"};
 }
 
-auto http_error(int status_code, const std::string& str) {
-  return alpaca_error{0x1000 + status_code, str};
+auto http_error(int status_code, std::string_view str) {
+  return alpaca_error{0x1000 + status_code, arena_string(str)};
 }
 
 }  // namespace alpaca
@@ -31,9 +31,14 @@ constexpr const parser::field<float> sitelongitude_f = { "SiteLongitude" };
 constexpr const parser::field<float> targetdeclination_f = { "TargetDeclination" };
 constexpr const parser::field<float> targetrightascension_f = { "TargetRightAscension" };
 constexpr const parser::field<float> rate_f = { "Rate" };
+constexpr const parser::field<float> minaltitude_f = { "MinAltitude" };
+constexpr const parser::field<float> maxmagnitude_f = { "MaxMagnitude" };
 
 // int fields
 constexpr const parser::field<int> axis_f = { "Axis" };
+constexpr const parser::field<int> devicenumber_f = { "DeviceNumber" };
+constexpr const parser::field<int> maxcount_f = { "MaxCount" };
+constexpr const parser::field<int> interval_f = { "Interval" };
 constexpr const parser::field<int> direction_f = { "Direction" };
 constexpr const parser::field<int> duration_f = { "Duration" };
 constexpr const parser::field<int> sideofpier_f = { "SideOfPier" };
@@ -42,6 +47,12 @@ constexpr const parser::field<int> trackingrate_f = { "TrackingRate" };
 
 // string fields
 constexpr const parser::field<std::string_view> utcdate_f = { "UTCDate" };
+constexpr const parser::field<std::string_view> action_f = { "Action" };
+constexpr const parser::field<std::string_view> parameters_f = { "Parameters" };
+
+// comma separated lists
+constexpr const parser::field<std::string_view> rightascensions_f = { "RightAscension" };
+constexpr const parser::field<std::string_view> declinations_f = { "Declination" };
 
 }  // namespace fields
 }  // namespace alpaca
@@ -3,80 +3,172 @@
 #ifndef INCLUDE_JSON_HPP_
 #define INCLUDE_JSON_HPP_
 
+#include <charconv>
+#include <cmath>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <iomanip>
+#include <ostream>
 #include <rva/variant.hpp>
 
+#include <arena.hpp>
+
 namespace alpaca {
 
+// strings and containers come from the request arena while one is open,
+// see request_scope
 using json_value = rva::variant<
   std::nullptr_t,
   bool,
   long,
   float,
-  std::string,
-  std::vector<rva::self_t>,
-  std::map<std::string, rva::self_t>
+  arena_string,
+  std::vector<rva::self_t, arena_allocator<rva::self_t>>,
+  std::map<arena_string, rva::self_t, std::less<>, arena_allocator<std::pair<const arena_string, rva::self_t>>>
 >;
 
 using json_int = long;
 using json_float = float;
 using json_bool = bool;
-using json_string = std::string;
-using json_array = std::vector<json_value>;
-using json_object = std::map<std::string, json_value>;
+using json_string = arena_string;
+using json_array = std::vector<json_value, arena_allocator<json_value>>;
+using json_object = std::map<json_string, json_value, std::less<>, arena_allocator<std::pair<const json_string, json_value>>>;
 
-}  // namespace alpaca
+// Appends JSON text straight into a caller owned buffer. Nested values are
+// visited by reference and numbers are formatted with std::to_chars, so
+// nothing is allocated besides the buffer growing.
+class json_writer {
+  std::string* out;
 
-static inline std::ostream& operator<<(std::ostream& os, const alpaca::json_value& js) {
-  switch (js.index()) {
-    case 0:
-      os << "null";
-      break;
-    case 1:
-      os << std::boolalpha << std::get<alpaca::json_bool>(js);
-      break;
-    case 2:
-      os << std::get<alpaca::json_int>(js);
-      break;
-    case 3:
-      os << std::get<alpaca::json_float>(js);
-      break;
-    case 4:
-      os << std::quoted(std::get<alpaca::json_string>(js));
-      break;
-    case 5: {
-      auto values = std::get<alpaca::json_array>(js);
-
-      os << "[";
-      for (auto i = values.begin(); i != values.end(); i++) {
-        os << *i;
-        if (i+1 != values.end())
-          os << ",";
+ public:
+  explicit json_writer(std::string* out)
+  : out(out) { }
+
+  void write_null() {
+    out->append("null");
+  }
+
+  void write_bool(bool value) {
+    out->append(value ? "true" : "false");
+  }
+
+  void write_int(json_int value) {
+    char buffer[24];
+    auto [end, ec] = std::to_chars(std::begin(buffer), std::end(buffer), value);
+    out->append(buffer, end);
+  }
+
+  void write_float(json_float value) {
+    // json has no representation for nan or infinity
+    if (!std::isfinite(value)) {
+      write_null();
+      return;
+    }
+
+    char buffer[32];
+    auto [end, ec] = std::to_chars(std::begin(buffer), std::end(buffer), value);
+    out->append(buffer, end);
+  }
+
+  void write_string(std::string_view value) {
+    constexpr char hex[] = "0123456789abcdef";
+
+    out->push_back('"');
+
+    std::size_t plain = 0;
+    for (std::size_t i = 0; i < value.size(); i++) {
+      unsigned char ch = static_cast<unsigned char>(value[i]);
+
+      if (ch >= 0x20 && ch != '"' && ch != '\\')
+        continue;
+
+      out->append(value.data() + plain, i - plain);
+      plain = i + 1;
+
+      switch (ch) {
+        case '"':  out->append("\\\""); break;
+        case '\\': out->append("\\\\"); break;
+        case '\n': out->append("\\n"); break;
+        case '\r': out->append("\\r"); break;
+        case '\t': out->append("\\t"); break;
+        default: {
+          const char escaped[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf] };
+          out->append(escaped, sizeof(escaped));
+          break;
+        }
       }
-      os << "]";
-      break;
     }
-    case 6: {
-      auto pairs = std::get<alpaca::json_object>(js);
-      os << "{";
-      auto kv = pairs.begin();
-      while (kv != pairs.end()) {
-        os << std::quoted(kv->first) << ":" << kv->second;
 
-        kv++;
+    out->append(value.data() + plain, value.size() - plain);
+    out->push_back('"');
+  }
+
+  // already serialized json
+  void write_raw(std::string_view json) {
+    out->append(json);
+  }
+
+  void write_key(std::string_view key) {
+    write_string(key);
+    out->push_back(':');
+  }
 
-        if (kv != pairs.end())
-          os << ",";
+  void write(const json_value& js) {
+    switch (js.index()) {
+      case 0:
+        write_null();
+        break;
+      case 1:
+        write_bool(std::get<json_bool>(js));
+        break;
+      case 2:
+        write_int(std::get<json_int>(js));
+        break;
+      case 3:
+        write_float(std::get<json_float>(js));
+        break;
+      case 4:
+        write_string(std::get<json_string>(js));
+        break;
+      case 5: {
+        const auto& values = std::get<json_array>(js);
+
+        out->push_back('[');
+        for (auto i = values.begin(); i != values.end(); i++) {
+          if (i != values.begin())
+            out->push_back(',');
+          write(*i);
+        }
+        out->push_back(']');
+        break;
+      }
+      case 6: {
+        const auto& pairs = std::get<json_object>(js);
+
+        out->push_back('{');
+        for (auto kv = pairs.begin(); kv != pairs.end(); kv++) {
+          if (kv != pairs.begin())
+            out->push_back(',');
+          write_key(kv->first);
+          write(kv->second);
+        }
+        out->push_back('}');
+        break;
       }
-      os << "}";
-      break;
     }
   }
+};
+
+}  // namespace alpaca
+
+static inline std::ostream& operator<<(std::ostream& os, const alpaca::json_value& js) {
+  std::string out;
+  alpaca::json_writer(&out).write(js);
 
-  return os;
+  return os << out;
 }
 
 #endif  // INCLUDE_JSON_HPP_
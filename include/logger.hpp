@@ -0,0 +1,328 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_LOGGER_HPP_
+#define INCLUDE_LOGGER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace alpaca {
+
+enum class log_level_t : int {
+  quiet = 0,
+  error,
+  info,
+  debug,
+};
+
+enum class log_kind_t : std::uint8_t {
+  message = 0,
+  access,
+};
+
+template<std::size_t N>
+struct log_text_t {
+  char data[N];
+
+  void assign(std::string_view text) {
+    std::size_t size = std::min(text.size(), N - 1);
+    std::memcpy(data, text.data(), size);
+    data[size] = '\0';
+  }
+};
+
+// fixed size so producers never allocate, text fields are truncated
+struct log_record_t {
+  std::int64_t timestamp_micros;
+  log_level_t level;
+  log_kind_t kind;
+
+  // access records
+  int status;
+  int error_number;
+  std::uint32_t server_transaction_id;
+  std::int64_t duration_micros;
+  log_text_t<8> method;
+  log_text_t<64> path;
+  log_text_t<128> query;
+
+  // access value at debug level, message text otherwise
+  log_text_t<160> text;
+};
+
+// Bounded multi producer, single consumer ring (Vyukov). Request threads
+// claim a cell with one CAS and never wait, when the ring is full the record
+// is dropped and counted. A background thread formats and writes in batches.
+class logger {
+  constexpr static std::size_t capacity = 512;
+  constexpr static std::size_t mask = capacity - 1;
+  constexpr static auto flush_interval = std::chrono::milliseconds(50);
+
+  static_assert((capacity & mask) == 0, "capacity must be a power of two");
+
+  struct cell_t {
+    std::atomic<std::size_t> sequence;
+    log_record_t record;
+  };
+
+  std::array<cell_t, capacity> cells;
+  alignas(64) std::atomic<std::size_t> enqueue_pos;
+  alignas(64) std::size_t dequeue_pos;
+
+  std::atomic<int> level;
+  std::atomic<std::uint64_t> dropped;
+  std::uint64_t reported_dropped;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool running = true;
+
+  std::string output;
+  std::thread writer;
+
+  log_record_t* claim(std::size_t* pos) {
+    std::size_t p = enqueue_pos.load(std::memory_order_relaxed);
+
+    while (true) {
+      cell_t& cell = cells[p & mask];
+      std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(p);
+
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(p, p + 1, std::memory_order_relaxed)) {
+          *pos = p;
+          return &cell.record;
+        }
+      } else if (diff < 0) {
+        // consumer has not released this cell yet, ring is full
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      } else {
+        p = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void publish(std::size_t pos) {
+    cells[pos & mask].sequence.store(pos + 1, std::memory_order_release);
+  }
+
+  static std::int64_t wall_micros() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+  }
+
+  void format_timestamp(std::int64_t micros) {
+    std::time_t seconds = static_cast<std::time_t>(micros / 1000000);
+    std::tm utc_tm;
+    gmtime_r(&seconds, &utc_tm);
+
+    char buffer[40];
+    int size = std::snprintf(
+      buffer, sizeof(buffer),
+      "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ ",
+      utc_tm.tm_year + 1900, utc_tm.tm_mon + 1, utc_tm.tm_mday,
+      utc_tm.tm_hour, utc_tm.tm_min, utc_tm.tm_sec,
+      static_cast<int>(micros % 1000000));
+
+    output.append(buffer, std::clamp(size, 0, static_cast<int>(sizeof(buffer) - 1)));
+  }
+
+  void format(const log_record_t& record) {
+    format_timestamp(record.timestamp_micros);
+
+    if (record.kind == log_kind_t::message) {
+      output.append(record.text.data);
+      output.push_back('\n');
+      return;
+    }
+
+    char buffer[96];
+    int size = std::snprintf(
+      buffer, sizeof(buffer),
+      " %d %d %u %lldus",
+      record.status, record.error_number, record.server_transaction_id,
+      static_cast<long long>(record.duration_micros));
+
+    output.append(record.method.data);
+    output.push_back(' ');
+    output.append(record.path.data);
+    if (record.query.data[0] != '\0') {
+      output.push_back('?');
+      output.append(record.query.data);
+    }
+    output.append(buffer, std::clamp(size, 0, static_cast<int>(sizeof(buffer) - 1)));
+
+    if (record.text.data[0] != '\0') {
+      output.append(" => ");
+      output.append(record.text.data);
+    }
+
+    output.push_back('\n');
+  }
+
+  // returns the number of records written
+  std::size_t drain() {
+    std::size_t count = 0;
+
+    while (true) {
+      cell_t& cell = cells[dequeue_pos & mask];
+      std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+      if (seq != dequeue_pos + 1) break;
+
+      format(cell.record);
+
+      cell.sequence.store(dequeue_pos + capacity, std::memory_order_release);
+      dequeue_pos++;
+      count++;
+    }
+
+    std::uint64_t now_dropped = dropped.load(std::memory_order_relaxed);
+    if (now_dropped != reported_dropped) {
+      char buffer[64];
+      int size = std::snprintf(
+        buffer, sizeof(buffer), "logger: dropped %llu records\n",
+        static_cast<unsigned long long>(now_dropped - reported_dropped));
+      output.append(buffer, std::clamp(size, 0, static_cast<int>(sizeof(buffer) - 1)));
+      reported_dropped = now_dropped;
+    }
+
+    if (!output.empty()) {
+      std::fwrite(output.data(), 1, output.size(), stdout);
+      std::fflush(stdout);
+      output.clear();
+    }
+
+    return count;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (running) {
+      lock.unlock();
+      std::size_t count = drain();
+      lock.lock();
+
+      // producers never notify, an idle ring is checked on a timer
+      if (count < capacity / 2)
+        cv.wait_for(lock, flush_interval, [this]() { return !running; });
+    }
+
+    lock.unlock();
+    drain();
+  }
+
+  logger()
+  : enqueue_pos(0)
+  , dequeue_pos(0)
+  , level(static_cast<int>(log_level_t::info))
+  , dropped(0)
+  , reported_dropped(0) {
+    for (std::size_t i = 0; i < capacity; i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+
+    output.reserve(capacity * 128);
+    writer = std::thread(&logger::run, this);
+  }
+
+ public:
+  ~logger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+
+    cv.notify_one();
+    writer.join();
+  }
+
+  logger(const logger&) = delete;
+  logger& operator=(const logger&) = delete;
+
+  static logger& instance() {
+    static logger log;
+    return log;
+  }
+
+  void set_level(log_level_t level) {
+    this->level.store(static_cast<int>(level), std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] bool enabled(log_level_t level) const {
+    return static_cast<int>(level) <= this->level.load(std::memory_order_relaxed)
+      && level != log_level_t::quiet;
+  }
+
+  [[nodiscard]] std::uint64_t get_dropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+  void access(
+    std::string_view method,
+    std::string_view path,
+    std::string_view query,
+    int status,
+    int error_number,
+    std::uint32_t server_transaction_id,
+    std::int64_t duration_micros,
+    std::string_view value) {
+    if (!enabled(log_level_t::info)) return;
+
+    std::size_t pos;
+    log_record_t* record = claim(&pos);
+    if (record == nullptr) return;
+
+    record->timestamp_micros = wall_micros();
+    record->level = log_level_t::info;
+    record->kind = log_kind_t::access;
+    record->status = status;
+    record->error_number = error_number;
+    record->server_transaction_id = server_transaction_id;
+    record->duration_micros = duration_micros;
+    record->method.assign(method);
+    record->path.assign(path);
+    record->query.assign(query);
+    record->text.assign(value);
+
+    publish(pos);
+  }
+
+  __attribute__((format(printf, 3, 4)))
+  void message(log_level_t level, const char* fmt, ...) {
+    if (!enabled(level)) return;
+
+    std::size_t pos;
+    log_record_t* record = claim(&pos);
+    if (record == nullptr) return;
+
+    record->timestamp_micros = wall_micros();
+    record->level = level;
+    record->kind = log_kind_t::message;
+
+    std::va_list args;
+    va_start(args, fmt);
+    std::vsnprintf(record->text.data, sizeof(record->text.data), fmt, args);
+    va_end(args);
+
+    publish(pos);
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_LOGGER_HPP_
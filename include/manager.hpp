@@ -4,18 +4,45 @@
 #define INCLUDE_MANAGER_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <sstream>
+#include <thread>
 
 #include <httpserver.hpp>
 #include <create_webserver.hpp>
 
 #include <resource.hpp>
+#include <catalog.hpp>
+#include <fields.hpp>
 #include <json.hpp>
+#include <logger.hpp>
+#include <metrics.hpp>
 #include <device.hpp>
 #include <telescope.hpp>
 
 namespace alpaca {
 
+// how device_manager::run serves http
+struct server_options_t {
+  int port = 11111;
+
+  // Device handlers block on the serial link for a whole round trip. A
+  // pool worker multiplexes many connections (epoll on Linux), so one
+  // slow reply stalls every client on that worker. A thread per
+  // connection only stalls the client that asked, and several clients
+  // with a few keep-alive connections each need only a handful of threads.
+  bool thread_per_connection = true;
+
+  // pool workers when not running a thread per connection, 0 for one per core
+  int threads = 0;
+
+  int max_connections = 64;
+  int per_ip_connection_limit = 16;
+
+  // seconds an idle keep-alive connection is kept open, 0 never closes it
+  int connection_timeout = 30;
+};
+
 class device_manager {
   std::vector<device*> devices;
 
@@ -58,19 +85,203 @@ class device_manager {
       const httpserver::http_request&,
       const arguments_t&) {
 
-      return flatten(
-        manager->devices,
-        [](device* dev) {
-          return dev->get_deviceinfo().map([](auto&& info) -> json_value {
-            return json_object {
-              {"DeviceName", info.name},
-              {"DeviceType", info.device_type},
-              {"DeviceNumber", info.device_number},
-              {"UniqueID", info.unique_id},
-            };
+      json_array response;
+      response.reserve(manager->devices.size());
+
+      for (device* dev : manager->devices) {
+        auto info = dev->get_deviceinfo();
+        if (info.is_error()) return info.error();
+
+        response.push_back(json_object {
+          {"DeviceName", json_string(info.get().name)},
+          {"DeviceType", json_string(info.get().device_type)},
+          {"DeviceNumber", info.get().device_number},
+          {"UniqueID", json_string(info.get().unique_id)},
+        });
+      }
+
+      return static_cast<json_value>(std::move(response));
+    }
+  };
+
+  // objects of the loaded catalog above an altitude for a telescope's site
+  class visibleobjects_resource : public alpaca_resource {
+    device_manager* manager;
+
+    constexpr static int max_count = 10000;
+
+   public:
+    visibleobjects_resource(device_manager* manager)
+    : manager(manager) { }
+
+    virtual return_t<json_value> handle_get(
+      const httpserver::http_request& req,
+      const arguments_t& args) {
+      if (req.get_method() != "GET")
+        return http_error(405, "method not allowed");
+
+      if (manager->objects == nullptr || !manager->objects->is_open())
+        return custom_error("No catalog loaded");
+
+      return visit(
+        [this](int device_number, float min_altitude, float max_magnitude, int count) -> return_t<json_value> {
+          if (count <= 0 || count > max_count || min_altitude < -90.0f || min_altitude > 90.0f)
+            return invalid_value();
+
+          if (manager->telescopes.get_device(device_number) == nullptr)
+            return invalid_value();
+
+          // the site and its sidereal time on the mount's clock, asked like
+          // a request to the telescope would be
+          return manager->telescopes.admitted(device_number, [&](telescope* tel) {
+            return tel->priv_get_sky().map([&](const sky_t& sky) {
+              return query(sky, { min_altitude, max_magnitude, static_cast<std::size_t>(count) });
+            });
           });
-        }
-      );
+        },
+        fields::devicenumber_f.get_or(args, 0),
+        fields::minaltitude_f.get_or(args, 30.0f),
+        fields::maxmagnitude_f.get_or(args, 99.0f),
+        fields::maxcount_f.get_or(args, 1000));
+    }
+
+   private:
+    json_value query(const sky_t& sky, const catalog_query_t& query) {
+      const catalog& objects = *manager->objects;
+
+      thread_local std::vector<visible_object_t> visible;
+      visible.clear();
+
+      catalog_stats_t stats = objects.visible(sky.observer, sky.lst, query, &visible);
+
+      logger::instance().message(
+        log_level_t::debug, "catalog: %u bands, %u candidates, %zu visible",
+        stats.bands, stats.candidates, visible.size());
+
+      json_array response;
+      response.reserve(visible.size());
+
+      for (const auto& object : visible) {
+        const catalog_record_t& record = objects.at(object.index);
+
+        response.push_back(json_object {
+          {"Name", json_string(objects.name(object.index))},
+          {"RightAscension", record.rightascension / 15.0f},
+          {"Declination", record.declination},
+          {"Magnitude", record.magnitude},
+          {"Azimuth", object.azimuth},
+          {"Altitude", object.altitude},
+        });
+      }
+
+      return response;
+    }
+  };
+
+  // Server sent events with the telemetry of one telescope. The first
+  // event is a snapshot of every known field, then a delta whenever the
+  // poller sees a change; Interval (ms) also repeats the snapshot at that
+  // period. Each subscriber keeps its connection, and thread, open.
+  class telemetrystream_resource : public httpserver::http_resource {
+    device_manager* manager;
+   public:
+    telemetrystream_resource(device_manager* manager)
+    : manager(manager) { }
+
+    virtual std::shared_ptr<httpserver::http_response> render(const httpserver::http_request& req) override {
+      if (req.get_method() != "GET")
+        return std::make_shared<httpserver::string_response>("Method Not Allowed", 405);
+
+      thread_local std::string to_parse;
+
+      to_parse.assign(req.get_querystring());
+      if (!to_parse.empty() && to_parse[0] == '?')
+        to_parse.erase(0, 1);
+
+      arguments_t args(false);
+      if (!args.parse(to_parse.data(), to_parse.size()))
+        return std::make_shared<httpserver::string_response>("Too many arguments", 400);
+
+      auto device_number = fields::devicenumber_f.get_or(args, 0);
+      auto interval = fields::interval_f.get_or(args, 0);
+
+      if (device_number.is_error() || interval.is_error() || interval.get() < 0)
+        return std::make_shared<httpserver::string_response>("Invalid arguments", 400);
+
+      telescope* tel = manager->telescopes.get_device(device_number.get());
+      if (tel == nullptr)
+        return std::make_shared<httpserver::string_response>("Not Found", 404);
+
+      // every stream keeps a worker busy, a pool must keep some for requests
+      blocking_slot_t slot(&manager->blocking);
+      if (!slot)
+        return std::make_shared<httpserver::string_response>("Too many subscribers", 503);
+
+      telemetry_stream* stream = tel->get_telemetry_stream();
+      if (!stream->subscribe())
+        return std::make_shared<httpserver::string_response>("Too many subscribers", 503);
+
+      auto subscription = std::make_shared<telemetry_subscription>(
+        stream, interval.get() * 1000ll, std::move(slot));
+
+      auto response = std::make_shared<httpserver::deferred_response<telemetry_subscription>>(
+        &telemetry_subscription::cycle, subscription, "", 200, "text/event-stream");
+      response->with_header("Cache-Control", "no-cache");
+
+      return response;
+    }
+  };
+
+  // Prometheus text, not an Alpaca envelope
+  class metrics_resource : public httpserver::http_resource {
+    device_manager* manager;
+   public:
+    metrics_resource(device_manager* manager)
+    : manager(manager) { }
+
+    virtual std::shared_ptr<httpserver::http_response> render(const httpserver::http_request&) override {
+      metrics_writer writer;
+
+      const http_metrics_t& http = http_metrics_t::instance();
+
+      writer.gauge("alpaca_http_requests_in_flight",
+        "Requests being handled by http workers", "",
+        http.in_flight.load(std::memory_order_relaxed));
+      writer.counter("alpaca_http_requests_total",
+        "Requests received by Alpaca resources", "",
+        http.requests.load(std::memory_order_relaxed));
+      writer.counter("alpaca_http_bad_requests_total",
+        "Requests rejected before reaching a device", "",
+        http.bad_requests.load(std::memory_order_relaxed));
+      writer.gauge("alpaca_http_blocking_responses",
+        "Telemetry streams and deferred replies holding an http worker", "",
+        manager->blocking.get_used());
+      writer.counter("alpaca_log_dropped_total",
+        "Log records dropped because the log ring was full", "",
+        logger::instance().get_dropped());
+
+      const arena_metrics_t& arena = arena_metrics_t::instance();
+
+      writer.counter("alpaca_arena_scopes_total",
+        "Requests handled inside a request arena", "",
+        arena.scopes.load(std::memory_order_relaxed));
+      writer.counter("alpaca_arena_allocations_total",
+        "Allocations served from a request arena", "",
+        arena.allocations.load(std::memory_order_relaxed));
+      writer.counter("alpaca_arena_overflows_total",
+        "Allocations of a request that found its arena full and went to the heap", "",
+        arena.overflows.load(std::memory_order_relaxed));
+      writer.counter("alpaca_arena_heap_allocations_total",
+        "Json and error allocations made outside any request", "",
+        arena.heap_allocations.load(std::memory_order_relaxed));
+      writer.gauge("alpaca_arena_high_water_bytes",
+        "Most bytes a request arena had in use", "",
+        static_cast<std::int64_t>(arena.high_water.load(std::memory_order_relaxed)));
+
+      manager->telescopes.write_metrics(&writer);
+
+      return std::make_shared<httpserver::string_response>(
+        writer.str(), 200, "text/plain; version=0.0.4");
     }
   };
 
@@ -79,34 +290,80 @@ class device_manager {
   configureddevices_resource configureddevices;
   telescope_resource telescopes;
   telescope_setup_resource telescope_setup;
+  metrics_resource metrics;
+  visibleobjects_resource visibleobjects;
+  telemetrystream_resource telemetrystream;
 
+  const catalog* objects = nullptr;
+
+  // telemetry streams and synchronous slews waiting for their reply
+  blocking_budget_t blocking;
+
+ public:
+  // for tools that run their own webserver, run() does it for the daemon
   void register_endpoint(httpserver::webserver* ws) {
     ws->register_resource("/management/apiversions", &apiversions);
     ws->register_resource("/management/v1/description", &description);
     ws->register_resource("/management/v1/configureddevices", &configureddevices);
+    ws->register_resource("/management/v1/metrics", &metrics);
+    ws->register_resource("/management/v1/visibleobjects", &visibleobjects);
+    ws->register_resource("/management/v1/telemetrystream", &telemetrystream);
 
     ws->register_resource("/api/v1/telescope", &telescopes, true);
     ws->register_resource("/setup/v1/telescope", &telescope_setup, true);
   }
 
- public:
   device_manager()
   : apiversions()
   , description()
   , configureddevices(this)
   , telescopes()
   , telescope_setup(&telescopes)
-  { }
+  , metrics(this)
+  , visibleobjects(this)
+  , telemetrystream(this) {
+    telescopes.set_blocking_budget(&blocking);
+  }
 
   void add_telescope(telescope* telescope) {
     devices.push_back(telescope);
     telescopes.add_device(telescope);
   }
 
-  int run(int port) {
-    httpserver::webserver ws = httpserver::create_webserver(port)
+  // admission slots of every telescope, see device_resource::set_max_pending
+  void set_max_pending(int max_pending) {
+    telescopes.set_max_pending(max_pending);
+  }
+
+  // served by /management/v1/visibleobjects, must outlive the manager
+  void set_catalog(const catalog* objects) {
+    this->objects = objects;
+  }
+
+  int run(const server_options_t& options) {
+    httpserver::create_webserver config = httpserver::create_webserver(options.port)
+      .max_connections(options.max_connections)
+      .per_IP_connection_limit(options.per_ip_connection_limit)
+      .connection_timeout(options.connection_timeout)
       .no_post_process();
 
+    if (options.thread_per_connection) {
+      config.start_method(httpserver::http::http_utils::THREAD_PER_CONNECTION);
+    } else {
+      int threads = options.threads > 0
+        ? options.threads
+        : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+      config.start_method(httpserver::http::http_utils::INTERNAL_SELECT).max_threads(threads);
+
+      // streams and deferred replies block in their response, leave half
+      // the workers to the other requests. A single worker still takes one,
+      // it then answers nothing else until that response ends.
+      blocking.set_limit(std::max(1, threads / 2));
+    }
+
+    httpserver::webserver ws = config;
+
     register_endpoint(&ws);
 
     ws.start(true);
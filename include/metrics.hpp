@@ -0,0 +1,195 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_METRICS_HPP_
+#define INCLUDE_METRICS_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace alpaca {
+
+using counter_t = std::atomic<std::uint64_t>;
+
+// Latency histogram with fixed buckets. observe() touches one bucket, the
+// cumulative counts Prometheus expects are computed when scraped.
+class histogram_t {
+ public:
+  constexpr static std::array<std::int64_t, 14> bounds_micros = {
+        100,     250,     500,
+       1000,    2500,    5000,
+      10000,   25000,   50000,
+     100000,  250000,  500000,
+    1000000, 2500000,
+  };
+
+ private:
+  std::array<counter_t, bounds_micros.size() + 1> buckets;
+  counter_t sum_micros;
+  counter_t count;
+
+ public:
+  histogram_t()
+  : buckets()
+  , sum_micros(0)
+  , count(0) { }
+
+  void observe(std::int64_t micros) {
+    if (micros < 0) micros = 0;
+
+    std::size_t bucket = 0;
+    while (bucket < bounds_micros.size() && micros > bounds_micros[bucket])
+      bucket++;
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_micros.fetch_add(static_cast<std::uint64_t>(micros), std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint64_t get_count() const {
+    return count.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint64_t get_sum_micros() const {
+    return sum_micros.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint64_t get_bucket(std::size_t bucket) const {
+    return buckets[bucket].load(std::memory_order_relaxed);
+  }
+};
+
+struct operation_metrics_t {
+  counter_t requests{0};
+  counter_t errors{0};
+  histogram_t latency;
+};
+
+// serial traffic of one command letter
+struct command_metrics_t {
+  counter_t transactions{0};
+  counter_t bytes_sent{0};
+  counter_t bytes_received{0};
+  counter_t timeouts{0};
+  counter_t short_reads{0};
+  counter_t errors{0};
+  histogram_t round_trip;
+};
+
+struct http_metrics_t {
+  std::atomic<std::int64_t> in_flight{0};
+  counter_t requests{0};
+  counter_t bad_requests{0};
+
+  static http_metrics_t& instance() {
+    static http_metrics_t metrics;
+    return metrics;
+  }
+};
+
+// Prometheus text exposition. Families are collected separately so samples
+// of several devices end up grouped under a single HELP/TYPE header.
+class metrics_writer {
+  struct family_t {
+    std::string name;
+    std::string text;
+  };
+
+  std::vector<family_t> families;
+
+  std::string& family(std::string_view name, std::string_view type, std::string_view help) {
+    for (auto& f : families) {
+      if (f.name == name) return f.text;
+    }
+
+    family_t& f = families.emplace_back();
+    f.name = name;
+    f.text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    f.text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    return f.text;
+  }
+
+  static void append_sample(
+    std::string* out, std::string_view name, std::string_view suffix,
+    std::string_view labels, std::string_view extra_label, const char* value) {
+    out->append(name).append(suffix);
+
+    if (!labels.empty() || !extra_label.empty()) {
+      out->push_back('{');
+      out->append(labels);
+      if (!labels.empty() && !extra_label.empty()) out->push_back(',');
+      out->append(extra_label);
+      out->push_back('}');
+    }
+
+    out->push_back(' ');
+    out->append(value);
+    out->push_back('\n');
+  }
+
+  static const char* format_uint(char (&buffer)[32], std::uint64_t value) {
+    std::snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+    return buffer;
+  }
+
+  static const char* format_seconds(char (&buffer)[32], std::uint64_t micros) {
+    std::snprintf(buffer, sizeof(buffer), "%.6f", static_cast<double>(micros) / 1e6);
+    return buffer;
+  }
+
+ public:
+  void counter(
+    std::string_view name, std::string_view help,
+    std::string_view labels, std::uint64_t value) {
+    char buffer[32];
+    append_sample(&family(name, "counter", help), name, "", labels, "", format_uint(buffer, value));
+  }
+
+  void gauge(
+    std::string_view name, std::string_view help,
+    std::string_view labels, std::int64_t value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+    append_sample(&family(name, "gauge", help), name, "", labels, "", buffer);
+  }
+
+  // latency in seconds, as Prometheus conventions ask
+  void histogram(
+    std::string_view name, std::string_view help,
+    std::string_view labels, const histogram_t& histogram) {
+    std::string& out = family(name, "histogram", help);
+
+    char value[32];
+    char le[48];
+    std::uint64_t cumulative = 0;
+
+    for (std::size_t i = 0; i < histogram_t::bounds_micros.size(); i++) {
+      cumulative += histogram.get_bucket(i);
+      std::snprintf(le, sizeof(le), "le=\"%g\"",
+        static_cast<double>(histogram_t::bounds_micros[i]) / 1e6);
+      append_sample(&out, name, "_bucket", labels, le, format_uint(value, cumulative));
+    }
+
+    cumulative += histogram.get_bucket(histogram_t::bounds_micros.size());
+    append_sample(&out, name, "_bucket", labels, "le=\"+Inf\"", format_uint(value, cumulative));
+
+    append_sample(&out, name, "_sum", labels, "", format_seconds(value, histogram.get_sum_micros()));
+    append_sample(&out, name, "_count", labels, "", format_uint(value, histogram.get_count()));
+  }
+
+  [[nodiscard]] std::string str() const {
+    std::string out;
+    for (const auto& f : families)
+      out.append(f.text);
+    return out;
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_METRICS_HPP_
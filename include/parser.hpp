@@ -3,6 +3,9 @@
 #ifndef INCLUDE_PARSER_HPP_
 #define INCLUDE_PARSER_HPP_
 
+#include <charconv>
+#include <cctype>
+#include <cstdint>
 #include <string>
 #include <cstdio>
 #include <stdexcept>
@@ -36,14 +39,27 @@ struct conversor<bool> {
   }
 };
 
+// values are views into the request buffer, they are not nul terminated
+[[nodiscard]] static inline std::string_view skip_sign(std::string_view v) {
+  while (!v.empty() && std::isspace(static_cast<unsigned char>(v.front())))
+    v.remove_prefix(1);
+
+  if (v.size() > 1 && v.front() == '+' && v[1] != '-')
+    v.remove_prefix(1);
+
+  return v;
+}
+
 template<>
 struct conversor<int> {
   auto conv(std::string_view v) -> result<int, alpaca_error> {
-    char* end = nullptr;
-    long value = std::strtol(v.data(), &end, 10);
+    v = skip_sign(v);
 
-    if (v.data() != end)
-     return static_cast<int>(value);
+    int value = 0;
+    auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), value);
+
+    if (ec == std::errc() && v.data() != end)
+     return value;
 
     return custom_error("not valid int");
   }
@@ -52,10 +68,12 @@ struct conversor<int> {
 template<>
 struct conversor<float> {
   auto conv(std::string_view v) -> result<float, alpaca_error> {
-    char* end = nullptr;
-    float value = std::strtof(v.data(), &end);
+    v = skip_sign(v);
+
+    float value = 0;
+    auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), value);
 
-    if (v.data() != end)
+    if (ec == std::errc() && v.data() != end)
       return value;
 
     return custom_error("not valid float");
@@ -72,18 +90,30 @@ struct conversor<std::string_view> {
 template<typename T>
 struct field {
   const char* name;
+  std::uint32_t hash;
+
+  constexpr field(const char* name)
+  : name(name)
+  , hash(util::hash_insensitive(name))
+  { }
 
   auto get(const arguments_t& args) const -> result<T, alpaca_error> {
-    // todo(marrony): key is a std::string
-    if (auto ite = args.find(name); ite != args.end()) {
-      if (auto value = conversor<T>{}.conv(ite->second); !value.is_error())
-        return value.get();
+    if (auto value = args.find(name, hash)) {
+      if (auto converted = conversor<T>{}.conv(*value); !converted.is_error())
+        return converted.get();
 
-      return custom_error(std::string{"Invalid '"} + name + "' field");
+      return custom_error("Invalid '", name, "' field");
     } else {
-      return custom_error(std::string{"Field '"} + name + "' not found");
+      return custom_error("Field '", name, "' not found");
     }
   }
+
+  // `fallback` when the field is missing, an error only when it is invalid
+  auto get_or(const arguments_t& args, T fallback) const -> result<T, alpaca_error> {
+    if (!args.find(name, hash)) return fallback;
+
+    return get(args);
+  }
 };
 
 struct parser_t {
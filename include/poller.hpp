@@ -0,0 +1,153 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_POLLER_HPP_
+#define INCLUDE_POLLER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include <telescope.hpp>
+#include <telemetry.hpp>
+#include <time.hpp>
+
+namespace alpaca {
+
+// Refreshes the telemetry snapshot of a telescope on its own thread, so GETs
+// of read-only properties are served from memory. It ticks at the fast rate
+// but every field has its own cadence: fast while the mount moves, slow
+// while it sits still and not at all once clients stopped asking for it.
+class telemetry_poller {
+  telescope* device;
+  telemetry_options_t options;
+
+  // last time each field was read, only touched by the polling thread
+  std::array<monotonic_t, telemetry_field_count> polled = {};
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool running = true;
+
+  std::thread worker;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto next = std::chrono::steady_clock::now();
+
+    while (running) {
+      lock.unlock();
+      poll_once();
+      lock.lock();
+
+      next += std::chrono::microseconds(options.interval_micros);
+
+      // fell behind (slow link), do not try to catch up in a burst
+      auto now = std::chrono::steady_clock::now();
+      if (next < now) next = now;
+
+      cv.wait_until(lock, next, [this]() { return !running; });
+    }
+  }
+
+ public:
+  telemetry_poller(telescope* device, const telemetry_options_t& options)
+  : device(device)
+  , options(options) {
+    device->get_telemetry_cache()->set_options(options);
+
+    if (options.interval_micros > 0)
+      worker = std::thread(&telemetry_poller::run, this);
+  }
+
+  ~telemetry_poller() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+
+    cv.notify_one();
+
+    if (worker.joinable())
+      worker.join();
+  }
+
+  telemetry_poller(const telemetry_poller&) = delete;
+  telemetry_poller& operator=(const telemetry_poller&) = delete;
+
+  [[nodiscard]] std::int64_t field_interval(telemetry_field_t field, bool moving) const {
+    std::int64_t idle = std::max(options.idle_interval_micros, options.interval_micros);
+
+    // only commands change it, and they invalidate the snapshot
+    if (field == telemetry_field_t::tracking) return idle;
+
+    return moving ? options.interval_micros : idle;
+  }
+
+  void poll_once() {
+    auto connected = device->get_connected();
+    if (connected.is_error() || !connected.get()) return;
+
+    telemetry_cache* cache = device->get_telemetry_cache();
+    std::uint32_t generation = cache->get_generation();
+    telemetry_t snapshot = cache->load();
+
+    monotonic_t now = monotonic_t::now();
+
+    bool moving = (snapshot.has(telemetry_field_t::slewing) && snapshot.slewing)
+      || device->is_moving()
+      || now - cache->get_changed() < options.settle_micros;
+
+    telemetry_stream* stream = device->get_telemetry_stream();
+
+    // a streaming client wants every field all the time
+    bool streaming = stream->get_subscribers() > 0;
+
+    std::uint32_t wanted = 0;
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+
+      if (!streaming && now - cache->get_demanded(field) > options.demand_window_micros) {
+        cache->set_allowance(field, 0);
+        continue;
+      }
+
+      std::int64_t interval = field_interval(field, moving);
+      cache->set_allowance(field, interval - options.interval_micros);
+
+      if (now - polled[i] >= interval)
+        wanted |= telemetry_t::bit(field);
+    }
+
+    // the goto flag decides the cadence, keep it as fresh as the positions
+    if ((wanted & ~telemetry_t::bit(telemetry_field_t::tracking)) != 0)
+      wanted |= telemetry_t::bit(telemetry_field_t::slewing);
+
+    if (wanted == 0) return;
+
+    // fields that fail this time drop out instead of aging in the snapshot
+    snapshot.fields &= ~wanted;
+
+    device->get_telemetry(&snapshot, wanted);
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if ((wanted & telemetry_t::bit(field)) == 0) continue;
+
+      polled[i] = now;
+      snapshot.timestamps[i] = now;
+    }
+
+    if (cache->publish(snapshot, generation))
+      stream->publish(snapshot);
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_POLLER_HPP_
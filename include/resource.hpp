@@ -3,43 +3,230 @@
 #ifndef INCLUDE_RESOURCE_HPP_
 #define INCLUDE_RESOURCE_HPP_
 
+#include <sys/types.h>
+
+#include <algorithm>
+#include <array>
 #include <atomic>
-#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
 #include <sstream>
+#include <string>
+#include <string_view>
 
 #include <httpserver.hpp>
 
+#include <arena.hpp>
+#include <budget.hpp>
 #include <c++util.hpp>
 #include <json.hpp>
 #include <util.hpp>
 #include <errors.hpp>
+#include <logger.hpp>
+#include <metrics.hpp>
 
 namespace alpaca {
 
-struct comparator_t {
-  std::function<bool(const std::string&, const std::string&)> fn;
+// Request arguments as views into a caller owned buffer (query string or
+// form body). Keys are hashed once while parsing and matched case
+// insensitively for GET, exactly for PUT, as the Alpaca spec requires.
+class arguments_t {
+ public:
+  constexpr static std::size_t max_arguments = 32;
+
+ private:
+  struct argument_t {
+    std::string_view key;
+    std::string_view value;
+    std::uint32_t hash;
+  };
 
-  bool operator()(const std::string& a, const std::string& b) const {
-    return fn(a, b);
+  std::array<argument_t, max_arguments> arguments;
+  std::size_t count = 0;
+  bool case_sensitive;
+
+  [[nodiscard]] static std::string_view unescape(char* str, std::size_t size) {
+    if (std::memchr(str, '%', size) != nullptr)
+      size = util::unescape(str, size);
+
+    return {str, size};
   }
-};
 
-using arguments_t = std::map<
-  std::string,
-  std::string,
-  comparator_t
->;
+ public:
+  explicit arguments_t(bool case_sensitive)
+  : case_sensitive(case_sensitive) { }
+
+  // splits `buffer` on '&' and '=' and unescapes it in place, the buffer
+  // must outlive the arguments. false when there are too many arguments.
+  [[nodiscard]] bool parse(char* buffer, std::size_t size) {
+    char* end = buffer + size;
+
+    while (buffer < end) {
+      char* token_end = std::find(buffer, end, '&');
+
+      if (token_end != buffer) {
+        if (count == max_arguments) return false;
+
+        char* equals = std::find(buffer, token_end, '=');
+        char* value = equals != token_end ? equals + 1 : token_end;
+
+        argument_t& argument = arguments[count++];
+        argument.key = unescape(buffer, equals - buffer);
+        argument.value = unescape(value, token_end - value);
+        argument.hash = util::hash_insensitive(argument.key);
+      }
+
+      buffer = token_end + 1;
+    }
+
+    return true;
+  }
+
+  // `hash` must be util::hash_insensitive(key), fields precompute it
+  [[nodiscard]] std::optional<std::string_view> find(
+    std::string_view key, std::uint32_t hash) const {
+    // the last occurrence wins, as it did with the map
+    for (std::size_t i = count; i-- > 0;) {
+      const argument_t& argument = arguments[i];
+
+      if (argument.hash != hash) continue;
+
+      if (case_sensitive ? argument.key == key : util::equals_insentive(argument.key, key))
+        return argument.value;
+    }
+
+    return std::nullopt;
+  }
+
+  [[nodiscard]] std::optional<std::string_view> find(std::string_view key) const {
+    return find(key, util::hash_insensitive(key));
+  }
+};
 
 template<typename T>
 using return_t = result<T, alpaca_error>;
 
+// {"Value": ..., "ClientID": ...}, with the Value written by `write_value`
+template<typename WriteValue>
+static inline void write_envelope(
+  json_writer& writer,
+  WriteValue&& write_value,
+  std::uint32_t client_id,
+  std::uint32_t client_transaction_id,
+  std::uint32_t server_transaction_id,
+  int error_number,
+  std::string_view error_message) {
+  writer.write_raw("{\"Value\":");
+  write_value(writer);
+  writer.write_raw(",\"ClientID\":");
+  writer.write_int(client_id);
+  writer.write_raw(",\"ErrorNumber\":");
+  writer.write_int(error_number);
+  writer.write_raw(",\"ErrorMessage\":");
+  writer.write_string(error_message);
+  writer.write_raw(",\"ClientTransactionID\":");
+  writer.write_int(client_transaction_id);
+  writer.write_raw(",\"ServerTransactionID\":");
+  writer.write_int(server_transaction_id);
+  writer.write_raw("}");
+}
+
+// What the reply of a PUT still waits for once the PUT itself returned,
+// the end of a synchronous slew. Made before the PUT runs, and destroyed
+// without waiting when the PUT fails or the reply is never sent.
+class completion {
+ public:
+  virtual ~completion() = default;
+
+  virtual return_t<void> wait() = 0;
+};
+
+// Reply of a PUT sent once its completion ends. The request returned when
+// the PUT did, so the wait holds no admission slot, arena or in flight
+// count. It does hold the http worker that calls the cycle callback, which
+// in pool mode serves other connections too, so every reply takes a place
+// in the server's blocking budget.
+class deferred_reply {
+  std::unique_ptr<completion> work;
+  blocking_slot_t slot;
+  std::uint32_t client_id;
+  std::uint32_t client_transaction_id;
+  std::uint32_t server_transaction_id;
+
+  std::string body;
+  std::size_t offset = 0;
+  bool written = false;
+
+  void complete() {
+    return_t<void> ret = work->wait();
+    json_writer writer(&body);
+
+    const int error_number = ret.is_error() ? ret.error().error_number : 0;
+    const std::string_view error_message = ret.is_error() ? std::string_view(ret.error().error_message) : "";
+
+    if (ret.is_error()) {
+      logger::instance().message(
+        log_level_t::info, "deferred reply %u: error %d %.*s", server_transaction_id,
+        error_number, static_cast<int>(error_message.size()), error_message.data());
+    }
+
+    write_envelope(
+      writer, [](json_writer& writer) { writer.write_null(); },
+      client_id, client_transaction_id, server_transaction_id, error_number, error_message);
+
+    written = true;
+  }
+
+ public:
+  deferred_reply(
+    std::unique_ptr<completion>&& work,
+    blocking_slot_t&& slot,
+    std::uint32_t client_id,
+    std::uint32_t client_transaction_id,
+    std::uint32_t server_transaction_id)
+  : work(std::move(work))
+  , slot(std::move(slot))
+  , client_id(client_id)
+  , client_transaction_id(client_transaction_id)
+  , server_transaction_id(server_transaction_id) {
+  }
+
+  deferred_reply(const deferred_reply&) = delete;
+  deferred_reply& operator=(const deferred_reply&) = delete;
+
+  // cycle callback of the deferred response, the first call waits
+  static ssize_t cycle(std::shared_ptr<deferred_reply> self, char* buffer, std::size_t max) {
+    if (!self->written) self->complete();
+
+    if (self->offset >= self->body.size()) return -1;
+
+    std::size_t size = std::min(max, self->body.size() - self->offset);
+    std::memcpy(buffer, self->body.data() + self->offset, size);
+    self->offset += size;
+
+    return static_cast<ssize_t>(size);
+  }
+};
+
 class alpaca_resource : public httpserver::http_resource {
+  std::atomic<std::uint32_t> server_transaction_id{0};
+
+  // shared with the other blocking responses, nullptr has no limit
+  blocking_budget_t* blocking = nullptr;
 
  protected:
   virtual result<json_value, alpaca_error> handle_get(
     const httpserver::http_request& req,
     const arguments_t& args) = 0;
 
+  // device resources keep one counter per device
+  virtual std::uint32_t next_transaction_id(const httpserver::http_request&) {
+    return ++server_transaction_id;
+  }
+
   std::shared_ptr<httpserver::http_response> not_found() {
     return std::make_shared<httpserver::string_response>("Not Found", 404);
   }
@@ -49,100 +236,226 @@ class alpaca_resource : public httpserver::http_resource {
   }
 
   std::shared_ptr<httpserver::http_response> bad_request(const std::string& msg) {
+    http_metrics_t::instance().bad_requests.fetch_add(1, std::memory_order_relaxed);
     return std::make_shared<httpserver::string_response>(msg, 400);
   }
 
   std::shared_ptr<httpserver::http_response> conv_error(const alpaca_error& error) {
-    return std::make_shared<httpserver::string_response>(error.error_message, error.error_number - 0x1000);
+    return std::make_shared<httpserver::string_response>(
+      std::string(error.error_message), error.error_number - 0x1000);
   }
 
   std::shared_ptr<httpserver::http_response> ok(const json_value& response) {
-    std::ostringstream os;
+    std::string& buffer = response_buffer();
+
+    json_writer(&buffer).write(response);
+
+    return std::make_shared<httpserver::string_response>(buffer, 200, "application/json");
+  }
+
+  // the Alpaca envelope is a fixed template, only the values are written
+  std::shared_ptr<httpserver::http_response> ok(
+    const json_value& value,
+    std::uint32_t client_id,
+    std::uint32_t client_transaction_id,
+    std::uint32_t server_transaction_id,
+    int error_number,
+    std::string_view error_message) {
+    return envelope(
+      [&value](json_writer& writer) { writer.write(value); },
+      client_id, client_transaction_id, server_transaction_id, error_number, error_message);
+  }
+
+  // a successful reply whose value was serialized beforehand
+  std::shared_ptr<httpserver::http_response> ok_serialized(
+    std::string_view value,
+    std::uint32_t client_id,
+    std::uint32_t client_transaction_id,
+    std::uint32_t server_transaction_id) {
+    return envelope(
+      [value](json_writer& writer) { writer.write_raw(value); },
+      client_id, client_transaction_id, server_transaction_id, 0, "");
+  }
 
-    os << response;
+  // Serialized Value of requests that need no handler, values of static
+  // properties that never change for a device. nullptr for the rest.
+  virtual const std::string* find_serialized(const httpserver::http_request&) {
+    return nullptr;
+  }
+
+  // Asked before a PUT runs, the work its reply waits for once the PUT
+  // succeeded. The reply becomes a deferred_reply, nullptr answers right
+  // away.
+  virtual std::unique_ptr<completion> find_completion(const httpserver::http_request&) {
+    return nullptr;
+  }
 
-    return std::make_shared<httpserver::string_response>(os.str(), 200, "application/json");
+  std::shared_ptr<httpserver::http_response> deferred(
+    std::unique_ptr<completion>&& work,
+    blocking_slot_t&& slot,
+    std::uint32_t client_id,
+    std::uint32_t client_transaction_id,
+    std::uint32_t server_transaction_id) {
+    auto reply = std::make_shared<deferred_reply>(
+      std::move(work), std::move(slot), client_id, client_transaction_id, server_transaction_id);
+
+    return std::make_shared<httpserver::deferred_response<deferred_reply>>(
+      &deferred_reply::cycle, reply, "", 200, "application/json");
+  }
+
+  template<typename WriteValue>
+  std::shared_ptr<httpserver::http_response> envelope(
+    WriteValue&& write_value,
+    std::uint32_t client_id,
+    std::uint32_t client_transaction_id,
+    std::uint32_t server_transaction_id,
+    int error_number,
+    std::string_view error_message) {
+    std::string& buffer = response_buffer();
+    json_writer writer(&buffer);
+
+    write_envelope(
+      writer, std::forward<WriteValue>(write_value),
+      client_id, client_transaction_id, server_transaction_id, error_number, error_message);
+
+    return std::make_shared<httpserver::string_response>(buffer, 200, "application/json");
+  }
+
+  // reused by every response rendered on this thread, keeps its capacity
+  static std::string& response_buffer() {
+    thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
   }
 
  public:
+  void set_blocking_budget(blocking_budget_t* blocking) {
+    this->blocking = blocking;
+  }
+
   virtual std::shared_ptr<httpserver::http_response> render(const httpserver::http_request& req) override {
-    comparator_t comp = {
-      req.get_method() == "GET"
-      ? util::compare_less_insensitive
-      : util::compare_less_sensitive
-    };
-    arguments_t args(comp);
-
-    std::string_view to_parse =
-      req.get_method() == "PUT"
-      ? req.get_content()
-      : req.get_querystring().size() > 0
-      ? req.get_querystring().substr(1)
-      : "";
-
-    for (auto& token : util::split(to_parse, "&")) {
-      auto a = util::split(token, "=");
-      if (a.size() > 0) {
-        std::string key{ a[0] };
-
-        if (a.size() == 2)
-          args[key] = a[1];
-
-        httpserver::http::http_unescape(&args[key]);
-      }
-    }
+    const auto started = std::chrono::steady_clock::now();
+
+    http_metrics_t& http = http_metrics_t::instance();
+    http.requests.fetch_add(1, std::memory_order_relaxed);
+    http.in_flight.fetch_add(1, std::memory_order_relaxed);
+
+    struct in_flight_guard {
+      http_metrics_t* http;
+      ~in_flight_guard() { http->in_flight.fetch_sub(1, std::memory_order_relaxed); }
+    } guard{&http};
+
+    // json values and errors of this request, gone once it is serialized
+    request_scope scope;
+
+    const bool is_put = req.get_method() == "PUT";
+
+    // reused per thread, parsing unescapes it in place
+    thread_local std::string to_parse;
+    thread_local std::string raw_arguments;
+
+    if (is_put)
+      raw_arguments.assign(req.get_content());
+    else
+      raw_arguments.assign(req.get_querystring());
+
+    std::string_view raw_view = raw_arguments;
+    if (!is_put && !raw_view.empty() && raw_view[0] == '?')
+      raw_view.remove_prefix(1);
+
+    to_parse.assign(raw_view);
+
+    arguments_t args(is_put);
+    if (!args.parse(to_parse.data(), to_parse.size()))
+      return bad_request("Too many arguments");
 
     std::uint32_t client_transaction_id = 0;
-    if (auto ite = args.find("ClientTransactionID"); ite != args.end()) {
-      if (std::sscanf(ite->second.c_str(), "%u", &client_transaction_id) != 1)
+    if (auto value = args.find("ClientTransactionID")) {
+      if (!util::parse_uint(*value, &client_transaction_id))
         return bad_request("Invalid 'ClientTransactionID'");
     }
 
     std::uint32_t client_id = 0;
-    if (auto ite = args.find("ClientID"); ite != args.end()) {
-      if (std::sscanf(ite->second.c_str(), "%u", &client_id) != 1)
+    if (auto value = args.find("ClientID")) {
+      if (!util::parse_uint(*value, &client_id))
         return bad_request("Invalid 'ClientID'");
     }
 
-    static std::atomic<int> server_transaction_id;
-
-    auto create_output = [&](const json_value& value, int error_number = 0, const std::string& error_message = "") -> json_object {
-      return {
-        {"Value", value},
-        {"ClientID", static_cast<json_int>(client_id)},
-        {"ErrorNumber", error_number},
-        {"ErrorMessage", error_message},
-        {"ClientTransactionID", static_cast<json_int>(client_transaction_id)},
-        {"ServerTransactionID", ++server_transaction_id}
+    {
+      auto log_access = [&](
+        int status, int error_number, std::uint32_t transaction_id,
+        const json_value* value, std::string_view serialized) {
+        logger& log = logger::instance();
+        if (!log.enabled(log_level_t::info)) return;
+
+        // values are only rendered when someone is going to read them
+        thread_local std::string value_text;
+        value_text.clear();
+        if (log.enabled(log_level_t::debug)) {
+          if (value != nullptr && *value != nullptr)
+            json_writer(&value_text).write(*value);
+          else
+            value_text.assign(serialized);
+        }
+
+        auto elapsed = std::chrono::steady_clock::now() - started;
+
+        log.access(
+          req.get_method(), req.get_path(), raw_view,
+          status, error_number, transaction_id,
+          std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+          value_text);
       };
-    };
 
-    {
+      if (const std::string* serialized = find_serialized(req)) {
+        std::uint32_t transaction_id = next_transaction_id(req);
+        log_access(200, 0, transaction_id, nullptr, *serialized);
+
+        return ok_serialized(*serialized, client_id, client_transaction_id, transaction_id);
+      }
+
+      // a PUT whose reply waits takes its place in the blocking budget
+      // before it runs, refused it never reaches the device
+      std::unique_ptr<completion> work = is_put ? find_completion(req) : nullptr;
+      blocking_slot_t slot = work != nullptr ? blocking_slot_t(blocking) : blocking_slot_t();
+
       auto handle_return = [&](return_t<json_value>&& ret) {
-        std::cout << req.get_method() << " " << req.get_path() << "?" << to_parse;
+        std::uint32_t transaction_id = next_transaction_id(req);
 
         return ret.match(
-          [&](const json_value& value) {
-            if (value != nullptr)
-              std::cout << " => " << value << std::endl;
-            else
-              std::cout << std::endl;
+          [&](const json_value& value) -> std::shared_ptr<httpserver::http_response> {
+            log_access(200, 0, transaction_id, &value, {});
 
-            return ok(create_output(value, 0, ""));
+            if (work != nullptr)
+              return deferred(std::move(work), std::move(slot), client_id, client_transaction_id, transaction_id);
+
+            return ok(value, client_id, client_transaction_id, transaction_id, 0, "");
           },
           [&](const alpaca_error& error) {
             if (error.error_number >= 0x1000) {
+              log_access(error.error_number - 0x1000, 0, transaction_id, nullptr, {});
+
               return conv_error(error);
             }
 
-            return ok(create_output(
+            log_access(200, error.error_number, transaction_id, nullptr, {});
+
+            return ok(
               static_cast<json_value>(nullptr),
+              client_id,
+              client_transaction_id,
+              transaction_id,
               error.error_number,
-              error.error_message));
+              error.error_message);
           }
         );
       };
 
+      if (work != nullptr && !slot) {
+        work.reset();
+        return handle_return(device_busy());
+      }
+
       return handle_return(handle_get(req, args));
     }
   }
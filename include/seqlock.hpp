@@ -0,0 +1,76 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_SEQLOCK_HPP_
+#define INCLUDE_SEQLOCK_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace alpaca {
+
+// Single writer, many readers. Readers never block the writer, they retry
+// when a store happened while they were copying. Writers must be serialized
+// by the caller.
+template<typename T>
+requires std::is_trivially_copyable_v<T>
+class seqlock {
+  using word_t = std::uint64_t;
+
+  constexpr static std::size_t word_count = (sizeof(T) + sizeof(word_t) - 1) / sizeof(word_t);
+
+  std::atomic<std::uint32_t> sequence;
+  std::array<std::atomic<word_t>, word_count> words;
+
+ public:
+  seqlock()
+  : sequence(0) {
+    store(T{});
+  }
+
+  explicit seqlock(const T& value)
+  : sequence(0) {
+    store(value);
+  }
+
+  void store(const T& value) {
+    std::array<word_t, word_count> buffer = {};
+    std::memcpy(buffer.data(), &value, sizeof(T));
+
+    std::uint32_t seq = sequence.load(std::memory_order_relaxed);
+
+    // odd sequence means a store is in progress
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (std::size_t i = 0; i < word_count; i++)
+      words[i].store(buffer[i], std::memory_order_relaxed);
+
+    sequence.store(seq + 2, std::memory_order_release);
+  }
+
+  [[nodiscard]] T load() const {
+    std::array<word_t, word_count> buffer;
+    std::uint32_t before, after;
+
+    do {
+      before = sequence.load(std::memory_order_acquire);
+
+      for (std::size_t i = 0; i < word_count; i++)
+        buffer[i] = words[i].load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+
+    T value;
+    std::memcpy(&value, buffer.data(), sizeof(T));
+    return value;
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_SEQLOCK_HPP_
@@ -5,12 +5,16 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
 
@@ -19,15 +23,36 @@ namespace alpaca {
 class serial {
   int fd;
 
-  int set_interface_attribs(int speed) {
+  // termios takes B* constants, not the rate itself
+  static speed_t to_speed(int baud_rate) {
+    switch (baud_rate) {
+      case 1200: return B1200;
+      case 2400: return B2400;
+      case 4800: return B4800;
+      case 9600: return B9600;
+      case 19200: return B19200;
+      case 38400: return B38400;
+      case 57600: return B57600;
+      case 115200: return B115200;
+      case 230400: return B230400;
+      default: return B0;
+    }
+  }
+
+  int set_interface_attribs(int baud_rate) {
     struct termios tty;
 
+    const speed_t speed = to_speed(baud_rate);
+    if (speed == B0) {
+      return -1;
+    }
+
     if (tcgetattr(fd, &tty) < 0) {
       return -1;
     }
 
-    cfsetospeed(&tty, static_cast<speed_t>(speed));
-    cfsetispeed(&tty, static_cast<speed_t>(speed));
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
 
     tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
     tty.c_cflag &= ~CSIZE;
@@ -41,9 +66,9 @@ class serial {
     tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
     tty.c_oflag &= ~OPOST;
 
-    /* fetch bytes as they become available */
+    /* never block in read(), waiting is done by poll() with a deadline */
     tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 5;
+    tty.c_cc[VTIME] = 0;
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) {
       return -1;
@@ -91,14 +116,17 @@ class serial {
     return fd != -1;
   }
 
+  // path must be nul terminated
   bool open(std::string_view path, int baudRate) {
-    fd = ::open(path.data(), O_RDWR | O_NOCTTY | O_SYNC);
+    fd = ::open(path.data(), O_RDWR | O_NOCTTY | O_CLOEXEC);
 
     if (fd < 0)
       return false;
 
-    if (set_interface_attribs(baudRate) < 0)
+    if (set_interface_attribs(baudRate) < 0) {
+      close();
       return false;
+    }
 
     return true;
   }
@@ -109,17 +137,64 @@ class serial {
     return true;
   }
 
-  int read(void* out, int out_size) {
+  // Reads until `out_size` bytes arrived, the `terminator` byte was received
+  // (-1 disables it) or `timeout_micros` elapsed, whichever happens first.
+  // Returns the number of bytes read or -1 when the port failed.
+  int read(void* out, int out_size, int terminator, std::int64_t timeout_micros) {
     char* out_bytes = reinterpret_cast<char*>(out);
-    const int size = out_size;
+    int size = 0;
+
+    timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_micros / 1000000;
+    deadline.tv_nsec += (timeout_micros % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while (size < out_size) {
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
 
-    int nbytes;
-    while ((nbytes = ::read(fd, out_bytes, out_size)) > 0) {
-      out_bytes += nbytes;
-      out_size -= nbytes;
+      timespec remaining = {
+        deadline.tv_sec - now.tv_sec,
+        deadline.tv_nsec - now.tv_nsec
+      };
+      if (remaining.tv_nsec < 0) {
+        remaining.tv_sec -= 1;
+        remaining.tv_nsec += 1000000000;
+      }
+      if (remaining.tv_sec < 0) break;
+
+      pollfd pfd = { fd, POLLIN, 0 };
+      int ready = ::ppoll(&pfd, 1, &remaining, nullptr);
+
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready < 0) return -1;
+      if (ready == 0) break;  // deadline
+
+      if ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) return -1;
+
+      int nbytes = ::read(fd, out_bytes + size, out_size - size);
+
+      if (nbytes < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      if (nbytes < 0) return -1;
+
+      if (terminator >= 0 && std::memchr(out_bytes + size, terminator, nbytes) != nullptr) {
+        size += nbytes;
+        break;
+      }
+
+      size += nbytes;
     }
 
-    return size - out_size;
+    return size;
+  }
+
+  // drops whatever is waiting in the input queue
+  void discard_input() {
+    tcflush(fd, TCIFLUSH);
   }
 
   int write(const void* in, int in_size) {
@@ -0,0 +1,250 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_SIMD_HPP_
+#define INCLUDE_SIMD_HPP_
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace alpaca {
+namespace simd {
+
+// Thin wrapper over the native float vector: AVX2 on x86 (build with
+// -mavx2 -mfma or -march=native), NEON on aarch64 (Raspberry Pi 4), one
+// lane otherwise. Only what the astronomy kernels need is here.
+#if defined(__AVX2__) && defined(__FMA__)
+
+struct mask_v {
+  __m256 v;
+
+  friend mask_v operator&(mask_v a, mask_v b) { return { _mm256_and_ps(a.v, b.v) }; }
+  friend mask_v operator|(mask_v a, mask_v b) { return { _mm256_or_ps(a.v, b.v) }; }
+};
+
+struct float_v {
+  constexpr static std::size_t width = 8;
+
+  __m256 v;
+
+  static float_v load(const float* ptr) { return { _mm256_loadu_ps(ptr) }; }
+  static float_v broadcast(float value) { return { _mm256_set1_ps(value) }; }
+  void store(float* ptr) const { _mm256_storeu_ps(ptr, v); }
+
+  friend float_v operator+(float_v a, float_v b) { return { _mm256_add_ps(a.v, b.v) }; }
+  friend float_v operator-(float_v a, float_v b) { return { _mm256_sub_ps(a.v, b.v) }; }
+  friend float_v operator*(float_v a, float_v b) { return { _mm256_mul_ps(a.v, b.v) }; }
+  friend float_v operator/(float_v a, float_v b) { return { _mm256_div_ps(a.v, b.v) }; }
+  friend float_v operator-(float_v a) { return { _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+
+  friend mask_v operator<(float_v a, float_v b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+  friend mask_v operator>(float_v a, float_v b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+  friend mask_v operator==(float_v a, float_v b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+};
+
+// a * b + c
+static inline float_v fma(float_v a, float_v b, float_v c) { return { _mm256_fmadd_ps(a.v, b.v, c.v) }; }
+static inline float_v min(float_v a, float_v b) { return { _mm256_min_ps(a.v, b.v) }; }
+static inline float_v max(float_v a, float_v b) { return { _mm256_max_ps(a.v, b.v) }; }
+static inline float_v abs(float_v a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+static inline float_v sqrt(float_v a) { return { _mm256_sqrt_ps(a.v) }; }
+static inline float_v round(float_v a) {
+  return { _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) };
+}
+static inline float_v floor(float_v a) {
+  return { _mm256_round_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC) };
+}
+// magnitude of a with the sign of b
+static inline float_v copysign(float_v a, float_v b) {
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  return { _mm256_or_ps(_mm256_andnot_ps(sign, a.v), _mm256_and_ps(sign, b.v)) };
+}
+// a where mask is set, b elsewhere
+static inline float_v select(mask_v mask, float_v a, float_v b) { return { _mm256_blendv_ps(b.v, a.v, mask.v) }; }
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+struct mask_v {
+  uint32x4_t v;
+
+  friend mask_v operator&(mask_v a, mask_v b) { return { vandq_u32(a.v, b.v) }; }
+  friend mask_v operator|(mask_v a, mask_v b) { return { vorrq_u32(a.v, b.v) }; }
+};
+
+struct float_v {
+  constexpr static std::size_t width = 4;
+
+  float32x4_t v;
+
+  static float_v load(const float* ptr) { return { vld1q_f32(ptr) }; }
+  static float_v broadcast(float value) { return { vdupq_n_f32(value) }; }
+  void store(float* ptr) const { vst1q_f32(ptr, v); }
+
+  friend float_v operator+(float_v a, float_v b) { return { vaddq_f32(a.v, b.v) }; }
+  friend float_v operator-(float_v a, float_v b) { return { vsubq_f32(a.v, b.v) }; }
+  friend float_v operator*(float_v a, float_v b) { return { vmulq_f32(a.v, b.v) }; }
+  friend float_v operator/(float_v a, float_v b) { return { vdivq_f32(a.v, b.v) }; }
+  friend float_v operator-(float_v a) { return { vnegq_f32(a.v) }; }
+
+  friend mask_v operator<(float_v a, float_v b) { return { vcltq_f32(a.v, b.v) }; }
+  friend mask_v operator>(float_v a, float_v b) { return { vcgtq_f32(a.v, b.v) }; }
+  friend mask_v operator==(float_v a, float_v b) { return { vceqq_f32(a.v, b.v) }; }
+};
+
+static inline float_v fma(float_v a, float_v b, float_v c) { return { vfmaq_f32(c.v, a.v, b.v) }; }
+static inline float_v min(float_v a, float_v b) { return { vminq_f32(a.v, b.v) }; }
+static inline float_v max(float_v a, float_v b) { return { vmaxq_f32(a.v, b.v) }; }
+static inline float_v abs(float_v a) { return { vabsq_f32(a.v) }; }
+static inline float_v sqrt(float_v a) { return { vsqrtq_f32(a.v) }; }
+static inline float_v round(float_v a) { return { vrndnq_f32(a.v) }; }
+static inline float_v floor(float_v a) { return { vrndmq_f32(a.v) }; }
+static inline float_v copysign(float_v a, float_v b) {
+  uint32x4_t sign = vdupq_n_u32(0x80000000u);
+  return { vbslq_f32(sign, b.v, a.v) };
+}
+static inline float_v select(mask_v mask, float_v a, float_v b) { return { vbslq_f32(mask.v, a.v, b.v) }; }
+
+#else
+
+struct mask_v {
+  bool v;
+
+  friend mask_v operator&(mask_v a, mask_v b) { return { a.v && b.v }; }
+  friend mask_v operator|(mask_v a, mask_v b) { return { a.v || b.v }; }
+};
+
+struct float_v {
+  constexpr static std::size_t width = 1;
+
+  float v;
+
+  static float_v load(const float* ptr) { return { *ptr }; }
+  static float_v broadcast(float value) { return { value }; }
+  void store(float* ptr) const { *ptr = v; }
+
+  friend float_v operator+(float_v a, float_v b) { return { a.v + b.v }; }
+  friend float_v operator-(float_v a, float_v b) { return { a.v - b.v }; }
+  friend float_v operator*(float_v a, float_v b) { return { a.v * b.v }; }
+  friend float_v operator/(float_v a, float_v b) { return { a.v / b.v }; }
+  friend float_v operator-(float_v a) { return { -a.v }; }
+
+  friend mask_v operator<(float_v a, float_v b) { return { a.v < b.v }; }
+  friend mask_v operator>(float_v a, float_v b) { return { a.v > b.v }; }
+  friend mask_v operator==(float_v a, float_v b) { return { a.v == b.v }; }
+};
+
+static inline float_v fma(float_v a, float_v b, float_v c) { return { a.v * b.v + c.v }; }
+static inline float_v min(float_v a, float_v b) { return { a.v < b.v ? a.v : b.v }; }
+static inline float_v max(float_v a, float_v b) { return { a.v > b.v ? a.v : b.v }; }
+static inline float_v abs(float_v a) { return { std::fabs(a.v) }; }
+static inline float_v sqrt(float_v a) { return { std::sqrt(a.v) }; }
+static inline float_v round(float_v a) { return { std::nearbyint(a.v) }; }
+static inline float_v floor(float_v a) { return { std::floor(a.v) }; }
+static inline float_v copysign(float_v a, float_v b) { return { std::copysign(a.v, b.v) }; }
+static inline float_v select(mask_v mask, float_v a, float_v b) { return { mask.v ? a.v : b.v }; }
+
+#endif
+
+// Polynomial approximations in the style of cephes sinf/asinf, a few ulp
+// away from libm. Angles are in degrees: the reduction to [-45, 45] is then
+// exact in float, which radians with a rounded pi/2 are not.
+static inline void sincos_deg(float_v degrees, float_v* sin, float_v* cos) {
+  const float_v quadrant = round(degrees * float_v::broadcast(1.0f / 90.0f));
+  const float_v r = (degrees - quadrant * float_v::broadcast(90.0f))
+    * float_v::broadcast(static_cast<float>(M_PI / 180.0));
+  const float_v z = r * r;
+
+  float_v s = fma(z, float_v::broadcast(-1.9515295891e-4f), float_v::broadcast(8.3321608736e-3f));
+  s = fma(z, s, float_v::broadcast(-1.6666654611e-1f));
+  s = fma(z * r, s, r);
+
+  float_v c = fma(z, float_v::broadcast(2.443315711809948e-5f), float_v::broadcast(-1.388731625493765e-3f));
+  c = fma(z, c, float_v::broadcast(4.166664568298827e-2f));
+  c = fma(z * z, c, fma(z, float_v::broadcast(-0.5f), float_v::broadcast(1.0f)));
+
+  // quadrant modulo 4, still as a float
+  const float_v q = quadrant - float_v::broadcast(4.0f) * floor(quadrant * float_v::broadcast(0.25f));
+
+  const mask_v swap = (q == float_v::broadcast(1.0f)) | (q == float_v::broadcast(3.0f));
+  const mask_v negate_sin = q > float_v::broadcast(1.5f);
+  const mask_v negate_cos = (q == float_v::broadcast(1.0f)) | (q == float_v::broadcast(2.0f));
+
+  const float_v sin_r = select(swap, c, s);
+  const float_v cos_r = select(swap, s, c);
+
+  *sin = select(negate_sin, -sin_r, sin_r);
+  *cos = select(negate_cos, -cos_r, cos_r);
+}
+
+namespace detail {
+
+// asin of |x| as (asin(t), reflected), in radians. Beyond 0.5 it answers
+// asin(sqrt((1 - |x|) / 2)), which keeps precision where acos needs it.
+static inline float_v asin_core(float_v a, mask_v* reflected) {
+  *reflected = a > float_v::broadcast(0.5f);
+
+  const float_v half = float_v::broadcast(0.5f) * (float_v::broadcast(1.0f) - a);
+  const float_v z = select(*reflected, half, a * a);
+  const float_v t = select(*reflected, sqrt(half), a);
+
+  float_v p = fma(z, float_v::broadcast(4.2163199048e-2f), float_v::broadcast(2.4181311049e-2f));
+  p = fma(z, p, float_v::broadcast(4.5470025998e-2f));
+  p = fma(z, p, float_v::broadcast(7.4953002686e-2f));
+  p = fma(z, p, float_v::broadcast(1.6666752422e-1f));
+
+  return fma(t * z, p, t);
+}
+
+}  // namespace detail
+
+// x must be in [-1, 1], results in degrees
+static inline float_v asin_deg(float_v x) {
+  const float_v k = float_v::broadcast(static_cast<float>(180.0 / M_PI));
+
+  mask_v reflected;
+  const float_v t = detail::asin_core(abs(x), &reflected) * k;
+  const float_v angle = select(reflected, float_v::broadcast(90.0f) - t - t, t);
+
+  return copysign(angle, x);
+}
+
+static inline float_v acos_deg(float_v x) {
+  const float_v k = float_v::broadcast(static_cast<float>(180.0 / M_PI));
+
+  mask_v reflected;
+  const float_v t = detail::asin_core(abs(x), &reflected) * k;
+
+  const float_v near = select(x < float_v::broadcast(0.0f), float_v::broadcast(180.0f) - t - t, t + t);
+  const float_v far = float_v::broadcast(90.0f) - copysign(t, x);
+
+  return select(reflected, near, far);
+}
+
+// atan2 in degrees, in (-180, 180]. Built on asin of the smaller
+// of |x| and |y| over the radius, which is well conditioned everywhere.
+static inline float_v atan2_deg(float_v y, float_v x) {
+  const float_v k = float_v::broadcast(static_cast<float>(180.0 / M_PI));
+  const float_v ax = abs(x);
+  const float_v ay = abs(y);
+
+  const float_v radius = max(sqrt(fma(x, x, y * y)), float_v::broadcast(1e-30f));
+
+  mask_v reflected;
+  const float_v t = detail::asin_core(min(ax, ay) / radius, &reflected) * k;
+
+  float_v angle = select(reflected, float_v::broadcast(90.0f) - t - t, t);
+  angle = select(ay > ax, float_v::broadcast(90.0f) - angle, angle);
+  angle = select(x < float_v::broadcast(0.0f), float_v::broadcast(180.0f) - angle, angle);
+
+  return copysign(angle, y);
+}
+
+}  // namespace simd
+}  // namespace alpaca
+
+#endif  // INCLUDE_SIMD_HPP_
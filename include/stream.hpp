@@ -0,0 +1,237 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_STREAM_HPP_
+#define INCLUDE_STREAM_HPP_
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <budget.hpp>
+#include <json.hpp>
+#include <telemetry.hpp>
+#include <time.hpp>
+
+namespace alpaca {
+
+// Fans the telemetry of one device out to streaming subscribers. The poller
+// is the only producer and formats every update once as server sent events,
+// subscribers only copy the text of the events they have not seen yet.
+class telemetry_stream {
+  constexpr static int max_subscribers = 32;
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+
+  std::uint64_t sequence = 0;
+  telemetry_t last = {};
+
+  std::string snapshot_event;  // every known field as of `sequence`
+  std::string delta_event;     // fields that changed from `sequence - 1`
+
+  std::atomic<int> subscribers{0};
+
+  [[nodiscard]] static bool same(const telemetry_t& a, const telemetry_t& b, telemetry_field_t field) {
+    switch (field) {
+      case telemetry_field_t::rightascension: return a.rightascension == b.rightascension;
+      case telemetry_field_t::declination: return a.declination == b.declination;
+      case telemetry_field_t::altitude: return a.altitude == b.altitude;
+      case telemetry_field_t::azimuth: return a.azimuth == b.azimuth;
+      case telemetry_field_t::slewing: return a.slewing == b.slewing;
+      case telemetry_field_t::tracking: return a.tracking == b.tracking;
+      default: return true;
+    }
+  }
+
+  static void write_event(
+    std::string* out, std::string_view name, std::uint64_t id,
+    const telemetry_t& telemetry, std::uint32_t fields) {
+    constexpr std::string_view keys[] = {
+      "RightAscension", "Declination", "Altitude", "Azimuth", "Slewing", "Tracking"
+    };
+
+    json_writer writer(out);
+
+    out->clear();
+    out->append("event: ").append(name).append("\nid: ");
+    writer.write_int(static_cast<json_int>(id));
+    out->append("\ndata: {");
+
+    bool first = true;
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if ((fields & telemetry_t::bit(field)) == 0) continue;
+
+      if (!first) out->push_back(',');
+      first = false;
+
+      writer.write_key(keys[i]);
+
+      switch (field) {
+        case telemetry_field_t::rightascension: writer.write_float(telemetry.rightascension); break;
+        case telemetry_field_t::declination: writer.write_float(telemetry.declination); break;
+        case telemetry_field_t::altitude: writer.write_float(telemetry.altitude); break;
+        case telemetry_field_t::azimuth: writer.write_float(telemetry.azimuth); break;
+        case telemetry_field_t::slewing: writer.write_bool(telemetry.slewing); break;
+        case telemetry_field_t::tracking: writer.write_bool(telemetry.tracking); break;
+        default: break;
+      }
+    }
+
+    out->append("}\n\n");
+  }
+
+ public:
+  // called by the poller after every published snapshot
+  void publish(const telemetry_t& telemetry) {
+    std::uint32_t changed = 0;
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if (!telemetry.has(field)) continue;
+
+      if (!last.has(field) || !same(last, telemetry, field))
+        changed |= telemetry_t::bit(field);
+    }
+
+    if (changed == 0) return;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      sequence++;
+      write_event(&delta_event, "delta", sequence, telemetry, changed);
+      write_event(&snapshot_event, "snapshot", sequence, telemetry, telemetry.fields);
+    }
+
+    last = telemetry;
+    cv.notify_all();
+  }
+
+  [[nodiscard]] int get_subscribers() const {
+    return subscribers.load(std::memory_order_relaxed);
+  }
+
+  // false when the stream already has all the subscribers it takes
+  [[nodiscard]] bool subscribe() {
+    if (subscribers.fetch_add(1, std::memory_order_relaxed) >= max_subscribers) {
+      subscribers.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    return true;
+  }
+
+  void unsubscribe() {
+    subscribers.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Waits until an update newer than `seen` or the deadline. A subscriber
+  // one update behind gets the delta, anyone further behind (or new) gets
+  // the whole snapshot. Returns false on timeout.
+  bool wait(std::uint64_t* seen, std::string* out, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (!cv.wait_until(lock, deadline, [this, seen]() { return sequence > *seen; }))
+      return false;
+
+    out->assign(sequence == *seen + 1 && *seen != 0 ? delta_event : snapshot_event);
+    *seen = sequence;
+
+    return true;
+  }
+
+  // the current snapshot, for subscribers that asked for a fixed interval
+  void snapshot(std::uint64_t* seen, std::string* out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    out->assign(snapshot_event);
+    *seen = sequence;
+  }
+};
+
+// One streaming client, owned by the http response that writes its events.
+class telemetry_subscription {
+  // a comment line now and then, so proxies and clients see a live connection
+  constexpr static std::int64_t keepalive_micros = 10000000;
+
+  telemetry_stream* stream;
+  std::int64_t interval_micros;
+
+  // place in the server's blocking budget, released with the subscription
+  blocking_slot_t slot;
+
+  std::uint64_t seen = 0;
+  std::chrono::steady_clock::time_point next_snapshot;
+
+  std::string pending;
+  std::size_t offset = 0;
+
+  void next_event() {
+    using clock = std::chrono::steady_clock;
+
+    auto now = clock::now();
+    auto deadline = now + std::chrono::microseconds(keepalive_micros);
+
+    if (interval_micros > 0) {
+      if (now >= next_snapshot) {
+        stream->snapshot(&seen, &pending);
+        next_snapshot = now + std::chrono::microseconds(interval_micros);
+
+        if (!pending.empty()) return;
+      }
+
+      deadline = std::min(deadline, next_snapshot);
+    }
+
+    if (!stream->wait(&seen, &pending, deadline) && (interval_micros <= 0 || clock::now() < next_snapshot))
+      pending.assign(": keepalive\n\n");
+  }
+
+ public:
+  // `interval_micros` above zero also repeats the snapshot at that period
+  telemetry_subscription(telemetry_stream* stream, std::int64_t interval_micros, blocking_slot_t&& slot)
+  : stream(stream)
+  , interval_micros(interval_micros)
+  , slot(std::move(slot))
+  , next_snapshot(std::chrono::steady_clock::now()) {
+  }
+
+  ~telemetry_subscription() {
+    stream->unsubscribe();
+  }
+
+  telemetry_subscription(const telemetry_subscription&) = delete;
+  telemetry_subscription& operator=(const telemetry_subscription&) = delete;
+
+  // cycle callback of the streaming response, blocks until there is
+  // something to send
+  static ssize_t cycle(std::shared_ptr<telemetry_subscription> self, char* buffer, std::size_t max) {
+    if (self->offset >= self->pending.size()) {
+      self->pending.clear();
+      self->offset = 0;
+
+      while (self->pending.empty())
+        self->next_event();
+    }
+
+    std::size_t size = std::min(max, self->pending.size() - self->offset);
+    std::memcpy(buffer, self->pending.data() + self->offset, size);
+    self->offset += size;
+
+    return static_cast<ssize_t>(size);
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_STREAM_HPP_
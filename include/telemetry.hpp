@@ -0,0 +1,308 @@
+// Copyright (C) 2023 Marrony Neris
+
+#ifndef INCLUDE_TELEMETRY_HPP_
+#define INCLUDE_TELEMETRY_HPP_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+#include <seqlock.hpp>
+#include <time.hpp>
+
+namespace alpaca {
+
+enum class telemetry_field_t : std::uint32_t {
+  rightascension = 0,
+  declination,
+  altitude,
+  azimuth,
+  slewing,
+  tracking,
+  count
+};
+
+constexpr std::size_t telemetry_field_count = static_cast<std::size_t>(telemetry_field_t::count);
+
+[[nodiscard]] constexpr std::string_view telemetry_field_name(telemetry_field_t field) {
+  switch (field) {
+    case telemetry_field_t::rightascension: return "rightascension";
+    case telemetry_field_t::declination: return "declination";
+    case telemetry_field_t::altitude: return "altitude";
+    case telemetry_field_t::azimuth: return "azimuth";
+    case telemetry_field_t::slewing: return "slewing";
+    case telemetry_field_t::tracking: return "tracking";
+    default: return "unknown";
+  }
+}
+
+// read-only mount state, fields are refreshed at their own cadence
+struct telemetry_t {
+  std::array<monotonic_t, telemetry_field_count> timestamps;  // when each field was read
+  std::uint32_t fields;  // bitmask of the fields read successfully
+
+  float rightascension;
+  float declination;
+  float altitude;
+  float azimuth;
+  bool slewing;
+  bool tracking;
+
+  [[nodiscard]] constexpr static std::uint32_t bit(telemetry_field_t field) {
+    return 1u << static_cast<std::uint32_t>(field);
+  }
+
+  [[nodiscard]] constexpr bool has(telemetry_field_t field) const {
+    return (fields & bit(field)) != 0;
+  }
+
+  constexpr void set(telemetry_field_t field) {
+    fields |= bit(field);
+  }
+};
+
+struct telemetry_options_t {
+  // poll period while the mount moves (goto, moveaxis, guiding or right
+  // after a command), zero disables the poller
+  std::int64_t interval_micros = 0;
+
+  // poll period while the mount sits still, tracking or not
+  std::int64_t idle_interval_micros = 5000000;
+
+  // fields no client asked for within the window are not polled at all
+  std::int64_t demand_window_micros = 60000000;
+
+  // fast polling continues this long after a command, a goto takes a
+  // moment to show up in the goto in progress flag
+  std::int64_t settle_micros = 2000000;
+
+  // how old a snapshot field can be and still answer a GET
+  std::array<std::int64_t, telemetry_field_count> max_age_micros = {
+    1000000,  // rightascension
+    1000000,  // declination
+    1000000,  // altitude
+    1000000,  // azimuth
+     500000,  // slewing
+    2000000,  // tracking
+  };
+};
+
+// Latest telemetry snapshot of a device. Readers are lock free, writers
+// (poller and invalidations) are serialized. Every invalidation bumps the
+// generation so a poll cycle started before a state change can not publish
+// stale values after it.
+class telemetry_cache {
+  seqlock<telemetry_t> snapshot;
+
+  std::mutex writer;
+  std::atomic<std::uint32_t> generation;
+
+  std::array<std::atomic<std::int64_t>, telemetry_field_count> max_age_micros;
+
+  // extra age the poller grants while it polls a field slower than usual
+  std::array<std::atomic<std::int64_t>, telemetry_field_count> allowance_micros;
+
+  // last GET of each field, hit or miss, and the last invalidation
+  mutable std::array<std::atomic<std::int64_t>, telemetry_field_count> demanded_micros;
+  std::atomic<std::int64_t> changed_micros;
+
+  mutable std::array<std::atomic<std::uint64_t>, telemetry_field_count> hits;
+  mutable std::array<std::atomic<std::uint64_t>, telemetry_field_count> misses;
+
+  // wakes whoever waits for the mount to reach some state
+  std::mutex published_mutex;
+  std::condition_variable published;
+
+ public:
+  telemetry_cache()
+  : snapshot()
+  , generation(0)
+  , max_age_micros()
+  , allowance_micros()
+  , demanded_micros()
+  , changed_micros(0)
+  , hits()
+  , misses() {
+    set_options(telemetry_options_t{});
+  }
+
+  void set_options(const telemetry_options_t& options) {
+    for (std::size_t i = 0; i < telemetry_field_count; i++)
+      max_age_micros[i].store(options.max_age_micros[i], std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint32_t get_generation() const {
+    return generation.load(std::memory_order_acquire);
+  }
+
+  // returns false when the snapshot was invalidated since `expected` was read
+  bool publish(const telemetry_t& telemetry, std::uint32_t expected) {
+    std::lock_guard<std::mutex> lock(writer);
+
+    if (generation.load(std::memory_order_relaxed) != expected)
+      return false;
+
+    snapshot.store(telemetry);
+
+    // taken once so a waiter between its check and its sleep is not missed
+    { std::lock_guard<std::mutex> published_lock(published_mutex); }
+    published.notify_all();
+
+    return true;
+  }
+
+  // Blocks until a published snapshot satisfies `done`, false once
+  // `timeout_micros` passed. Waiting costs nothing on the serial link, the
+  // poller wakes the waiters with every snapshot it publishes.
+  template<typename Done>
+  bool wait(Done&& done, std::int64_t timeout_micros) {
+    std::unique_lock<std::mutex> lock(published_mutex);
+
+    return published.wait_for(lock, std::chrono::microseconds(timeout_micros), [this, &done]() {
+      return done(snapshot.load());
+    });
+  }
+
+  // Adds fields read outside the poller to the snapshot, with their own
+  // timestamps. Dropped when the snapshot was invalidated since `expected`.
+  bool merge(const telemetry_t& telemetry, std::uint32_t expected) {
+    std::lock_guard<std::mutex> lock(writer);
+
+    if (generation.load(std::memory_order_relaxed) != expected)
+      return false;
+
+    telemetry_t merged = snapshot.load();
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if (!telemetry.has(field)) continue;
+
+      switch (field) {
+        case telemetry_field_t::rightascension: merged.rightascension = telemetry.rightascension; break;
+        case telemetry_field_t::declination: merged.declination = telemetry.declination; break;
+        case telemetry_field_t::altitude: merged.altitude = telemetry.altitude; break;
+        case telemetry_field_t::azimuth: merged.azimuth = telemetry.azimuth; break;
+        case telemetry_field_t::slewing: merged.slewing = telemetry.slewing; break;
+        case telemetry_field_t::tracking: merged.tracking = telemetry.tracking; break;
+        default: break;
+      }
+
+      merged.timestamps[i] = telemetry.timestamps[i];
+      merged.set(field);
+    }
+
+    snapshot.store(merged);
+
+    { std::lock_guard<std::mutex> published_lock(published_mutex); }
+    published.notify_all();
+
+    return true;
+  }
+
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(writer);
+
+    generation.fetch_add(1, std::memory_order_acq_rel);
+    snapshot.store(telemetry_t{});
+
+    for (auto& allowance : allowance_micros)
+      allowance.store(0, std::memory_order_relaxed);
+
+    changed_micros.store(monotonic_t::now().micros, std::memory_order_relaxed);
+  }
+
+  void set_allowance(telemetry_field_t field, std::int64_t micros) {
+    allowance_micros[static_cast<std::size_t>(field)].store(micros, std::memory_order_relaxed);
+  }
+
+  // keeps the poller reading a field nobody GETs, for waiters
+  void demand(telemetry_field_t field) const {
+    demanded_micros[static_cast<std::size_t>(field)].store(monotonic_t::now().micros, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] monotonic_t get_demanded(telemetry_field_t field) const {
+    return { demanded_micros[static_cast<std::size_t>(field)].load(std::memory_order_relaxed) };
+  }
+
+  [[nodiscard]] monotonic_t get_changed() const {
+    return { changed_micros.load(std::memory_order_relaxed) };
+  }
+
+  [[nodiscard]] telemetry_t load() const {
+    return snapshot.load();
+  }
+
+  // fields of `wanted` (a telemetry_t::bit mask) a GET would answer from
+  // the snapshot, fields with caching disabled are never fresh
+  [[nodiscard]] std::uint32_t fresh(const telemetry_t& telemetry, std::uint32_t wanted) const {
+    const monotonic_t now = monotonic_t::now();
+    std::uint32_t fields = 0;
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if ((wanted & telemetry_t::bit(field)) == 0 || !telemetry.has(field)) continue;
+
+      std::int64_t max_age = max_age_micros[i].load(std::memory_order_relaxed);
+      if (max_age <= 0) continue;
+
+      max_age += allowance_micros[i].load(std::memory_order_relaxed);
+      if (now - telemetry.timestamps[i] <= max_age)
+        fields |= telemetry_t::bit(field);
+    }
+
+    return fields;
+  }
+
+  // fields of `wanted` with caching enabled
+  [[nodiscard]] std::uint32_t cached(std::uint32_t wanted) const {
+    std::uint32_t fields = 0;
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      if (max_age_micros[i].load(std::memory_order_relaxed) > 0)
+        fields |= telemetry_t::bit(static_cast<telemetry_field_t>(i));
+    }
+
+    return wanted & fields;
+  }
+
+  template<typename T>
+  [[nodiscard]] std::optional<T> find(telemetry_field_t field, T telemetry_t::* member) const {
+    std::size_t index = static_cast<std::size_t>(field);
+    std::int64_t max_age = max_age_micros[index].load(std::memory_order_relaxed);
+
+    // caching disabled for this field, not a miss
+    if (max_age <= 0) return std::nullopt;
+
+    monotonic_t now = monotonic_t::now();
+    demanded_micros[index].store(now.micros, std::memory_order_relaxed);
+
+    max_age += allowance_micros[index].load(std::memory_order_relaxed);
+
+    telemetry_t telemetry = snapshot.load();
+
+    if (!telemetry.has(field) || now - telemetry.timestamps[index] > max_age) {
+      misses[index].fetch_add(1, std::memory_order_relaxed);
+      return std::nullopt;
+    }
+
+    hits[index].fetch_add(1, std::memory_order_relaxed);
+    return telemetry.*member;
+  }
+
+  [[nodiscard]] std::uint64_t get_hits(telemetry_field_t field) const {
+    return hits[static_cast<std::size_t>(field)].load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint64_t get_misses(telemetry_field_t field) const {
+    return misses[static_cast<std::size_t>(field)].load(std::memory_order_relaxed);
+  }
+};
+
+}  // namespace alpaca
+
+#endif  // INCLUDE_TELEMETRY_HPP_
@@ -7,17 +7,23 @@
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
+#include <limits>
+#include <span>
 #include <sstream>
 #include <vector>
 #include <map>
 #include <string>
 #include <stdexcept>
+#include <thread>
 
 #include <device.hpp>
 #include <parser.hpp>
 #include <fields.hpp>
 #include <time.hpp>
+#include <astronomy.hpp>
 #include <json.hpp>
+#include <telemetry.hpp>
+#include <stream.hpp>
 
 namespace alpaca {
 
@@ -128,6 +134,57 @@ struct coord_t {
   }
 };
 
+// observer of a site and its local sidereal time at one instant
+struct sky_t {
+  astronomy::observer_t observer;
+  float lst;  // degrees
+};
+
+// equatorial targets in SoA layout, ready for the batched transforms
+struct targets_t {
+  constexpr static std::size_t max_targets = 4096;
+
+  arena_vector<float> rightascension;  // degrees
+  arena_vector<float> declination;
+
+  static return_t<arena_vector<float>> parse_list(
+    std::string_view list, float scale, const char* name) {
+    arena_vector<float> values;
+
+    for (std::string_view token : util::split(list, ",")) {
+      auto value = parser::conversor<float>{}.conv(token);
+
+      if (value.is_error() || values.size() == max_targets)
+        return custom_error("Invalid '", name, "' field");
+
+      values.push_back(value.get() * scale);
+    }
+
+    return values;
+  }
+
+  targets_t(arena_vector<float>&& rightascension, arena_vector<float>&& declination)
+  : rightascension(std::move(rightascension)), declination(std::move(declination)) { }
+
+  // RightAscension in hours and Declination in degrees, as comma separated lists
+  static return_t<targets_t> parse(const arguments_t& args) {
+    return visit(
+      [](std::string_view ra, std::string_view de) {
+        return visit(
+          [](arena_vector<float>&& ra, arena_vector<float>&& de) -> return_t<targets_t> {
+            if (ra.size() != de.size())
+              return custom_error("'RightAscension' and 'Declination' lengths differ");
+
+            return targets_t(std::move(ra), std::move(de));
+          },
+          parse_list(ra, 15.0f, "RightAscension"),
+          parse_list(de, 1.0f, "Declination"));
+      },
+      fields::rightascensions_f.get(args),
+      fields::declinations_f.get(args));
+  }
+};
+
 struct pulse_t {
   int direction;
   int duration;
@@ -158,6 +215,155 @@ struct move_t {
 class telescope : public device {
   telescopeinfo_t telescopeinfo;
 
+  mutable telemetry_cache telemetry;
+  mutable telemetry_stream stream;
+
+  // synchronous slews waiting for their goto or settle, Slewing stays true
+  // while the latest of them was started after the last abortslew
+  std::atomic<int> slews_waiting{0};
+
+  // bumped by abortslew, the waits of the slews started before it end
+  std::atomic<std::uint32_t> slew_generation{0};
+  std::atomic<std::uint32_t> waiting_generation{0};
+
+  // goto longer than this fail the synchronous slew waiting for it
+  constexpr static std::int64_t max_slew_micros = 600ll * 1000000;
+
+  // without a fresh snapshot the mount itself is asked this often
+  constexpr static std::int64_t slew_check_micros = 1000000;
+
+  // A mount may report its goto a poll or two after taking it. A wait that
+  // never saw the goto moving only takes a stop as its end after this long.
+  constexpr static std::int64_t slew_start_micros = 1500000;
+
+  [[nodiscard]] bool settling() const {
+    return slews_waiting.load(std::memory_order_relaxed) > 0
+      && waiting_generation.load(std::memory_order_relaxed) == slew_generation.load(std::memory_order_relaxed);
+  }
+
+  // Wait of one synchronous slew, made before its goto is sent and run by
+  // the deferred reply once the PUT returned. Each slew keeps its own start,
+  // concurrent ones do not take each other's goto for their own. It counts
+  // as waiting from construction to the end of the wait, or to destruction
+  // when the PUT failed or the reply was dropped unsent.
+  class slew_wait_t : public completion {
+    telescope* tel;
+    const monotonic_t started;
+    const std::uint32_t generation;
+    bool waiting = true;
+
+    void release() {
+      if (!waiting) return;
+
+      waiting = false;
+      tel->slews_waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+   public:
+    explicit slew_wait_t(telescope* tel)
+    : tel(tel)
+    , started(monotonic_t::now())
+    , generation(tel->slew_generation.load(std::memory_order_relaxed)) {
+      tel->waiting_generation.store(generation, std::memory_order_relaxed);
+      tel->slews_waiting.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    virtual ~slew_wait_t() override {
+      release();
+    }
+
+    slew_wait_t(const slew_wait_t&) = delete;
+    slew_wait_t& operator=(const slew_wait_t&) = delete;
+
+    virtual return_t<void> wait() override {
+      auto ret = tel->wait_for_slew(started, generation);
+      release();
+      return ret;
+    }
+  };
+
+  // Waits for the goto sent at `started` to end and then for the settle
+  // time. The end comes from the poller, so
+  // the wait sends nothing to the mount and wakes with the snapshots it
+  // publishes. Without a poller the mount is asked once a second.
+  return_t<void> wait_for_slew(monotonic_t started, std::uint32_t generation) {
+    const std::size_t index = static_cast<std::size_t>(telemetry_field_t::slewing);
+    bool seen_moving = false;
+
+    auto aborted = [this, generation]() {
+      return slew_generation.load(std::memory_order_relaxed) != generation;
+    };
+
+    auto stopped = [&](const telemetry_t& snapshot) {
+      if (aborted()) return true;
+
+      const std::int64_t since = snapshot.timestamps[index] - started;
+      if (!snapshot.has(telemetry_field_t::slewing) || since < 0) return false;
+
+      if (snapshot.slewing) {
+        seen_moving = true;
+        return false;
+      }
+
+      return seen_moving || since >= slew_start_micros;
+    };
+
+    auto ended = [&]() -> return_t<bool> {
+      while (true) {
+        telemetry.demand(telemetry_field_t::slewing);
+
+        if (telemetry.wait(stopped, slew_check_micros)) return true;
+
+        monotonic_t now = monotonic_t::now();
+        if (now - started > max_slew_micros) return false;
+
+        telemetry_t snapshot = telemetry.load();
+        if (snapshot.has(telemetry_field_t::slewing) && now - snapshot.timestamps[index] < slew_check_micros)
+          continue;
+
+        auto slewing = get_slewing();
+        if (slewing.is_error()) return slewing.error();
+
+        if (slewing.get())
+          seen_moving = true;
+        else if (seen_moving || now - started >= slew_start_micros)
+          return true;
+      }
+    }();
+
+    if (ended.is_error()) return ended.error();
+    if (!ended.get()) return custom_error("Slew did not finish");
+    if (aborted()) return custom_error("Slew aborted");
+
+    auto settle_time = get_slewsettletime();
+    const std::int64_t settle_micros = settle_time.is_error() ? 0 : std::max(0, settle_time.get()) * 1000000ll;
+
+    // an abort ends the settle too, the poller publishes the state change
+    telemetry.wait([&aborted](const telemetry_t&) { return aborted(); }, settle_micros);
+    if (aborted()) return custom_error("Slew aborted");
+
+    return {};
+  }
+
+  template<typename T, typename Fn>
+  auto from_telemetry(telemetry_field_t field, T telemetry_t::* member, Fn&& fn) const
+    -> return_t<T> {
+    if (auto cached = telemetry.find(field, member))
+      return *cached;
+
+    return fn();
+  }
+
+  template<typename T>
+  static void to_telemetry(
+    telemetry_t* snapshot, telemetry_field_t field, T telemetry_t::* member,
+    const return_t<T>& value) {
+    if (!value.is_error()) {
+      snapshot->*member = value.get();
+      snapshot->set(field);
+    }
+  }
+
   [[nodiscard]]
   inline auto check_parked() const -> check_t {
     return get_atpark()
@@ -180,7 +386,9 @@ class telescope : public device {
   return_t<float> priv_get_altitude() const {
     return visit(
       [this]() {
-        return get_altitude();
+        return from_telemetry(telemetry_field_t::altitude, &telemetry_t::altitude, [this]() {
+          return get_altitude();
+        });
       },
       check_connected()
     );
@@ -189,7 +397,29 @@ class telescope : public device {
   return_t<float> priv_get_azimuth() const {
     return visit(
       [this]() {
-        return get_azimuth();
+        return from_telemetry(telemetry_field_t::azimuth, &telemetry_t::azimuth, [this]() {
+          return get_azimuth();
+        });
+      },
+      check_connected()
+    );
+  }
+
+  // not part of the Alpaca API, horizontal coordinates of many targets
+  // at once for planning tools
+  return_t<json_value> priv_get_horizontalcoordinates(const targets_t& targets) const {
+    return visit(
+      [this, &targets]() {
+        arena_vector<float> azimuth(targets.rightascension.size());
+        arena_vector<float> altitude(targets.rightascension.size());
+
+        return get_horizontalcoordinates(targets, azimuth, altitude)
+          .map([&azimuth, &altitude]() -> json_value {
+            return json_object {
+              {"Azimuth", json_array(azimuth.begin(), azimuth.end())},
+              {"Altitude", json_array(altitude.begin(), altitude.end())},
+            };
+          });
       },
       check_connected()
     );
@@ -198,7 +428,9 @@ class telescope : public device {
   return_t<float> priv_get_declination() const {
     return visit(
       [this]() {
-        return get_declination();
+        return from_telemetry(telemetry_field_t::declination, &telemetry_t::declination, [this]() {
+          return get_declination();
+        });
       },
       check_connected()
     );
@@ -207,7 +439,9 @@ class telescope : public device {
   return_t<float> priv_get_rightascension() const {
     return visit(
       [this]() {
-        return get_rightascension();
+        return from_telemetry(telemetry_field_t::rightascension, &telemetry_t::rightascension, [this]() {
+          return get_rightascension();
+        });
       },
       check_connected()
     );
@@ -243,7 +477,12 @@ class telescope : public device {
   return_t<bool> priv_get_slewing() const {
     return visit(
       [this]() {
-        return get_slewing();
+        return from_telemetry(telemetry_field_t::slewing, &telemetry_t::slewing, [this]() {
+          return get_slewing();
+        })
+        .map([this](bool slewing) {
+          return slewing || settling();
+        });
       },
       check_connected()
     );
@@ -400,6 +639,16 @@ class telescope : public device {
     );
   }
 
+  // not part of the Alpaca API, the sky the catalog queries are answered on
+  return_t<sky_t> priv_get_sky() const {
+    return visit(
+      [this]() {
+        return get_sky();
+      },
+      check_connected()
+    );
+  }
+
   return_t<float> priv_get_sitelatitude() const {
     return visit(
       [this]() {
@@ -498,7 +747,9 @@ class telescope : public device {
   return_t<bool> priv_get_tracking() const {
     return visit(
       [this]() {
-        return get_tracking();
+        return from_telemetry(telemetry_field_t::tracking, &telemetry_t::tracking, [this]() {
+          return get_tracking();
+        });
       },
       check_connected()
     );
@@ -532,7 +783,7 @@ class telescope : public device {
     );
   }
 
-  return_t<std::string> priv_get_utcdate() const {
+  return_t<json_string> priv_get_utcdate() const {
     return visit(
       [this]() {
         return get_utcdate();
@@ -554,7 +805,11 @@ class telescope : public device {
   return_t<void> priv_abortslew() {
     return visit(
       [this]() {
-        return abortslew();
+        return abortslew().flat_map([this]() -> return_t<void> {
+          // synchronous slews end their wait, Slewing is the mount's again
+          slew_generation.fetch_add(1, std::memory_order_relaxed);
+          return {};
+        });
       },
       check_connected()
     );
@@ -618,7 +873,9 @@ class telescope : public device {
         return slewtoaltaz(altazm);
       },
       check_connected(),
-      check_flag(get_canslewaltaz())
+      check_flag(get_canslewaltaz()),
+      check_value(altazm.azimuth >= 0.0f && altazm.azimuth <= 360.f),
+      check_value(altazm.altitude >= -90.0f && altazm.altitude <= +90.f)
     );
   }
 
@@ -640,7 +897,9 @@ class telescope : public device {
         return slewtocoordinates(coord);
       },
       check_connected(),
-      check_flag(get_canslew())
+      check_flag(get_canslew()),
+      check_value(coord.declination >= -90.0f && coord.declination <= +90.0f),
+      check_value(coord.rightascension >= 0.0f && coord.rightascension <= +24.0f)
     );
   }
 
@@ -730,6 +989,120 @@ class telescope : public device {
   virtual ~telescope() override
   { }
 
+  virtual void state_changed() override {
+    telemetry.invalidate();
+  }
+
+  // snapshot cache served to GETs, refreshed by a telemetry_poller
+  telemetry_cache* get_telemetry_cache() const {
+    return &telemetry;
+  }
+
+  // pushes what the poller publishes to streaming clients
+  telemetry_stream* get_telemetry_stream() const {
+    return &stream;
+  }
+
+  virtual void write_metrics(metrics_writer* writer, std::string_view labels) const override {
+    writer->gauge("alpaca_telemetry_stream_subscribers",
+      "Clients connected to the telemetry stream", labels, stream.get_subscribers());
+
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+
+      std::string field_labels(labels);
+      field_labels.append(",field=\"").append(telemetry_field_name(field)).append("\"");
+
+      writer->counter("alpaca_telemetry_cache_hits_total",
+        "GETs answered from the telemetry snapshot", field_labels, telemetry.get_hits(field));
+      writer->counter("alpaca_telemetry_cache_misses_total",
+        "GETs that found the telemetry snapshot empty or too old", field_labels,
+        telemetry.get_misses(field));
+    }
+  }
+
+  // reads the `wanted` telemetry fields (a telemetry_t::bit mask) in one
+  // go, drivers that can fetch several fields per transaction should
+  // override it
+  virtual void get_telemetry(telemetry_t* snapshot, std::uint32_t wanted) const {
+    auto want = [wanted](telemetry_field_t field) {
+      return (wanted & telemetry_t::bit(field)) != 0;
+    };
+
+    if (want(telemetry_field_t::rightascension))
+      to_telemetry(snapshot, telemetry_field_t::rightascension,
+        &telemetry_t::rightascension, get_rightascension());
+    if (want(telemetry_field_t::declination))
+      to_telemetry(snapshot, telemetry_field_t::declination,
+        &telemetry_t::declination, get_declination());
+    if (want(telemetry_field_t::altitude))
+      to_telemetry(snapshot, telemetry_field_t::altitude,
+        &telemetry_t::altitude, get_altitude());
+    if (want(telemetry_field_t::azimuth))
+      to_telemetry(snapshot, telemetry_field_t::azimuth,
+        &telemetry_t::azimuth, get_azimuth());
+    if (want(telemetry_field_t::slewing))
+      to_telemetry(snapshot, telemetry_field_t::slewing,
+        &telemetry_t::slewing, get_slewing());
+    if (want(telemetry_field_t::tracking))
+      to_telemetry(snapshot, telemetry_field_t::tracking,
+        &telemetry_t::tracking, get_tracking());
+  }
+
+  // Telemetry fields of a ReadProperties missing from the snapshot, or too
+  // old, are read with one get_telemetry (one pipelined burst for drivers
+  // that override it) and merged into the snapshot, where the GETs of the
+  // batch find them.
+  virtual monotonic_t prefetch(std::span<const std::string_view> names) const override {
+    std::uint32_t wanted = 0;
+
+    for (std::string_view name : names) {
+      for (std::size_t i = 0; i < telemetry_field_count; i++) {
+        auto field = static_cast<telemetry_field_t>(i);
+        if (util::equals_insentive(name, telemetry_field_name(field)))
+          wanted |= telemetry_t::bit(field);
+      }
+    }
+
+    wanted = telemetry.cached(wanted);
+
+    monotonic_t now = monotonic_t::now();
+    if (wanted == 0 || !is_connected) return now;
+
+    std::uint32_t generation = telemetry.get_generation();
+    telemetry_t snapshot = telemetry.load();
+    std::uint32_t missing = wanted & ~telemetry.fresh(snapshot, wanted);
+
+    if (missing != 0) {
+      telemetry_t read = {};
+      get_telemetry(&read, missing);
+
+      for (std::size_t i = 0; i < telemetry_field_count; i++)
+        read.timestamps[i] = now;
+
+      read.fields &= missing;
+      telemetry.merge(read, generation);
+
+      snapshot = telemetry.load();
+    }
+
+    monotonic_t oldest = now;
+    for (std::size_t i = 0; i < telemetry_field_count; i++) {
+      auto field = static_cast<telemetry_field_t>(i);
+      if ((wanted & telemetry_t::bit(field)) != 0 && snapshot.has(field) && snapshot.timestamps[i] - oldest < 0)
+        oldest = snapshot.timestamps[i];
+    }
+
+    return oldest;
+  }
+
+  // motion the slewing flag does not show (moveaxis, pulse guiding), the
+  // poller speeds up while it is true
+  virtual bool is_moving() const {
+    auto guiding = get_ispulseguiding();
+    return !guiding.is_error() && guiding.get();
+  }
+
   // read-only properties
   virtual return_t<float> get_altitude() const {
     return not_implemented();
@@ -758,6 +1131,35 @@ class telescope : public device {
   virtual return_t<float> get_siderealtime() const {
     return not_implemented();
   }
+  // Horizontal coordinates of `targets` from the site, by the host clock.
+  // Drivers whose mount keeps its own time answer on that clock, the one
+  // their Altitude and Azimuth are taken on.
+  virtual return_t<void> get_horizontalcoordinates(
+    const targets_t& targets, std::span<float> azimuth, std::span<float> altitude) const {
+    return visit(
+      [&](float latitude, float longitude) -> return_t<void> {
+        astronomy::ra_de_to_azm_alt(
+          utcdate_t::now(),
+          targets.rightascension, targets.declination,
+          latitude, longitude,
+          azimuth, altitude);
+
+        return {};
+      },
+      get_sitelatitude(),
+      get_sitelongitude());
+  }
+  // Observer of the site and its local sidereal time, by the host clock.
+  // Drivers whose mount keeps its own time answer on that clock.
+  virtual return_t<sky_t> get_sky() const {
+    return visit(
+      [](float latitude, float longitude) -> return_t<sky_t> {
+        const astronomy::observer_t observer(latitude, longitude);
+        return sky_t{ observer, observer.lst() };
+      },
+      get_sitelatitude(),
+      get_sitelongitude());
+  }
   virtual return_t<destination_side_of_pier_t> get_destinationsideofpier(const coord_t&) const {
     return not_implemented();
   }
@@ -769,7 +1171,7 @@ class telescope : public device {
   virtual return_t<int> get_interfaceversion() const override { return telescopeinfo.interfaceversion; }
   virtual return_t<std::string> get_name() const override { return telescopeinfo.name; }
   virtual return_t<std::vector<std::string>> get_supportedactions() const override {
-    return std::vector<std::string> { };
+    return std::vector<std::string> { std::string(read_properties_action) };
   }
   virtual return_t<alignment_mode_t> get_alignmentmode() const { return telescopeinfo.alignmentmode; }
   virtual return_t<float> get_aperturearea() const { return telescopeinfo.aperturearea; }
@@ -873,11 +1275,15 @@ class telescope : public device {
     return not_implemented();
   }
 
-  virtual return_t<std::string> get_utcdate() const {
-    utcdate_t utcdate;
+  virtual return_t<json_string> get_utcdate() const {
+    utcdate_t utcdate = {0};
+
+    return get_utctm(&utcdate).map([&utcdate]() {
+      char utc[utcdate_t::utc_size];
+      utcdate.format_utc(utc);
 
-    get_utctm(&utcdate);
-    return utcdate.format_utc();
+      return json_string(utc, sizeof(utc));
+    });
   }
 
   virtual return_t<void> put_utcdate(const std::string& utc) {
@@ -967,20 +1373,22 @@ class telescope : public device {
   virtual return_t<void> setpark() {
     return not_implemented();
   }
-  virtual return_t<void> slewtoaltaz(const altazm_t&) {
-    return not_implemented();
+  // the synchronous slews are the asynchronous ones, their replies wait
+  // in a slew_wait_t
+  virtual return_t<void> slewtoaltaz(const altazm_t& altazm) {
+    return slewtoaltazasync(altazm);
   }
   virtual return_t<void> slewtoaltazasync(const altazm_t&) {
     return not_implemented();
   }
-  virtual return_t<void> slewtocoordinates(const coord_t&) {
-    return not_implemented();
+  virtual return_t<void> slewtocoordinates(const coord_t& coord) {
+    return slewtocoordinatesasync(coord);
   }
   virtual return_t<void> slewtocoordinatesasync(const coord_t&) {
     return not_implemented();
   }
   virtual return_t<void> slewtotarget() {
-    return not_implemented();
+    return slewtotargetasync();
   }
   virtual return_t<void> slewtotargetasync() {
     return not_implemented();
@@ -1000,69 +1408,75 @@ class telescope : public device {
 };
 
 class telescope_resource : public device_resource<telescope> {
- public:
-  telescope_resource()
-  : device_resource("telescope") {
+  using ops = operations<telescope>;
+
+  inline static constexpr operation_table table { join(device_operations<telescope>(), std::array {
     // read-only properties
-    define_get("altitude", [](const telescope* tel, const arguments_t&) {
+    ops::get("altitude", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_altitude();
-    });
-    define_get("azimuth", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("azimuth", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_azimuth();
-    });
-    define_get("declination", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("horizontalcoordinates", [](const telescope* tel, const arguments_t& args) {
+      return targets_t::parse(args)
+        .flat_map([tel](const targets_t& targets) {
+          return tel->priv_get_horizontalcoordinates(targets);
+        });
+    }),
+    ops::get("declination", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_declination();
-    });
-    define_get("rightascension", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("rightascension", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_rightascension();
-    });
-    define_get("athome", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("athome", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_athome();
-    });
-    define_get("atpark", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("atpark", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_atpark();
-    });
-    define_get("ispulseguiding", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("ispulseguiding", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_ispulseguiding();
-    });
-    define_get("slewing", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("slewing", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_slewing();
-    });
-    define_get("siderealtime", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get("siderealtime", [](const telescope* tel, const arguments_t&) {
       return tel->priv_get_siderealtime();
-    });
-    define_get("destinationsideofpier", [](const telescope* tel, const arguments_t& args) {
+    }),
+    ops::get("destinationsideofpier", [](const telescope* tel, const arguments_t& args) {
       return coord_t::parse(args).flat_map([tel](const coord_t& coord) {
         return tel->priv_get_destinationsideofpier(coord)
           .map([](destination_side_of_pier_t d) {
             return static_cast<int>(d);
           });
       });
-    });
+    }),
 
     // constants
-    define_get("alignmentmode", [](const telescope* tel, const arguments_t&) {
+    ops::get_constant("alignmentmode", [](const telescope* tel, const arguments_t&) {
       return tel->get_alignmentmode()
         .map([](alignment_mode_t alignmentmode) {
           return static_cast<int>(alignmentmode);
         });
-    });
-    define_get("aperturearea", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("aperturearea", [](const telescope* tel, const arguments_t&) {
       return tel->get_aperturearea();
-    });
-    define_get("aperturediameter", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("aperturediameter", [](const telescope* tel, const arguments_t&) {
       return tel->get_aperturediameter();
-    });
-    define_get("focallength", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("focallength", [](const telescope* tel, const arguments_t&) {
       return tel->get_focallength();
-    });
-    define_get("equatorialsystem", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("equatorialsystem", [](const telescope* tel, const arguments_t&) {
       return tel->get_equatorialsystem()
         .map([](equatorial_system_t equatorialsystem) {
           return static_cast<int>(equatorialsystem);
         });
-    });
-    define_get("axisrates", [](const telescope* tel, const arguments_t& args) {
+    }),
+    ops::get("axisrates", [](const telescope* tel, const arguments_t& args) {
       return parser::parser_t::parse<int>(args, fields::axis_f)
         .flat_map([tel](int axis) {
           return tel->get_axisrates(axis).map([](auto&& axisrates) {
@@ -1083,8 +1497,8 @@ class telescope_resource : public device_resource<telescope> {
             return out_axisrates;
           });
         });
-    });
-    define_get("trackingrates", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("trackingrates", [](const telescope* tel, const arguments_t&) {
       return tel->get_trackingrates()
         .map([](auto&& trackingrates) {
           json_array out_trackingrates;
@@ -1100,68 +1514,68 @@ class telescope_resource : public device_resource<telescope> {
 
           return out_trackingrates;
         });
-    });
+    }),
 
     // flags
-    define_get("canfindhome", [](const telescope* tel, const arguments_t&) {
+    ops::get_constant("canfindhome", [](const telescope* tel, const arguments_t&) {
       return tel->get_canfindhome();
-    });
-    define_get("canmoveaxis", [](const telescope* tel, const arguments_t& args) {
+    }),
+    ops::get("canmoveaxis", [](const telescope* tel, const arguments_t& args) {
       return parser::parser_t::parse<int>(args, fields::axis_f)
         .flat_map([tel](int axis) {
           return tel->check_axis(axis).flat_map([tel, axis]() {
             return tel->get_canmoveaxis(axis);
           });
         });
-    });
-    define_get("canpark", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canpark", [](const telescope* tel, const arguments_t&) {
       return tel->get_canpark();
-    });
-    define_get("canpulseguide", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canpulseguide", [](const telescope* tel, const arguments_t&) {
       return tel->get_canpulseguide();
-    });
-    define_get("cansetdeclinationrate", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansetdeclinationrate", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansetdeclinationrate();
-    });
-    define_get("cansetguiderates", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansetguiderates", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansetguiderates();
-    });
-    define_get("cansetpark", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansetpark", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansetpark();
-    });
-    define_get("cansetpierside", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansetpierside", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansetpierside();
-    });
-    define_get("cansetrightascensionrate", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansetrightascensionrate", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansetrightascensionrate();
-    });
-    define_get("cansettracking", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansettracking", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansettracking();
-    });
-    define_get("canslew", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canslew", [](const telescope* tel, const arguments_t&) {
       return tel->get_canslew();
-    });
-    define_get("canslewaltaz", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canslewaltaz", [](const telescope* tel, const arguments_t&) {
       return tel->get_canslewaltaz();
-    });
-    define_get("canslewaltazasync", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canslewaltazasync", [](const telescope* tel, const arguments_t&) {
       return tel->get_canslewaltazasync();
-    });
-    define_get("canslewasync", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canslewasync", [](const telescope* tel, const arguments_t&) {
       return tel->get_canslewasync();
-    });
-    define_get("cansync", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansync", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansync();
-    });
-    define_get("cansyncaltaz", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("cansyncaltaz", [](const telescope* tel, const arguments_t&) {
       return tel->get_cansyncaltaz();
-    });
-    define_get("canunpark", [](const telescope* tel, const arguments_t&) {
+    }),
+    ops::get_constant("canunpark", [](const telescope* tel, const arguments_t&) {
       return tel->get_canunpark();
-    });
+    }),
 
     // read-wrie properties
-    define_ops(
+    ops::get_put(
       "declinationrate",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_declinationrate();
@@ -1171,8 +1585,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([tel](float declinationrate) {
             return tel->priv_put_declinationrate(declinationrate);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "doesrefraction",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_doesrefraction();
@@ -1182,8 +1596,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](bool doesrefraction) {
             return tel->priv_put_doesrefraction(doesrefraction);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "guideratedeclination",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_guideratedeclination();
@@ -1193,8 +1607,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float guideratedeclination) {
             return tel->priv_put_guideratedeclination(guideratedeclination);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "guideraterightascension",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_guideraterightascension();
@@ -1204,8 +1618,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float guideraterightascension) {
             return tel->priv_put_guideraterightascension(guideraterightascension);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "rightascensionrate",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_rightascensionrate();
@@ -1215,8 +1629,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float rightascensionrate) {
             return tel->priv_put_rightascensionrate(rightascensionrate);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "sideofpier",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_sideofpier();
@@ -1226,8 +1640,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](int sideofpier) {
             return tel->priv_put_sideofpier(sideofpier);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "siteelevation",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_siteelevation();
@@ -1237,8 +1651,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float siteelevation) {
             return tel->priv_put_siteelevation(siteelevation);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "sitelatitude",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_sitelatitude();
@@ -1248,8 +1662,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float sitelatitude) {
             return tel->priv_put_sitelatitude(sitelatitude);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "sitelongitude",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_sitelongitude();
@@ -1259,8 +1673,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float sitelongitude) {
             return tel->priv_put_sitelongitude(sitelongitude);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "slewsettletime",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_slewsettletime();
@@ -1270,8 +1684,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](int slewsettletime) {
             return tel->priv_put_slewsettletime(slewsettletime);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "targetdeclination",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_targetdeclination();
@@ -1281,8 +1695,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float targetdeclination) {
             return tel->priv_put_targetdeclination(targetdeclination);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "targetrightascension",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_targetrightascension();
@@ -1292,8 +1706,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](float targetrightascension) {
             return tel->priv_put_targetrightascension(targetrightascension);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "tracking",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_tracking();
@@ -1303,8 +1717,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](bool tracking) {
             return tel->priv_put_tracking(tracking);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "trackingrate",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_trackingrate()
@@ -1317,8 +1731,8 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](int trackingrate) {
             return tel->priv_put_trackingrate(trackingrate);
           });
-      });
-    define_ops(
+      }),
+    ops::get_put(
       "utcdate",
       [](const telescope* tel, const arguments_t&) {
         return tel->priv_get_utcdate();
@@ -1328,81 +1742,98 @@ class telescope_resource : public device_resource<telescope> {
           .flat_map([=](std::string_view utc) {
             return tel->priv_put_utcdate(std::string{utc});
           });
-      });
+      }),
 
     // operations
-    define_put("abortslew", [](telescope* tel, const arguments_t&) {
+    ops::put("abortslew", [](telescope* tel, const arguments_t&) {
       return tel->priv_abortslew();
-    });
-    define_put("findhome", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put("findhome", [](telescope* tel, const arguments_t&) {
       return tel->priv_findhome();
-    });
-    define_put("setpark", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put("setpark", [](telescope* tel, const arguments_t&) {
       return tel->priv_setpark();
-    });
-    define_put("park", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put("park", [](telescope* tel, const arguments_t&) {
       return tel->priv_park();
-    });
-    define_put("slewtotarget", [](telescope* tel, const arguments_t&) {
-      return tel->priv_slewtotarget();
-    });
-    define_put("slewtotargetasync", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put_deferred("slewtotarget",
+      [](telescope* tel, const arguments_t&) {
+        return tel->priv_slewtotarget();
+      },
+      [](telescope* tel) -> std::unique_ptr<completion> {
+        return std::make_unique<telescope::slew_wait_t>(tel);
+      }),
+    ops::put("slewtotargetasync", [](telescope* tel, const arguments_t&) {
       return tel->priv_slewtotargetasync();
-    });
-    define_put("synctotarget", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put("synctotarget", [](telescope* tel, const arguments_t&) {
       return tel->priv_synctotarget();
-    });
-    define_put("unpark", [](telescope* tel, const arguments_t&) {
+    }),
+    ops::put("unpark", [](telescope* tel, const arguments_t&) {
       return tel->priv_unpark();
-    });
-    define_put("moveaxis", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put("moveaxis", [](telescope* tel, const arguments_t& args) {
       return move_t::parse(args)
         .flat_map([=](const move_t& move) {
           return tel->priv_moveaxis(move);
         });
-    });
-    define_put("pulseguide", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put("pulseguide", [](telescope* tel, const arguments_t& args) {
       return pulse_t::parse(args)
         .flat_map([=](const pulse_t& pulse) {
           return tel->priv_pulseguide(pulse);
         });
-    });
-    define_put("slewtoaltaz", [](telescope* tel, const arguments_t& args) {
-      return altazm_t::parse(args)
-        .flat_map([=](const altazm_t& altazm) {
-          return tel->priv_slewtoaltaz(altazm);
-        });
-    });
-    define_put("slewtoaltazasync", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put_deferred("slewtoaltaz",
+      [](telescope* tel, const arguments_t& args) {
+        return altazm_t::parse(args)
+          .flat_map([=](const altazm_t& altazm) {
+            return tel->priv_slewtoaltaz(altazm);
+          });
+      },
+      [](telescope* tel) -> std::unique_ptr<completion> {
+        return std::make_unique<telescope::slew_wait_t>(tel);
+      }),
+    ops::put("slewtoaltazasync", [](telescope* tel, const arguments_t& args) {
       return altazm_t::parse(args)
         .flat_map([=](const altazm_t& altazm) {
           return tel->priv_slewtoaltazasync(altazm);
         });
-    });
-    define_put("slewtocoordinates", [](telescope* tel, const arguments_t& args) {
-      return coord_t::parse(args)
-        .flat_map([=](const coord_t& coord) {
-          return tel->priv_slewtocoordinates(coord);
-        });
-    });
-    define_put("slewtocoordinatesasync", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put_deferred("slewtocoordinates",
+      [](telescope* tel, const arguments_t& args) {
+        return coord_t::parse(args)
+          .flat_map([=](const coord_t& coord) {
+            return tel->priv_slewtocoordinates(coord);
+          });
+      },
+      [](telescope* tel) -> std::unique_ptr<completion> {
+        return std::make_unique<telescope::slew_wait_t>(tel);
+      }),
+    ops::put("slewtocoordinatesasync", [](telescope* tel, const arguments_t& args) {
       return coord_t::parse(args)
         .flat_map([=](const coord_t& coord) {
           return tel->priv_slewtocoordinatesasync(coord);
         });
-    });
-    define_put("synctoaltaz", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put("synctoaltaz", [](telescope* tel, const arguments_t& args) {
       return altazm_t::parse(args)
         .flat_map([=](const altazm_t& altazm) {
           return tel->priv_synctoaltaz(altazm);
         });
-    });
-    define_put("synctocoordinates", [](telescope* tel, const arguments_t& args) {
+    }),
+    ops::put("synctocoordinates", [](telescope* tel, const arguments_t& args) {
       return coord_t::parse(args)
         .flat_map([=](const coord_t& coord) {
           return tel->priv_synctocoordinates(coord);
         });
-    });
+    }),
+  }) };
+
+ public:
+  telescope_resource()
+  : device_resource("telescope", [](std::string_view name) { return table.find(name); }, table.list()) {
   }
 };
 
@@ -1416,9 +1847,9 @@ class telescope_setup_resource : public httpserver::http_resource {
     (void)resource;
 
     json_object obj = {
-      {"device_type", req.get_path_piece(2)},
-      {"device_number", req.get_path_piece(3)},
-      {"operation", req.get_path_piece(4)},
+      {"device_type", json_string(req.get_path_piece(2))},
+      {"device_number", json_string(req.get_path_piece(3))},
+      {"operation", json_string(req.get_path_piece(4))},
     };
 
     std::ostringstream os;
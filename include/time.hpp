@@ -3,7 +3,11 @@
 #ifndef INCLUDE_TIME_HPP_
 #define INCLUDE_TIME_HPP_
 
+#include <atomic>
+#include <cstdint>
 #include <ctime>
+#include <string>
+#include <string_view>
 
 namespace alpaca {
 
@@ -57,43 +61,202 @@ struct utcdate_t {
     gmtime_r(&time, utc_tm);
   }
 
-  static return_t<utcdate_t> parse_utc(std::string_view utc) {
-    std::tm utc_tm;
-    float seconds;
+  // days since 1970-01-01 of a proleptic gregorian date and back, the
+  // era based algorithms of Howard Hinnant's date library
+  [[nodiscard]] constexpr static std::int64_t days_from_civil(std::int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    const std::int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(year - era * 400);
+    const unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<std::int64_t>(doe) - 719468;
+  }
+
+  constexpr static void civil_from_days(std::int64_t days, std::int64_t* year, unsigned* month, unsigned* day) {
+    days += 719468;
+    const std::int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(days - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = static_cast<std::int64_t>(yoe) + era * 400 + (*month <= 2);
+  }
+
+  [[nodiscard]] constexpr static unsigned days_in_month(std::int64_t year, unsigned month) {
+    if (month == 2)
+      return (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) ? 29 : 28;
+
+    return (month == 4 || month == 6 || month == 9 || month == 11) ? 30 : 31;
+  }
+
+  // YYYY-MM-DDTHH:MM:SS with an optional fraction of a second and Z,
+  // digits past the microsecond are dropped
+  [[nodiscard]] constexpr static bool scan_utc(std::string_view utc, std::uint64_t* micros) {
+    if (utc.size() < 19) return false;
+
+    auto digits = [utc](std::size_t at, std::size_t count, unsigned* value) {
+      *value = 0;
+      for (std::size_t i = at; i < at + count; i++) {
+        if (utc[i] < '0' || utc[i] > '9') return false;
+        *value = *value * 10 + static_cast<unsigned>(utc[i] - '0');
+      }
+      return true;
+    };
+
+    unsigned year, month, day, hour, minute, second;
+    if (!digits(0, 4, &year) || utc[4] != '-' || !digits(5, 2, &month) || utc[7] != '-' ||
+        !digits(8, 2, &day) || utc[10] != 'T' || !digits(11, 2, &hour) || utc[13] != ':' ||
+        !digits(14, 2, &minute) || utc[16] != ':' || !digits(17, 2, &second))
+      return false;
+
+    // the epoch is the earliest utcdate_t can hold, a leap second rolls over
+    if (year < 1970 || month < 1 || month > 12 || day < 1 || day > days_in_month(year, month) ||
+        hour > 23 || minute > 59 || second > 60)
+      return false;
+
+    std::size_t at = 19;
+    unsigned fraction = 0;
 
-    int count = std::sscanf(
-      utc.data(),
-      "%04d-%02d-%02dT%02d:%02d:%fZ",
-      &utc_tm.tm_year, &utc_tm.tm_mon,
-      &utc_tm.tm_mday, &utc_tm.tm_hour,
-      &utc_tm.tm_min, &seconds);
+    if (at < utc.size() && utc[at] == '.') {
+      const std::size_t first = ++at;
+      unsigned scale = 100000;
 
-    if (count != 6) {
+      for (; at < utc.size() && utc[at] >= '0' && utc[at] <= '9'; at++) {
+        fraction += static_cast<unsigned>(utc[at] - '0') * scale;
+        scale /= 10;
+      }
+
+      if (at == first) return false;
+    }
+
+    if (at < utc.size() && utc[at] == 'Z') at++;
+    if (at != utc.size()) return false;
+
+    const std::int64_t days = days_from_civil(year, month, day);
+    const std::uint64_t seconds = static_cast<std::uint64_t>(days) * 86400 + hour * 3600 + minute * 60 + second;
+
+    *micros = seconds * 1000000 + fraction;
+    return true;
+  }
+
+  static return_t<utcdate_t> parse_utc(std::string_view utc) {
+    std::uint64_t micros;
+    if (!scan_utc(utc, &micros)) {
       return invalid_value();
     }
 
-    utc_tm.tm_year -= 1900;
-    utc_tm.tm_mon -= 1;
-    utc_tm.tm_sec = static_cast<int>(seconds);
-    utc_tm.tm_isdst = -1;
+    return utcdate_t{micros};
+  }
+
+  // "YYYY-MM-DDTHH:MM:SSZ" without a nul
+  constexpr static std::size_t utc_size = 20;
+
+  constexpr void format_utc(char* out) const {
+    const std::uint64_t seconds = micros / 1000000;
+    const unsigned of_day = static_cast<unsigned>(seconds % 86400);
+
+    std::int64_t year;
+    unsigned month, day;
+    civil_from_days(static_cast<std::int64_t>(seconds / 86400), &year, &month, &day);
 
-    return utcdate_t::from_utc_tm(&utc_tm);
+    auto put = [&out](unsigned value, int width) {
+      for (int i = width - 1; i >= 0; i--) {
+        out[i] = static_cast<char>('0' + value % 10);
+        value /= 10;
+      }
+      out += width;
+    };
+
+    put(static_cast<unsigned>(year), 4); *out++ = '-';
+    put(month, 2); *out++ = '-';
+    put(day, 2); *out++ = 'T';
+    put(of_day / 3600, 2); *out++ = ':';
+    put(of_day / 60 % 60, 2); *out++ = ':';
+    put(of_day % 60, 2); *out++ = 'Z';
   }
 
   std::string format_utc() const {
-    char utc[128];
-    std::tm utc_tm;
+    char utc[utc_size];
+    format_utc(utc);
+
+    return std::string(utc, utc_size);
+  }
+};
+
+static_assert(utcdate_t::days_from_civil(1970, 1, 1) == 0);
+static_assert(utcdate_t::days_from_civil(2000, 3, 1) == 11017);
+static_assert([] {
+  std::uint64_t micros = 0;
+  return utcdate_t::scan_utc("2024-02-29T23:59:59.25Z", &micros) &&
+    micros == 1709251199250000ull &&
+    !utcdate_t::scan_utc("2023-02-29T00:00:00Z", &micros) &&
+    !utcdate_t::scan_utc("2023-01-01T00:00:00Zjunk", &micros);
+}());
+static_assert([] {
+  char utc[utcdate_t::utc_size];
+  utcdate_t{1709251199250000ull}.format_utc(utc);
+  return std::string_view(utc, utcdate_t::utc_size) == "2024-02-29T23:59:59Z";
+}());
+
+// monotonic clock, only meaningful to measure intervals
+struct monotonic_t {
+  std::int64_t micros;
+
+  constexpr std::int64_t operator-(monotonic_t other) const {
+    return micros - other.micros;
+  }
+
+  constexpr monotonic_t operator+(std::int64_t offset_micros) const {
+    return { micros + offset_micros };
+  }
+
+  static monotonic_t now() noexcept {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return { ts.tv_sec * 1000000ll + ts.tv_nsec / 1000 };
+  }
+};
+
+// Time source of simulated hardware. It starts at `start` and runs
+// `scale` times faster than the wall clock, a scale of 0 only moves on
+// advance(), so a scenario stepped by hand reproduces exactly.
+class virtual_clock_t {
+  utcdate_t origin_utc;
+  monotonic_t origin;
+  double scale;
+
+  std::atomic<std::int64_t> advanced{0};
+
+ public:
+  explicit virtual_clock_t(double scale = 1.0, utcdate_t start = utcdate_t::now())
+  : origin_utc(start)
+  , origin(monotonic_t::now())
+  , scale(scale) {
+  }
 
-    to_utc_tm(&utc_tm);
+  // micros of virtual time since the clock started
+  [[nodiscard]] std::int64_t elapsed() const {
+    std::int64_t micros = advanced.load(std::memory_order_relaxed);
 
-    std::snprintf(
-      utc,
-      128,
-      "%04d-%02d-%02dT%02d:%02d:%02dZ",
-      utc_tm.tm_year + 1900, utc_tm.tm_mon + 1, utc_tm.tm_mday,
-      utc_tm.tm_hour, utc_tm.tm_min, utc_tm.tm_sec);
+    if (scale > 0.0)
+      micros += static_cast<std::int64_t>(static_cast<double>(monotonic_t::now() - origin) * scale);
+
+    return micros;
+  }
+
+  [[nodiscard]] utcdate_t utc() const {
+    return { origin_utc.micros + static_cast<std::uint64_t>(elapsed()) };
+  }
+
+  [[nodiscard]] monotonic_t monotonic() const {
+    return origin + elapsed();
+  }
 
-    return utc;
+  void advance(std::int64_t micros) {
+    advanced.fetch_add(micros, std::memory_order_relaxed);
   }
 };
 
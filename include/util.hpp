@@ -6,7 +6,12 @@
 #include <sys/time.h>
 #include <vector>
 #include <cctype>
+#include <charconv>
+#include <cstdint>
 #include <string>
+#include <string_view>
+
+#include <arena.hpp>
 
 #define NO_OP
 #define LOWER std::tolower
@@ -67,9 +72,48 @@ static inline bool equals_insentive(std::string_view x, std::string_view y) {
   return true;
 }
 
+// case insensitive FNV-1a, ascii only so it can run at compile time
+[[nodiscard]]
+static constexpr std::uint32_t hash_insensitive(std::string_view str) {
+  std::uint32_t hash = 2166136261u;
+
+  for (char ch : str) {
+    char lower = ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+    hash = (hash ^ static_cast<std::uint8_t>(lower)) * 16777619u;
+  }
+
+  return hash;
+}
+
+[[nodiscard]]
+static inline int hex_digit(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+// decodes %HH sequences in place, returns the new size
 [[nodiscard]]
-static inline std::vector<std::string_view> split(std::string_view str, std::string_view delim) {
-  std::vector<std::string_view> tokens;
+static inline std::size_t unescape(char* str, std::size_t size) {
+  std::size_t out = 0;
+
+  for (std::size_t in = 0; in < size; in++) {
+    if (str[in] == '%' && in + 2 < size && hex_digit(str[in+1]) >= 0 && hex_digit(str[in+2]) >= 0) {
+      str[out++] = static_cast<char>(hex_digit(str[in+1]) << 4 | hex_digit(str[in+2]));
+      in += 2;
+    } else {
+      str[out++] = str[in];
+    }
+  }
+
+  return out;
+}
+
+[[nodiscard]]
+// the tokens come from the request arena while one is open
+static inline arena_vector<std::string_view> split(std::string_view str, std::string_view delim) {
+  arena_vector<std::string_view> tokens;
 
   size_t last_pos = 0;
   size_t pos = 0;
@@ -85,10 +129,17 @@ static inline std::vector<std::string_view> split(std::string_view str, std::str
 
 [[nodiscard]]
 static inline int parse_int(std::string_view str, int default_value) {
-  char* end = nullptr;
-  long value = std::strtol(str.data(), &end, 10);
+  int value;
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+
+  return ec == std::errc() && end != str.data() ? value : default_value;
+}
+
+[[nodiscard]]
+static inline bool parse_uint(std::string_view str, std::uint32_t* value) {
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), *value);
 
-  return str.data() != end ? static_cast<int>(value) : default_value;
+  return ec == std::errc() && end != str.data();
 }
 
 }  // namespace util
@@ -1,10 +1,20 @@
 // Copyright (C) 2023 Marrony Neris
 
 #include <getopt.h>
+
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <manager.hpp>
+#include <logger.hpp>
+#include <poller.hpp>
 #include <celestron/celestron.hpp>
+#include <celestron/scheduler.hpp>
+#include <celestron/trace.hpp>
 
 void print_help(char* cmdline) {
   std::cout << "Usage: " << cmdline << " [options]" << std::endl;
@@ -12,27 +22,64 @@ void print_help(char* cmdline) {
   std::cout << "Alpaca Server for Raspberry PI" << std::endl;
   std::cout << "" << std::endl;
   std::cout << "Options:" << std::endl;
-  std::cout << "  -d, --device <string>  USB device (default: \"/dev/ttyUSB0\")" << std::endl;
+  std::cout << "  -d, --device <string>  USB device, repeat for more mounts (default: \"/dev/ttyUSB0\")" << std::endl;
   std::cout << "  -b, --baud <number>    Baud rate (default: 9600)" << std::endl;
   std::cout << "  -p, --port <number>    Port to listen (default: 11111)" << std::endl;
   std::cout << "  -c, --conform          Runs in conform mode (default: false)" << std::endl;
+  std::cout << "  -w, --record <path>    Record the serial exchanges, .N appended past the first mount" << std::endl;
+  std::cout << "  -l, --replay <path>    Answer from a recorded trace instead of the mount" << std::endl;
+  std::cout << "  -s, --time-scale <n>   Conform simulators run n times faster than real time (default: 1)" << std::endl;
+  std::cout << "  -r, --poll-rate <hz>   Telemetry poll rate while moving, 0 disables (default: 0)" << std::endl;
+  std::cout << "  -i, --idle-poll <ms>   Telemetry poll period while still (default: 5000)" << std::endl;
+  std::cout << "  -a, --max-age <ms>     Max age of polled telemetry (default: per property)" << std::endl;
+  std::cout << "  -v, --verbose <level>  0 quiet, 1 errors, 2 requests, 3 debug (default: 2)" << std::endl;
+  std::cout << "  -q, --max-pending <n>  Requests admitted per device before busy (default: 8)" << std::endl;
+  std::cout << "  -k, --catalog <path>   Object catalog built by catalog-convert (default: none)" << std::endl;
+  std::cout << "  -m, --http-mode <mode> thread (one per connection) or pool (default: thread)" << std::endl;
+  std::cout << "  -t, --threads <n>      Pool workers in pool mode, 0 for one per core (default: 0)" << std::endl;
+  std::cout << "                         half of them, at least one, may serve telemetry streams" << std::endl;
+  std::cout << "  -n, --max-connections <n>  Connections accepted at once (default: 64)" << std::endl;
+  std::cout << "  -e, --keep-alive <s>   Idle keep-alive connection timeout, 0 never (default: 30)" << std::endl;
   std::cout << "  -h, --help             Display help" << std::endl;
 }
 
 int main(int argc, char** argv) {
-  const char* short_options = "h::p::d::b::c::";
+  const char* short_options = "hp:d:b:cw:l:s:r:i:a:v:q:k:m:t:n:e:";
   const struct option long_options[] = {
     {"help",    no_argument,       NULL, 'h'},
     {"port",    required_argument, NULL, 'p'},
     {"device",  required_argument, NULL, 'd'},
     {"baud",    required_argument, NULL, 'b'},
     {"conform", no_argument,       NULL, 'c'},
+    {"record",  required_argument, NULL, 'w'},
+    {"replay",  required_argument, NULL, 'l'},
+    {"time-scale", required_argument, NULL, 's'},
+    {"poll-rate", required_argument, NULL, 'r'},
+    {"idle-poll", required_argument, NULL, 'i'},
+    {"max-age", required_argument, NULL, 'a'},
+    {"verbose", required_argument, NULL, 'v'},
+    {"max-pending", required_argument, NULL, 'q'},
+    {"catalog", required_argument, NULL, 'k'},
+    {"http-mode", required_argument, NULL, 'm'},
+    {"threads", required_argument, NULL, 't'},
+    {"max-connections", required_argument, NULL, 'n'},
+    {"keep-alive", required_argument, NULL, 'e'},
+    {NULL,      0,                 NULL, 0},
   };
 
-  std::string device;
+  std::vector<std::string> devices;
   int baud = 9600;
-  int port = 11111;
+  alpaca::server_options_t server;
   bool conform = false;
+  int time_scale = 1;
+  std::string record_path;
+  std::string replay_path;
+  int poll_rate = 0;
+  int idle_poll = 5000;
+  int max_age = -1;
+  int max_pending = 8;
+  int verbose = static_cast<int>(alpaca::log_level_t::info);
+  std::string catalog_path;
 
   int next_option;
   do {
@@ -40,11 +87,11 @@ int main(int argc, char** argv) {
 
     switch (next_option) {
       case 'p':
-        port = alpaca::util::parse_int(optarg, port);
+        server.port = alpaca::util::parse_int(optarg, server.port);
         break;
 
       case 'd':
-        device = optarg;
+        devices.push_back(optarg);
         break;
 
       case 'b':
@@ -55,6 +102,65 @@ int main(int argc, char** argv) {
         conform = true;
         break;
 
+      case 'w':
+        record_path = optarg;
+        break;
+
+      case 'l':
+        replay_path = optarg;
+        break;
+
+      case 's':
+        time_scale = alpaca::util::parse_int(optarg, time_scale);
+        break;
+
+      case 'r':
+        poll_rate = alpaca::util::parse_int(optarg, poll_rate);
+        break;
+
+      case 'i':
+        idle_poll = alpaca::util::parse_int(optarg, idle_poll);
+        break;
+
+      case 'a':
+        max_age = alpaca::util::parse_int(optarg, max_age);
+        break;
+
+      case 'v':
+        verbose = alpaca::util::parse_int(optarg, verbose);
+        break;
+
+      case 'q':
+        max_pending = alpaca::util::parse_int(optarg, max_pending);
+        break;
+
+      case 'k':
+        catalog_path = optarg;
+        break;
+
+      case 'm':
+        if (std::string_view(optarg) == "pool")
+          server.thread_per_connection = false;
+        else if (std::string_view(optarg) == "thread")
+          server.thread_per_connection = true;
+        else {
+          print_help(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 't':
+        server.threads = alpaca::util::parse_int(optarg, server.threads);
+        break;
+
+      case 'n':
+        server.max_connections = alpaca::util::parse_int(optarg, server.max_connections);
+        break;
+
+      case 'e':
+        server.connection_timeout = alpaca::util::parse_int(optarg, server.connection_timeout);
+        break;
+
       case '?':
       case 'h':
         print_help(argv[0]);
@@ -62,17 +168,16 @@ int main(int argc, char** argv) {
     }
   } while (next_option != -1);
 
-  std::cout << "Listening on port " << port << std::endl;
+  alpaca::logger::instance().set_level(static_cast<alpaca::log_level_t>(
+    std::clamp(verbose, static_cast<int>(alpaca::log_level_t::quiet), static_cast<int>(alpaca::log_level_t::debug))));
+
+  std::cout << "Listening on port " << server.port << std::endl;
 
   if (conform)
     std::cout << "Running in conform mode" << std::endl;
 
-  auto protocol = [device, baud, conform]() -> std::unique_ptr<celestron::nexstar_protocol> {
-    if (conform)
-      return std::make_unique<celestron::simulator_protocol>();
-    else
-      return std::make_unique<celestron::serial_protocol>(device, baud);
-  }();
+  if (devices.empty())
+    devices.push_back("/dev/ttyUSB0");
 
   alpaca::telescopeinfo_t info = {
     .description = "Generic Celestron",
@@ -100,9 +205,76 @@ int main(int argc, char** argv) {
              alpaca::telescope_flags_t::can_move_axis_1
   };
 
-  celestron::celestron_telescope tel0(info, std::move(protocol));
+  alpaca::telemetry_options_t telemetry_options;
+  telemetry_options.interval_micros = poll_rate > 0 ? 1000000 / poll_rate : 0;
+  telemetry_options.idle_interval_micros = idle_poll * 1000ll;
+
+  if (max_age >= 0)
+    telemetry_options.max_age_micros.fill(max_age * 1000ll);
+
+  std::vector<std::unique_ptr<celestron::celestron_telescope>> telescopes;
+  std::vector<std::unique_ptr<alpaca::telemetry_poller>> pollers;
+
+  // one simulator per --device in conform mode, so multi mount setups can be tried
+  // traces of the first mount keep the given path, the others get .N
+  auto trace_path = [&](const std::string& path) {
+    return telescopes.empty() ? path : path + "." + std::to_string(telescopes.size());
+  };
+
+  for (const std::string& device : devices) {
+    std::unique_ptr<celestron::nexstar_protocol> protocol;
+
+    if (conform) {
+      protocol = std::make_unique<celestron::simulator_protocol>(
+        std::make_shared<alpaca::virtual_clock_t>(std::max(time_scale, 1)));
+    } else if (!replay_path.empty()) {
+      auto replay = std::make_unique<celestron::replay_protocol>();
+      if (!replay->load(trace_path(replay_path).c_str())) {
+        std::cerr << "cannot replay " << trace_path(replay_path) << std::endl;
+        return 1;
+      }
+      protocol = std::move(replay);
+    } else {
+      protocol = std::make_unique<celestron::serial_protocol>(device, baud);
+    }
+
+    if (!record_path.empty()) {
+      auto recording = std::make_unique<celestron::recording_protocol>(std::move(protocol), trace_path(record_path).c_str());
+      if (!recording->is_open()) {
+        std::cerr << "cannot record to " << trace_path(record_path) << std::endl;
+        return 1;
+      }
+      protocol = std::move(recording);
+    }
+
+    // every http worker shares this mount, funnel all of them through its own
+    // i/o thread so a stalled port only holds up requests for that mount
+    protocol = std::make_unique<celestron::scheduled_protocol>(std::move(protocol));
+
+    telescopes.push_back(std::make_unique<celestron::celestron_telescope>(info, std::move(protocol)));
+
+    // without a poller the snapshot stays empty and every GET goes to the mount
+    pollers.push_back(std::make_unique<alpaca::telemetry_poller>(telescopes.back().get(), telemetry_options));
+
+    if (!conform)
+      std::cout << "Telescope " << telescopes.size() - 1 << " on " << device << std::endl;
+  }
+
+  alpaca::catalog objects;
+
+  if (!catalog_path.empty()) {
+    if (!objects.open(catalog_path.c_str())) {
+      std::cerr << "Cannot open catalog " << catalog_path << std::endl;
+      return 1;
+    }
+
+    std::cout << "Catalog with " << objects.size() << " objects" << std::endl;
+  }
 
   alpaca::device_manager manager;
-  manager.add_telescope(&tel0);
-  return manager.run(port);
+  manager.set_max_pending(max_pending);
+  for (auto& telescope : telescopes)
+    manager.add_telescope(telescope.get());
+  manager.set_catalog(&objects);
+  return manager.run(server);
 }
@@ -0,0 +1,558 @@
+// Copyright (C) 2023 Marrony Neris
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <logger.hpp>
+#include <manager.hpp>
+#include <poller.hpp>
+#include <celestron/celestron.hpp>
+#include <celestron/scheduler.hpp>
+#include <celestron/trace.hpp>
+
+// Load generator for the daemon running on the simulator, or on a trace
+// recorded from a real mount. In http mode the clients talk to an
+// in-process webserver over loopback, in direct mode they call the
+// telescope_resource operations, so the difference between both is the
+// cost of the http server, argument parsing and the envelope.
+
+struct request_t {
+  bool is_put;
+  std::string operation;
+  std::string arguments;
+};
+
+// -- workloads
+
+// what imaging software polls while exposing
+static const char* const poller_operations[] = {
+  "rightascension", "declination", "altitude", "azimuth",
+  "slewing", "tracking", "atpark", "sideofpier", "utcdate", "siderealtime",
+};
+
+// every GET the conformance checker goes through
+static const char* const conform_operations[] = {
+  "connected", "description", "driverinfo", "driverversion", "interfaceversion",
+  "name", "supportedactions", "alignmentmode", "aperturearea", "aperturediameter",
+  "focallength", "equatorialsystem", "trackingrates", "canfindhome", "canpark",
+  "canpulseguide", "cansetdeclinationrate", "cansetguiderates", "cansetpark",
+  "cansetpierside", "cansetrightascensionrate", "cansettracking", "canslew",
+  "canslewaltaz", "canslewaltazasync", "canslewasync", "cansync", "cansyncaltaz",
+  "canunpark", "declinationrate", "doesrefraction", "guideratedeclination",
+  "guideraterightascension", "rightascensionrate", "siteelevation", "sitelatitude",
+  "sitelongitude", "slewsettletime", "targetdeclination", "targetrightascension",
+  "trackingrate", "rightascension", "declination", "altitude", "azimuth",
+  "athome", "atpark", "ispulseguiding", "slewing", "siderealtime", "utcdate",
+};
+
+static request_t get(const char* operation) {
+  return { false, operation, "ClientID=1&ClientTransactionID=1" };
+}
+
+static request_t next_request(const std::string& workload, std::uint64_t n, std::mt19937* rng) {
+  if (workload == "conform") {
+    constexpr std::size_t count = std::size(conform_operations);
+
+    // a sweep of GETs with a few settings changed in between
+    switch (n % (count + 3)) {
+      case count:
+        return { true, "tracking", "Tracking=True&ClientID=1&ClientTransactionID=1" };
+      case count + 1:
+        return { true, "targetrightascension",
+          "TargetRightAscension=" + std::to_string((*rng)() % 24) + "&ClientID=1&ClientTransactionID=1" };
+      case count + 2:
+        return { true, "targetdeclination",
+          "TargetDeclination=" + std::to_string(static_cast<int>((*rng)() % 180) - 90)
+          + "&ClientID=1&ClientTransactionID=1" };
+      default:
+        return get(conform_operations[n % (count + 3)]);
+    }
+  }
+
+  if (workload == "slew") {
+    // several clients fighting over the mount
+    switch (n % 8) {
+      case 0:
+        return { true, "slewtocoordinatesasync",
+          "RightAscension=" + std::to_string((*rng)() % 24)
+          + "&Declination=" + std::to_string(static_cast<int>((*rng)() % 180) - 90)
+          + "&ClientID=1&ClientTransactionID=1" };
+      case 7:
+        return { true, "abortslew", "ClientID=1&ClientTransactionID=1" };
+      default:
+        return get(poller_operations[n % 4]);
+    }
+  }
+
+  return get(poller_operations[n % std::size(poller_operations)]);
+}
+
+// -- clients
+
+// keep-alive client, one request in flight per connection
+class http_client {
+  int fd = -1;
+  int port;
+  std::string buffer;
+  std::string request;
+
+  bool connect() {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+  }
+
+  bool send_all(const std::string& data) {
+    std::size_t sent = 0;
+
+    while (sent < data.size()) {
+      ssize_t nbytes = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (nbytes <= 0) return false;
+      sent += static_cast<std::size_t>(nbytes);
+    }
+
+    return true;
+  }
+
+  bool receive(std::size_t size) {
+    char chunk[4096];
+
+    while (buffer.size() < size) {
+      ssize_t nbytes = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (nbytes <= 0) return false;
+      buffer.append(chunk, static_cast<std::size_t>(nbytes));
+    }
+
+    return true;
+  }
+
+  bool read_response(int* status, std::string* body) {
+    std::size_t header_end;
+    char chunk[4096];
+
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t nbytes = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (nbytes <= 0) return false;
+      buffer.append(chunk, static_cast<std::size_t>(nbytes));
+    }
+
+    std::string_view header(buffer.data(), header_end);
+
+    *status = 0;
+    if (header.size() > 12)
+      *status = alpaca::util::parse_int(header.substr(9, 3), 0);
+
+    std::size_t content_length = 0;
+    for (std::size_t pos = 0; pos < header.size();) {
+      std::size_t eol = header.find("\r\n", pos);
+      if (eol == std::string_view::npos) eol = header.size();
+
+      std::string_view line = header.substr(pos, eol - pos);
+      constexpr std::string_view name = "content-length:";
+
+      if (line.size() > name.size() && alpaca::util::equals_insentive(line.substr(0, name.size()), name)) {
+        std::string_view value = line.substr(name.size());
+        while (!value.empty() && value[0] == ' ') value.remove_prefix(1);
+        content_length = static_cast<std::size_t>(alpaca::util::parse_int(value, 0));
+      }
+
+      pos = eol + 2;
+    }
+
+    std::size_t total = header_end + 4 + content_length;
+    if (!receive(total)) return false;
+
+    body->assign(buffer, header_end + 4, content_length);
+    buffer.erase(0, total);
+
+    return true;
+  }
+
+ public:
+  explicit http_client(int port)
+  : port(port) { }
+
+  ~http_client() {
+    close();
+  }
+
+  http_client(const http_client&) = delete;
+  http_client& operator=(const http_client&) = delete;
+
+  // false on transport errors, `ok` tells whether the Alpaca call succeeded
+  bool send(const request_t& req, bool* ok) {
+    if (fd < 0 && !connect()) return false;
+
+    request.clear();
+    request.append(req.is_put ? "PUT" : "GET");
+    request.append(" /api/v1/telescope/0/").append(req.operation);
+
+    if (req.is_put) {
+      request.append(" HTTP/1.1\r\nHost: localhost\r\n");
+      request.append("Content-Type: application/x-www-form-urlencoded\r\n");
+      request.append("Content-Length: ").append(std::to_string(req.arguments.size()));
+      request.append("\r\n\r\n").append(req.arguments);
+    } else {
+      request.append("?").append(req.arguments);
+      request.append(" HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    }
+
+    int status;
+    std::string body;
+
+    if (!send_all(request) || !read_response(&status, &body)) {
+      close();
+      buffer.clear();
+      return false;
+    }
+
+    *ok = status == 200 && body.find("\"ErrorNumber\":0,") != std::string::npos;
+    return true;
+  }
+};
+
+class direct_client {
+  alpaca::telescope_resource* resource;
+  std::string arguments;
+
+ public:
+  explicit direct_client(alpaca::telescope_resource* resource)
+  : resource(resource) { }
+
+  bool send(const request_t& req, bool* ok) {
+    arguments.assign(req.arguments);
+
+    alpaca::arguments_t args(req.is_put);
+    if (!args.parse(arguments.data(), arguments.size())) return false;
+
+    *ok = !resource->invoke(0, req.is_put, req.operation, args).is_error();
+    return true;
+  }
+};
+
+// -- reporting
+
+struct samples_t {
+  std::vector<std::int64_t> micros;
+  std::uint64_t errors = 0;
+  std::uint64_t failures = 0;
+};
+
+using samples_map = std::map<std::string, samples_t>;
+
+static std::int64_t percentile(const std::vector<std::int64_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+
+  std::size_t index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void print_row(const char* name, samples_t* samples, double seconds) {
+  std::sort(samples->micros.begin(), samples->micros.end());
+
+  std::printf("%-34s %9zu %10.1f %8lld %8lld %8lld %7llu %7llu\n",
+    name,
+    samples->micros.size(),
+    static_cast<double>(samples->micros.size()) / seconds,
+    static_cast<long long>(percentile(samples->micros, 0.50)),
+    static_cast<long long>(percentile(samples->micros, 0.99)),
+    static_cast<long long>(percentile(samples->micros, 0.999)),
+    static_cast<unsigned long long>(samples->errors),
+    static_cast<unsigned long long>(samples->failures));
+}
+
+static void print_report(samples_map* results, double seconds) {
+  std::printf("%-34s %9s %10s %8s %8s %8s %7s %7s\n",
+    "operation", "count", "req/s", "p50us", "p99us", "p999us", "errors", "failed");
+
+  samples_t total;
+
+  for (auto& [name, samples] : *results) {
+    total.micros.insert(total.micros.end(), samples.micros.begin(), samples.micros.end());
+    total.errors += samples.errors;
+    total.failures += samples.failures;
+
+    print_row(name.c_str(), &samples, seconds);
+  }
+
+  print_row("total", &total, seconds);
+}
+
+template<typename Client>
+static void run_client(
+  Client* client, const std::string& workload, int id,
+  const std::atomic<bool>* running, samples_map* results) {
+  std::mt19937 rng(static_cast<std::uint32_t>(id) * 7919u + 1);
+
+  for (std::uint64_t n = static_cast<std::uint64_t>(id); running->load(std::memory_order_relaxed); n++) {
+    request_t req = next_request(workload, n, &rng);
+
+    auto started = std::chrono::steady_clock::now();
+    bool ok = false;
+    bool sent = client->send(req, &ok);
+    auto elapsed = std::chrono::steady_clock::now() - started;
+
+    samples_t& samples = (*results)[(req.is_put ? "PUT " : "GET ") + req.operation];
+
+    if (!sent) {
+      samples.failures++;
+      continue;
+    }
+
+    samples.micros.push_back(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    if (!ok) samples.errors++;
+  }
+}
+
+void print_help(char* cmdline) {
+  std::cout << "Usage: " << cmdline << " [options]" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Alpaca server benchmark over the simulator" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -m, --mode <string>      http or direct (default: http)" << std::endl;
+  std::cout << "  -w, --workload <string>  poll, conform or slew (default: poll)" << std::endl;
+  std::cout << "  -c, --clients <number>   Concurrent clients (default: 4)" << std::endl;
+  std::cout << "  -s, --seconds <number>   Duration (default: 10)" << std::endl;
+  std::cout << "  -p, --port <number>      Port to listen (default: 11112)" << std::endl;
+  std::cout << "  -t, --threads <number>   Http worker threads, 0 for one per connection (default: 0)" << std::endl;
+  std::cout << "  -r, --poll-rate <hz>     Telemetry poll rate, 0 disables (default: 0)" << std::endl;
+  std::cout << "  -q, --max-pending <n>    Requests admitted to the mount before busy (default: 8)" << std::endl;
+  std::cout << "  -l, --replay <path>      Replay a trace recorded by the daemon instead of the simulator" << std::endl;
+  std::cout << "  -h, --help               Display help" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  const char* short_options = "hm:w:c:s:p:t:r:q:l:";
+  const struct option long_options[] = {
+    {"help",      no_argument,       NULL, 'h'},
+    {"mode",      required_argument, NULL, 'm'},
+    {"workload",  required_argument, NULL, 'w'},
+    {"clients",   required_argument, NULL, 'c'},
+    {"seconds",   required_argument, NULL, 's'},
+    {"port",      required_argument, NULL, 'p'},
+    {"threads",   required_argument, NULL, 't'},
+    {"poll-rate", required_argument, NULL, 'r'},
+    {"max-pending", required_argument, NULL, 'q'},
+    {"replay",    required_argument, NULL, 'l'},
+    {NULL,        0,                 NULL, 0},
+  };
+
+  std::string mode = "http";
+  std::string workload = "poll";
+  int clients = 4;
+  int seconds = 10;
+  int port = 11112;
+  int threads = 0;
+  int poll_rate = 0;
+  int max_pending = 8;
+  std::string replay_path;
+
+  int next_option;
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+
+    switch (next_option) {
+      case 'm':
+        mode = optarg;
+        break;
+
+      case 'w':
+        workload = optarg;
+        break;
+
+      case 'c':
+        clients = std::max(1, alpaca::util::parse_int(optarg, clients));
+        break;
+
+      case 's':
+        seconds = std::max(1, alpaca::util::parse_int(optarg, seconds));
+        break;
+
+      case 'p':
+        port = alpaca::util::parse_int(optarg, port);
+        break;
+
+      case 't':
+        threads = alpaca::util::parse_int(optarg, threads);
+        break;
+
+      case 'r':
+        poll_rate = alpaca::util::parse_int(optarg, poll_rate);
+        break;
+
+      case 'q':
+        max_pending = alpaca::util::parse_int(optarg, max_pending);
+        break;
+
+      case 'l':
+        replay_path = optarg;
+        break;
+
+      case '?':
+      case 'h':
+        print_help(argv[0]);
+        return 0;
+    }
+  } while (next_option != -1);
+
+  // the access log would measure stdout instead of the server
+  alpaca::logger::instance().set_level(alpaca::log_level_t::quiet);
+
+  alpaca::telescopeinfo_t info = {
+    .description = "Simulator",
+    .driverinfo = "Simulator",
+    .driverversion = "0.0.1",
+    .interfaceversion = 2,
+    .name = "Simulator",
+    .alignmentmode = alpaca::alignment_mode_t::german,
+    .aperturearea = 3.14159f * 0.075f * 0.075f,
+    .aperturediameter = 0.15f,
+    .focallength = 1500,
+    .equatorialsystem = alpaca::equatorial_system_t::jnow,
+    .axisrates = {{
+      .minimum = 0,
+      .maximum = 8,
+    }},
+    .trackingrates = {
+      alpaca::driver_rate_t::sidereal,
+      alpaca::driver_rate_t::lunar,
+      alpaca::driver_rate_t::solar
+    },
+    .flags = alpaca::telescope_flags_t::can_slew_async | alpaca::telescope_flags_t::can_slew_altaz_async |
+             alpaca::telescope_flags_t::can_sync | alpaca::telescope_flags_t::can_sync_altaz |
+             alpaca::telescope_flags_t::can_set_tracking | alpaca::telescope_flags_t::can_move_axis_0 |
+             alpaca::telescope_flags_t::can_move_axis_1
+  };
+
+  std::unique_ptr<celestron::nexstar_protocol> protocol;
+
+  if (!replay_path.empty()) {
+    auto replay = std::make_unique<celestron::replay_protocol>();
+    if (!replay->load(replay_path.c_str())) {
+      std::cerr << "cannot replay " << replay_path << std::endl;
+      return 1;
+    }
+    protocol = std::move(replay);
+  } else {
+    protocol = std::make_unique<celestron::simulator_protocol>();
+  }
+
+  celestron::celestron_telescope tel0(info,
+    std::make_unique<celestron::scheduled_protocol>(std::move(protocol)));
+
+  tel0.put_connected(true);
+
+  alpaca::telemetry_options_t telemetry_options;
+  telemetry_options.interval_micros = poll_rate > 0 ? 1000000 / poll_rate : 0;
+  alpaca::telemetry_poller poller(&tel0, telemetry_options);
+
+  std::atomic<bool> running = true;
+  std::vector<samples_map> results(clients);
+  std::vector<std::thread> workers;
+
+  auto wait = [&]() {
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    running = false;
+
+    for (auto& worker : workers)
+      worker.join();
+
+    samples_map merged;
+    for (auto& result : results) {
+      for (auto& [name, samples] : result) {
+        samples_t& into = merged[name];
+        into.micros.insert(into.micros.end(), samples.micros.begin(), samples.micros.end());
+        into.errors += samples.errors;
+        into.failures += samples.failures;
+      }
+    }
+
+    std::printf("mode %s, workload %s, %d clients, %d s\n",
+      mode.c_str(), workload.c_str(), clients, seconds);
+    print_report(&merged, seconds);
+  };
+
+  if (mode == "direct") {
+    alpaca::telescope_resource resource;
+    resource.set_max_pending(max_pending);
+    resource.add_device(&tel0);
+
+    std::vector<std::unique_ptr<direct_client>> direct;
+    for (int i = 0; i < clients; i++) {
+      direct.push_back(std::make_unique<direct_client>(&resource));
+      workers.emplace_back(run_client<direct_client>,
+        direct.back().get(), workload, i, &running, &results[i]);
+    }
+
+    wait();
+    return 0;
+  }
+
+  alpaca::device_manager manager;
+  manager.set_max_pending(max_pending);
+  manager.add_telescope(&tel0);
+
+  httpserver::create_webserver config = httpserver::create_webserver(port)
+    .no_post_process();
+
+  if (threads > 0)
+    config.start_method(httpserver::http::http_utils::INTERNAL_SELECT).max_threads(threads);
+  else
+    config.start_method(httpserver::http::http_utils::THREAD_PER_CONNECTION);
+
+  httpserver::webserver ws = config;
+  manager.register_endpoint(&ws);
+
+  if (!ws.start(false)) {
+    std::cerr << "Cannot listen on port " << port << std::endl;
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<http_client>> http;
+  for (int i = 0; i < clients; i++) {
+    http.push_back(std::make_unique<http_client>(port));
+    workers.emplace_back(run_client<http_client>,
+      http.back().get(), workload, i, &running, &results[i]);
+  }
+
+  wait();
+  ws.stop();
+
+  return 0;
+}
@@ -0,0 +1,480 @@
+// Copyright (C) 2023 Marrony Neris
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <celestron/celestron.hpp>
+
+// Timings of the astronomy and NexStar codec kernels on the request path,
+// each next to its error against a double precision reference. Speedups
+// must stay inside the error budgets.
+
+using alpaca::utcdate_t;
+using alpaca::jdate_t;
+
+namespace reference {
+
+constexpr double k = M_PI / 180.0;
+
+// Meeus, Astronomical Algorithms 12.4
+double to_gmst(std::uint64_t jdate_micros) {
+  const double micros_per_day = 86400000000.0;
+  const double j2000_micros = 2451545.0 * micros_per_day;
+
+  double diff = (static_cast<double>(jdate_micros) - j2000_micros) / micros_per_day;
+  double T = diff / 36525.0;
+  double theta0 = 280.46061837 + 360.98564736629 * diff + 0.000387933 * T * T - T * T * T / 38710000.0;
+
+  double angle = std::fmod(theta0, 360.0);
+  return angle < 0.0 ? angle + 360.0 : angle;
+}
+
+static double wrap_360(double angle) {
+  angle = std::fmod(angle, 360.0);
+  return angle < 0.0 ? angle + 360.0 : angle;
+}
+
+// atan2 forms, well conditioned everywhere but at the poles; all in degrees
+void ra_de_to_azm_alt(
+  double lst, double ra, double de, double lat, double* azm, double* alt) {
+  double ha = lst - ra;
+
+  *alt = std::asin(std::sin(de*k)*std::sin(lat*k) + std::cos(de*k)*std::cos(lat*k)*std::cos(ha*k)) / k;
+  *azm = wrap_360(std::atan2(
+    -std::cos(de*k)*std::sin(ha*k),
+    std::sin(de*k)*std::cos(lat*k) - std::cos(de*k)*std::sin(lat*k)*std::cos(ha*k)) / k);
+}
+
+void azm_alt_to_ra_de(
+  double lst, double azm, double alt, double lat, double* ra, double* de) {
+  *de = std::asin(std::sin(alt*k)*std::sin(lat*k) + std::cos(alt*k)*std::cos(lat*k)*std::cos(azm*k)) / k;
+
+  double ha = std::atan2(
+    -std::cos(alt*k)*std::sin(azm*k),
+    std::sin(alt*k)*std::cos(lat*k) - std::cos(alt*k)*std::sin(lat*k)*std::cos(azm*k)) / k;
+  *ra = wrap_360(lst - ha);
+}
+
+}  // namespace reference
+
+// keeps the optimizer from dropping the measured work
+template<typename T>
+static inline void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct accuracy_t {
+  const char* name;
+  double max_error;  // arcseconds
+  double budget;
+};
+
+static std::vector<accuracy_t> accuracy;
+static int iterations = 1000000;
+
+// `items` is how many ops one call of fn does, timings are per op
+template<typename Fn>
+static void measure(const char* name, Fn&& fn, int items = 1) {
+  const int calls = std::max(iterations / items, 1);
+
+  // warm caches and branch predictors first
+  for (int i = 0; i < calls / 10; i++) fn(i);
+
+  auto started = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) fn(i);
+  auto elapsed = std::chrono::steady_clock::now() - started;
+
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count() / (static_cast<double>(calls) * items);
+  std::printf("%-36s %10.1f ns/op\n", name, ns);
+}
+
+static double arcsec(double degrees) {
+  return std::abs(degrees) * 3600.0;
+}
+
+// wraps a difference of angles in degrees to [-180, 180]
+static double angle_diff(double a, double b) {
+  double diff = std::fmod(a - b, 360.0);
+  if (diff > 180.0) diff -= 360.0;
+  if (diff < -180.0) diff += 360.0;
+  return diff;
+}
+
+// reply canned for every command, measures only the parsing side
+struct canned_protocol : celestron::nexstar_protocol {
+  const char* reply;
+
+  explicit canned_protocol(const char* reply)
+  : reply(reply) { }
+
+  virtual int send_command(const void*, int, void* out, int out_size, celestron::expect_t) override {
+    int size = std::min(out_size, static_cast<int>(std::strlen(reply)));
+    std::memcpy(out, reply, size);
+    return size;
+  }
+};
+
+void print_help(char* cmdline) {
+  std::cout << "Usage: " << cmdline << " [options]" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Astronomy and NexStar codec microbenchmarks" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -i, --iterations <number>  Iterations per kernel (default: 1000000)" << std::endl;
+  std::cout << "  -s, --strict               Exit with 1 when an error budget is exceeded" << std::endl;
+  std::cout << "  -h, --help                 Display help" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  const char* short_options = "hi:s";
+  const struct option long_options[] = {
+    {"help",       no_argument,       NULL, 'h'},
+    {"iterations", required_argument, NULL, 'i'},
+    {"strict",     no_argument,       NULL, 's'},
+    {NULL,         0,                 NULL, 0},
+  };
+
+  bool strict = false;
+
+  int next_option;
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+
+    switch (next_option) {
+      case 'i':
+        iterations = std::max(1, alpaca::util::parse_int(optarg, iterations));
+        break;
+
+      case 's':
+        strict = true;
+        break;
+
+      case '?':
+      case 'h':
+        print_help(argv[0]);
+        return 0;
+    }
+  } while (next_option != -1);
+
+  std::mt19937 rng(42);
+
+  // 2000-01-01 .. 2040-01-01
+  std::uniform_int_distribution<std::uint64_t> date_dist(946684800ull * 1000000, 2208988800ull * 1000000);
+  std::uniform_real_distribution<float> ra_dist(0.0f, 360.0f);
+  std::uniform_real_distribution<float> de_dist(-89.0f, 89.0f);
+  std::uniform_real_distribution<float> lat_dist(-60.0f, 60.0f);
+  std::uniform_real_distribution<float> lon_dist(-180.0f, 180.0f);
+
+  constexpr int samples = 4096;
+
+  struct sample_t {
+    utcdate_t utc;
+    float ra, de, lat, lon;
+  };
+
+  std::vector<sample_t> inputs(samples);
+  for (auto& in : inputs)
+    in = { utcdate_t{ date_dist(rng) }, ra_dist(rng), de_dist(rng), lat_dist(rng), lon_dist(rng) };
+
+  std::printf("timings\n");
+
+  // -- sidereal time
+
+  measure("astronomy::to_gmst", [&](int i) {
+    keep(alpaca::astronomy::to_gmst(inputs[i % samples].utc));
+  });
+
+  measure("astronomy::to_lst", [&](int i) {
+    const sample_t& in = inputs[i % samples];
+    keep(alpaca::astronomy::to_lst(in.utc, in.lon));
+  });
+
+  {
+    double max_error = 0;
+    for (const auto& in : inputs) {
+      double expected = reference::to_gmst(jdate_t::from_utc(in.utc).micros);
+      max_error = std::max(max_error, arcsec(angle_diff(alpaca::astronomy::to_gmst(in.utc), expected)));
+    }
+    accuracy.push_back({ "astronomy::to_gmst", max_error, 1.0 });
+  }
+
+  {
+    // anchored at a sample, evaluated up to an hour later as refresh() allows
+    std::uniform_int_distribution<std::int64_t> offset_dist(0, 3600ll * 1000000);
+
+    std::vector<alpaca::astronomy::observer_t> observers;
+    std::vector<utcdate_t> later;
+    for (const auto& in : inputs) {
+      observers.emplace_back(in.lat, in.lon, in.utc, alpaca::monotonic_t{0});
+      later.push_back(utcdate_t{ in.utc.micros + offset_dist(rng) });
+    }
+
+    measure("observer_t::lst", [&](int i) {
+      keep(observers[i % samples].lst(later[i % samples]));
+    });
+
+    double max_error = 0;
+    for (int i = 0; i < samples; i++) {
+      double expected = reference::to_gmst(jdate_t::from_utc(later[i]).micros) + inputs[i].lon;
+      max_error = std::max(max_error, arcsec(angle_diff(observers[i].lst(later[i]), expected)));
+    }
+    accuracy.push_back({ "observer_t::lst", max_error, 0.1 });
+  }
+
+  // -- coordinate transforms
+
+  measure("astronomy::ra_de_to_azm_alt", [&](int i) {
+    const sample_t& in = inputs[i % samples];
+    float azm, alt;
+    alpaca::astronomy::ra_de_to_azm_alt(in.utc, in.ra, in.de, in.lat, in.lon, &azm, &alt);
+    keep(azm);
+    keep(alt);
+  });
+
+  measure("astronomy::azm_alt_to_ra_de", [&](int i) {
+    const sample_t& in = inputs[i % samples];
+    float ra, de;
+    alpaca::astronomy::azm_alt_to_ra_de(in.utc, in.ra, in.de, in.lat, in.lon, &ra, &de);
+    keep(ra);
+    keep(de);
+  });
+
+  {
+    std::vector<alpaca::astronomy::observer_t> observers;
+    for (const auto& in : inputs)
+      observers.emplace_back(in.lat, in.lon);
+
+    measure("astronomy::ra_de_to_azm_alt, observer", [&](int i) {
+      const sample_t& in = inputs[i % samples];
+      float azm, alt;
+      alpaca::astronomy::ra_de_to_azm_alt(observers[i % samples], in.ra, in.de, &azm, &alt);
+      keep(azm);
+      keep(alt);
+    });
+  }
+
+  {
+    std::vector<float> ra(samples), de(samples), azm(samples), alt(samples);
+    for (int i = 0; i < samples; i++) {
+      ra[i] = inputs[i].ra;
+      de[i] = inputs[i].de;
+    }
+
+    const sample_t& site = inputs[0];
+
+    measure("astronomy::ra_de_to_azm_alt, batch", [&](int) {
+      alpaca::astronomy::ra_de_to_azm_alt(site.utc, ra, de, site.lat, site.lon, azm, alt);
+      keep(azm[0]);
+    }, samples);
+
+    measure("astronomy::azm_alt_to_ra_de, batch", [&](int) {
+      alpaca::astronomy::azm_alt_to_ra_de(site.utc, ra, de, site.lat, site.lon, azm, alt);
+      keep(azm[0]);
+    }, samples);
+  }
+
+  {
+    // the kernels take sidereal time from their own to_gmst, the reference
+    // uses the same lst so only the transform itself is compared
+    double max_azm_alt = 0;
+    double max_ra_de = 0;
+
+    for (const auto& in : inputs) {
+      double lst = alpaca::astronomy::to_lst(in.utc, in.lon);
+
+      float azm, alt;
+      alpaca::astronomy::ra_de_to_azm_alt(in.utc, in.ra, in.de, in.lat, in.lon, &azm, &alt);
+
+      double ref_azm, ref_alt;
+      reference::ra_de_to_azm_alt(lst, in.ra, in.de, in.lat, &ref_azm, &ref_alt);
+
+      // azimuth is singular at the poles of the horizon
+      if (std::abs(ref_alt) < 85.0) {
+        max_azm_alt = std::max(max_azm_alt, arcsec(angle_diff(azm, ref_azm)));
+      }
+      max_azm_alt = std::max(max_azm_alt, arcsec(alt - ref_alt));
+
+      float ra, de;
+      alpaca::astronomy::azm_alt_to_ra_de(in.utc, in.ra, in.de, in.lat, in.lon, &ra, &de);
+
+      double ref_ra, ref_de;
+      reference::azm_alt_to_ra_de(lst, in.ra, in.de, in.lat, &ref_ra, &ref_de);
+
+      if (std::abs(ref_de) < 85.0) {
+        max_ra_de = std::max(max_ra_de, arcsec(angle_diff(ra, ref_ra)));
+      }
+      max_ra_de = std::max(max_ra_de, arcsec(de - ref_de));
+    }
+
+    accuracy.push_back({ "astronomy::ra_de_to_azm_alt", max_azm_alt, 1.0 });
+    accuracy.push_back({ "astronomy::azm_alt_to_ra_de", max_ra_de, 1.0 });
+  }
+
+  // -- angle formatting
+
+  measure("astronomy::dms_t", [&](int i) {
+    keep(alpaca::astronomy::dms_t(inputs[i % samples].de));
+  });
+
+  {
+    double max_error = 0;
+    for (const auto& in : inputs) {
+      alpaca::astronomy::dms_t dms(in.de);
+      max_error = std::max(max_error, arcsec(static_cast<double>(dms.to_decimal()) - in.de));
+    }
+    // rounded to whole seconds
+    accuracy.push_back({ "astronomy::dms_t", max_error, 0.5 + 0.05 });
+  }
+
+  // -- nexstar codec
+
+  celestron::simulator_protocol codec;
+
+  measure("nexstar_to_degree", [&](int i) {
+    keep(codec.nexstar_to_degree(static_cast<std::uint32_t>(i) * 2654435761u, true));
+  });
+
+  measure("degree_to_nexstar", [&](int i) {
+    keep(codec.degree_to_nexstar(inputs[i % samples].ra, true));
+  });
+
+  {
+    double max_precise = 0;
+    double max_coarse = 0;
+
+    for (const auto& in : inputs) {
+      double ref = in.ra;
+
+      std::uint32_t precise = codec.degree_to_nexstar(in.ra, true);
+      max_precise = std::max(max_precise, arcsec(angle_diff(codec.nexstar_to_degree(precise, true), ref)));
+
+      std::uint32_t coarse = codec.degree_to_nexstar(in.ra, false);
+      max_coarse = std::max(max_coarse, arcsec(angle_diff(codec.nexstar_to_degree(coarse, false), ref)));
+    }
+
+    // a step is 360/2^32 or 360/2^16 degrees, but a float angle near 360
+    // only resolves ~0.08 arcseconds, and encoding truncates
+    accuracy.push_back({ "nexstar codec, precise", max_precise, 0.2 });
+    accuracy.push_back({ "nexstar codec, coarse", max_coarse, 360.0 * 3600.0 / 65536.0 });
+  }
+
+  canned_protocol precise_reply("34AB0500,12CE0500#");
+  canned_protocol coarse_reply("34AB,12CE#");
+
+  measure("get_ra_de, precise reply", [&](int) {
+    alpaca::coord_t coord(0, 0);
+    keep(precise_reply.get_ra_de(&coord, true));
+    keep(coord);
+  });
+
+  measure("get_ra_de, coarse reply", [&](int) {
+    alpaca::coord_t coord(0, 0);
+    keep(coarse_reply.get_ra_de(&coord, false));
+    keep(coord);
+  });
+
+  {
+    alpaca::coord_t coord(0, 0);
+    double error = 360.0;
+
+    if (precise_reply.get_ra_de(&coord, true)) {
+      double ra = 0x34AB0500 * (360.0 / 4294967296.0) / 15.0;
+      double de = 0x12CE0500 * (360.0 / 4294967296.0);
+      error = std::max(arcsec((coord.rightascension - ra) * 15.0), arcsec(coord.declination - de));
+    }
+
+    accuracy.push_back({ "get_ra_de parse", error, 0.1 });
+  }
+
+  // -- simulator guiding
+
+  {
+    // overlapping pulses, RA runs 500 ms and Dec 700 ms with 300 ms of both,
+    // each axis has to move by rate * duration. A stopped clock only moves
+    // when advanced, in whole ticks.
+    auto clock = std::make_shared<alpaca::virtual_clock_t>(0.0);
+    celestron::simulator_protocol mount(clock);
+
+    // 30 steps of 1/4 arcsecond per second, about half sidereal
+    const double rate = 30.0 / (3600.0 * 4);
+
+    alpaca::coord_t before(0, 0);
+    alpaca::coord_t after(0, 0);
+    bool ok = mount.get_ra_de(&before, true);
+
+    ok &= mount.slew_variable(alpaca::move_t(0, static_cast<float>(rate)));
+    clock->advance(200000);
+    ok &= mount.slew_variable(alpaca::move_t(1, static_cast<float>(rate)));
+    clock->advance(300000);
+    ok &= mount.slew_variable(alpaca::move_t(0, 0.0f));
+    clock->advance(400000);
+    ok &= mount.slew_variable(alpaca::move_t(1, 0.0f));
+    clock->advance(100000);
+
+    ok &= mount.get_ra_de(&after, true);
+
+    double ra_error = 360.0;
+    double de_error = 360.0;
+    if (ok) {
+      double ra_moved = angle_diff(after.rightascension * 15.0, before.rightascension * 15.0);
+      double de_moved = angle_diff(after.declination, before.declination);
+
+      ra_error = arcsec(std::abs(ra_moved) - rate * 0.5);
+      de_error = arcsec(std::abs(de_moved) - rate * 0.7);
+    }
+
+    // a float angle resolves ~0.03 arcseconds at 180 degrees
+    accuracy.push_back({ "simulator guide pulse, RA", ra_error, 0.1 });
+    accuracy.push_back({ "simulator guide pulse, Dec", de_error, 0.1 });
+  }
+
+  // -- utc dates
+
+  measure("utcdate_t::format_utc", [&](int i) {
+    keep(inputs[i % samples].utc.format_utc());
+  });
+
+  std::vector<std::string> formatted;
+  for (const auto& in : inputs)
+    formatted.push_back(in.utc.format_utc());
+
+  measure("utcdate_t::parse_utc", [&](int i) {
+    keep(utcdate_t::parse_utc(formatted[i % samples]));
+  });
+
+  {
+    double max_error = 0;
+    for (int i = 0; i < samples; i++) {
+      auto parsed = utcdate_t::parse_utc(formatted[i]);
+      double truncated = static_cast<double>(inputs[i].utc.micros / 1000000);
+
+      double error = parsed.is_error()
+        ? 1e9
+        : std::abs(static_cast<double>(parsed.get().micros / 1000000) - truncated);
+
+      max_error = std::max(max_error, error);
+    }
+    accuracy.push_back({ "utcdate_t round trip (seconds)", max_error, 0.0 });
+  }
+
+  std::printf("\naccuracy, max error in arcseconds\n");
+
+  bool over_budget = false;
+  for (const auto& a : accuracy) {
+    bool ok = a.max_error <= a.budget;
+    over_budget |= !ok;
+
+    std::printf("%-36s %12.4f  budget %10.4f  %s\n", a.name, a.max_error, a.budget, ok ? "ok" : "OVER BUDGET");
+  }
+
+  return strict && over_budget ? 1 : 0;
+}
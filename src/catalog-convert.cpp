@@ -0,0 +1,128 @@
+// Copyright (C) 2023 Marrony Neris
+
+#include <getopt.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <resource.hpp>
+#include <catalog.hpp>
+#include <parser.hpp>
+#include <util.hpp>
+
+// Converts a CSV catalog into the mapped format the daemon loads with
+// --catalog. One object per line: name,ra,dec,magnitude with right
+// ascension in decimal hours and declination in decimal degrees. Lines
+// starting with '#' and lines that do not parse (a header) are skipped.
+
+void print_help(char* cmdline) {
+  std::cout << "Usage: " << cmdline << " [options]" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Builds a binary object catalog from CSV" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -i, --input <path>     CSV input, name,ra_hours,dec_degrees,magnitude" << std::endl;
+  std::cout << "  -o, --output <path>    Catalog output" << std::endl;
+  std::cout << "  -b, --bands <number>   Declination bands (default: 180)" << std::endl;
+  std::cout << "  -h, --help             Display help" << std::endl;
+}
+
+static bool parse_line(std::string_view line, alpaca::catalog_entry_t* entry) {
+  auto columns = alpaca::util::split(line, ",");
+  if (columns.size() < 4) return false;
+
+  alpaca::parser::conversor<float> to_float;
+
+  auto ra = to_float.conv(columns[1]);
+  auto de = to_float.conv(columns[2]);
+  auto magnitude = to_float.conv(columns[3]);
+
+  if (ra.is_error() || de.is_error() || magnitude.is_error()) return false;
+  if (ra.get() < 0.0f || ra.get() > 24.0f || de.get() < -90.0f || de.get() > 90.0f) return false;
+
+  entry->name = columns[0];
+  entry->rightascension = ra.get() * 15.0f;
+  entry->declination = de.get();
+  entry->magnitude = magnitude.get();
+
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const char* short_options = "hi:o:b:";
+  const struct option long_options[] = {
+    {"help",   no_argument,       NULL, 'h'},
+    {"input",  required_argument, NULL, 'i'},
+    {"output", required_argument, NULL, 'o'},
+    {"bands",  required_argument, NULL, 'b'},
+    {NULL,     0,                 NULL, 0},
+  };
+
+  std::string input;
+  std::string output;
+  int bands = 180;
+
+  int next_option;
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+
+    switch (next_option) {
+      case 'i':
+        input = optarg;
+        break;
+
+      case 'o':
+        output = optarg;
+        break;
+
+      case 'b':
+        bands = alpaca::util::parse_int(optarg, bands);
+        break;
+
+      case '?':
+      case 'h':
+        print_help(argv[0]);
+        return 0;
+    }
+  } while (next_option != -1);
+
+  if (input.empty() || output.empty() || bands <= 0) {
+    print_help(argv[0]);
+    return 1;
+  }
+
+  std::ifstream file(input);
+  if (!file) {
+    std::cerr << "cannot read " << input << std::endl;
+    return 1;
+  }
+
+  std::vector<alpaca::catalog_entry_t> entries;
+  std::size_t skipped = 0;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') continue;
+
+    alpaca::catalog_entry_t entry;
+    if (parse_line(line, &entry))
+      entries.push_back(std::move(entry));
+    else
+      skipped++;
+  }
+
+  std::size_t count = entries.size();
+
+  if (!alpaca::write_catalog(output.c_str(), std::move(entries), static_cast<std::uint32_t>(bands))) {
+    std::cerr << "cannot write " << output << std::endl;
+    return 1;
+  }
+
+  std::cout << count << " objects in " << bands << " bands, " << skipped << " lines skipped" << std::endl;
+
+  return 0;
+}